@@ -0,0 +1,335 @@
+// aggregator.cpp : Sensor values summarised over a window, one record per window instead of every sample
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "common.h"
+
+void P2Quantile::reset(float quantile)
+{ // start again, the markers are seeded from the first five samples
+  _p = quantile;
+  _count = 0;
+}
+
+void P2Quantile::add(float x)
+{ // move the markers towards where the quantile and its neighbours should be, bending them along a parabola where that fits
+  if (_count < 5)
+  { // keep the first five, in order
+    uint8_t i = _count++;
+    while ((i > 0) && (_q[i - 1] > x))
+    {
+      _q[i] = _q[i - 1];
+      i--;
+    }
+    _q[i] = x;
+    if (_count == 5)
+    {
+      for (uint8_t m = 0; m < 5; m++)
+      {
+        _n[m] = m;
+      }
+      _np[0] = 0;
+      _np[1] = 2 * _p;
+      _np[2] = 4 * _p;
+      _np[3] = 2 + 2 * _p;
+      _np[4] = 4;
+      _dn[0] = 0;
+      _dn[1] = _p / 2;
+      _dn[2] = _p;
+      _dn[3] = (1 + _p) / 2;
+      _dn[4] = 1;
+    }
+    return;
+  }
+  _count++;
+
+  uint8_t k;
+  if (x < _q[0])
+  {
+    _q[0] = x;
+    k = 0;
+  }
+  else if (x >= _q[4])
+  {
+    _q[4] = x;
+    k = 3;
+  }
+  else
+  {
+    k = 0;
+    while (x >= _q[k + 1])
+    {
+      k++;
+    }
+  }
+  for (uint8_t m = k + 1; m < 5; m++)
+  {
+    _n[m] += 1;
+  }
+  for (uint8_t m = 0; m < 5; m++)
+  {
+    _np[m] += _dn[m];
+  }
+
+  for (uint8_t m = 1; m < 4; m++)
+  {
+    const float d = _np[m] - _n[m];
+    if (((d >= 1) && ((_n[m + 1] - _n[m]) > 1)) || ((d <= -1) && ((_n[m - 1] - _n[m]) < -1)))
+    {
+      const float s = (d > 0) ? 1 : -1;
+      const float parabolic = _q[m] + s / (_n[m + 1] - _n[m - 1]) *
+                                          ((_n[m] - _n[m - 1] + s) * (_q[m + 1] - _q[m]) / (_n[m + 1] - _n[m]) +
+                                           (_n[m + 1] - _n[m] - s) * (_q[m] - _q[m - 1]) / (_n[m] - _n[m - 1]));
+      if ((_q[m - 1] < parabolic) && (parabolic < _q[m + 1]))
+      {
+        _q[m] = parabolic;
+      }
+      else
+      { // linear towards the neighbour instead
+        const uint8_t neighbour = (s > 0) ? m + 1 : m - 1;
+        _q[m] += s * (_q[neighbour] - _q[m]) / (_n[neighbour] - _n[m]);
+      }
+      _n[m] += s;
+    }
+  }
+}
+
+float P2Quantile::get(void)
+{ // the middle marker, or straight from the samples while there are too few for markers
+  if (_count >= 5)
+  {
+    return _q[2];
+  }
+  if (_count == 0)
+  {
+    return 0;
+  }
+  return _q[(uint8_t)(_p * (_count - 1) + 0.5f)];
+}
+
+void Aggregator::begin()
+{ // called in the main code setup, handles our initialisation
+  _windows = 0;
+  _dropped = 0;
+  _alive = true;
+  applyConfig();
+}
+
+void Aggregator::loop()
+{ // called in the main code loop, handles our periodic code
+  const uint32_t now = millis();
+  const bool connected = mqtt.clientIsConnected();
+  for (uint8_t i = 0; i < _metricCount; i++)
+  {
+    AggregateMetric &metric = _metrics[i];
+    if (metric.held && connected)
+    {
+      _publish(metric);
+    }
+    const uint32_t window = _specs[metric.spec].window;
+    if ((now - metric.startedAt) < window)
+    {
+      continue;
+    }
+    if (metric.count != 0)
+    {
+      _close(metric);
+      if (connected)
+      {
+        _publish(metric);
+      }
+    }
+    // windows stay on their boundaries unless we have missed a whole one
+    metric.startedAt += window;
+    if ((now - metric.startedAt) >= window)
+    {
+      metric.startedAt = now;
+    }
+    _start(metric, metric.startedAt);
+  }
+}
+
+void Aggregator::applyConfig()
+{ // parse the sensorWindows setting, dropping windows in progress if it or duty cycling has changed
+  if (!_alive || ((strcmp(_source, config.getSensorWindows()) == 0) && (_dutyCycling == power.isDutyCycling())))
+  {
+    return;
+  }
+  strncpy(_source, config.getSensorWindows(), sizeof(_source));
+  _source[sizeof(_source) - 1] = '\0';
+  _dutyCycling = power.isDutyCycling();
+  _specCount = 0;
+  _metricCount = 0;
+  if (_dutyCycling && (_source[0] != '\0'))
+  { // a window kept in RAM is lost at every sleep, better every sample goes out as it is
+    debug.printLn(F("SENSOR: [ERROR] sensor windows are ignored while duty cycling"));
+    return;
+  }
+
+  char text[sizeof(_source)];
+  memcpy(text, _source, sizeof(text));
+  char *save;
+  for (char *spec = strtok_r(text, " ,", &save); spec != nullptr; spec = strtok_r(nullptr, " ,", &save))
+  {
+    if (_specCount == AGGREGATE_SPECS)
+    {
+      debug.printLn(String(F("SENSOR: [ERROR] only ")) + String(AGGREGATE_SPECS) + String(F(" sensor windows fit")));
+      break;
+    }
+    if (!_parseSpec(spec))
+    {
+      debug.printLn(String(F("SENSOR: [ERROR] cannot understand sensor window ")) + String(spec));
+    }
+  }
+  debug.printLn(String(F("SENSOR: ")) + String(_specCount) + String(F(" sensor windows")));
+}
+
+bool Aggregator::_parseSpec(char *text)
+{ // <sensor>.<value>=<seconds>[/p<percentile>]
+  char *dot = strchr(text, '.');
+  char *equals = strchr(text, '=');
+  if ((dot == nullptr) || (equals == nullptr) || (equals < dot) ||
+      ((size_t)(dot - text) >= sizeof(AggregateSpec::sensor)) || ((size_t)(equals - dot - 1) >= sizeof(AggregateSpec::value)))
+  {
+    return false;
+  }
+  AggregateSpec &spec = _specs[_specCount];
+  *dot = '\0';
+  *equals = '\0';
+  strcpy(spec.sensor, text);
+  strcpy(spec.value, dot + 1);
+  char *end;
+  const uint32_t seconds = strtoul(equals + 1, &end, 10);
+  spec.percentile = 0;
+  if (strncmp(end, "/p", 2) == 0)
+  {
+    spec.percentile = strtoul(end + 2, &end, 10);
+    if ((spec.percentile == 0) || (spec.percentile > 99))
+    {
+      return false;
+    }
+  }
+  if ((*end != '\0') || (seconds == 0) || (spec.sensor[0] == '\0') || (spec.value[0] == '\0'))
+  {
+    return false;
+  }
+  spec.window = seconds * ASECOND;
+  _specCount++;
+  return true;
+}
+
+int8_t Aggregator::_findSpec(SensorDriver *driver, uint8_t value)
+{ // the first spec naming this value, -1 for none
+  for (uint8_t i = 0; i < _specCount; i++)
+  {
+    if ((strcmp(_specs[i].sensor, driver->name()) == 0) &&
+        ((strcmp(_specs[i].value, "*") == 0) || (strcmp(_specs[i].value, driver->valueName(value)) == 0)))
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool Aggregator::add(SensorDriver *driver, uint8_t value, float sample)
+{ // fold a sample into its window, starting one on the value's first sample
+  if (_specCount == 0)
+  {
+    return false;
+  }
+  AggregateMetric *metric = nullptr;
+  for (uint8_t i = 0; i < _metricCount; i++)
+  {
+    if ((_metrics[i].driver == driver) && (_metrics[i].value == value))
+    {
+      metric = &_metrics[i];
+      break;
+    }
+  }
+  if (metric == nullptr)
+  {
+    const int8_t spec = _findSpec(driver, value);
+    if (spec < 0)
+    {
+      return false;
+    }
+    if (_metricCount == AGGREGATE_METRICS)
+    { // better every sample than none
+      return false;
+    }
+    metric = &_metrics[_metricCount++];
+    metric->driver = driver;
+    metric->value = value;
+    metric->spec = spec;
+    metric->held = false;
+    _start(*metric, millis());
+  }
+
+  if (metric->count == 0)
+  {
+    metric->minimum = sample;
+    metric->maximum = sample;
+    metric->mean = sample;
+  }
+  else
+  {
+    metric->minimum = min(metric->minimum, sample);
+    metric->maximum = max(metric->maximum, sample);
+    metric->mean += (sample - metric->mean) / (metric->count + 1);
+  }
+  metric->count++;
+  metric->last = sample;
+  if (_specs[metric->spec].percentile != 0)
+  {
+    metric->quantile.add(sample);
+  }
+  return true;
+}
+
+void Aggregator::_start(AggregateMetric &metric, uint32_t now)
+{ // an empty window from now
+  metric.startedAt = now;
+  metric.count = 0;
+  metric.quantile.reset(_specs[metric.spec].percentile / 100.0f);
+}
+
+void Aggregator::_close(AggregateMetric &metric)
+{ // keep the window that has just ended until it can be published, the newest wins if the broker is still away
+  if (metric.held)
+  {
+    _dropped++;
+  }
+  AggregateRecord &closed = metric.closed;
+  closed.startedAt = metric.startedAt;
+  closed.count = metric.count;
+  closed.minimum = metric.minimum;
+  closed.maximum = metric.maximum;
+  closed.mean = metric.mean;
+  closed.last = metric.last;
+  closed.quantile = metric.quantile.get();
+  metric.held = true;
+}
+
+void Aggregator::_publish(AggregateMetric &metric)
+{ // one record for the closed window on <Sensor Topic>/<sensor>/<value>, stamped with when it began; straight to MQTT,
+  // the records are too big for the queue Power keeps across deep sleep
+  const AggregateSpec &spec = _specs[metric.spec];
+  const AggregateRecord &closed = metric.closed;
+  ScratchString subtopic;
+  subtopic.add('/').add(metric.driver->name()).add('/').add(metric.driver->valueName(metric.value));
+  ScratchString payload;
+  char number[24];
+  payload.add(F("{\"")).add(timeSync.key()).add(F("\":")).add(timeSync.format(closed.startedAt, number, sizeof(number)));
+  payload.add(F(",\"n\":")).add(closed.count);
+  payload.add(F(",\"min\":")).add(dtostrf(closed.minimum, 1, 2, number));
+  payload.add(F(",\"max\":")).add(dtostrf(closed.maximum, 1, 2, number));
+  payload.add(F(",\"mean\":")).add(dtostrf(closed.mean, 1, 2, number));
+  payload.add(F(",\"last\":")).add(dtostrf(closed.last, 1, 2, number));
+  if (spec.percentile != 0)
+  {
+    payload.add(F(",\"p")).add(spec.percentile).add(F("\":")).add(dtostrf(closed.quantile, 1, 2, number));
+  }
+  payload.add('}');
+  mqtt.publishSensorSubTopic(subtopic.c_str(), payload.c_str());
+  metric.held = false;
+  _windows++;
+}
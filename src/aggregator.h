@@ -0,0 +1,119 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+#include "config.h"
+
+class SensorDriver;
+
+// Streaming estimate of one quantile in five markers, Jain and Chlamtac's P-square algorithm: O(1) memory, no samples kept
+class P2Quantile
+{
+public:
+    void reset(float quantile);
+    void add(float x);
+    float get(void);
+
+protected:
+    float _p;       // the quantile, 0..1
+    uint32_t _count;
+    float _q[5];    // marker heights, _q[2] is the estimate
+    float _n[5];    // marker positions
+    float _np[5];   // desired positions
+    float _dn[5];   // desired position increments
+};
+
+// Which sensor values are aggregated, from the sensorWindows setting
+struct AggregateSpec
+{
+    char sensor[16];
+    char value[16]; // "*" for all of the sensor's values
+    uint32_t window; // msec
+    uint8_t percentile; // 1..99 to estimate that percentile, 0 for none
+};
+
+// A closed window, kept until the broker is there to take it
+struct AggregateRecord
+{
+    uint32_t startedAt; // millis() the window began
+    uint32_t count;
+    float minimum;
+    float maximum;
+    float mean;
+    float last;
+    float quantile;
+};
+
+// One value's window in progress
+struct AggregateMetric
+{
+    SensorDriver *driver;
+    uint8_t value;     // index into the driver's values
+    uint8_t spec;      // into the specs
+    uint32_t startedAt; // millis() the window began
+    uint32_t count;
+    float minimum;
+    float maximum;
+    float mean;        // running, so there's no sum to lose precision in
+    float last;
+    P2Quantile quantile;
+    bool held;             // closed holds a window the broker hasn't had yet
+    AggregateRecord closed;
+};
+
+class Aggregator
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    Aggregator(void)
+    {
+        _alive = false;
+        _specCount = 0;
+        _metricCount = 0;
+        _dutyCycling = false;
+        _source[0] = '\0';
+    }
+
+    // destructor
+    ~Aggregator(void) { _alive = false; }
+
+    void begin();
+    void loop();
+    void applyConfig();
+
+    // take a sample into its window, false if the value isn't aggregated and should go out as it is
+    bool add(SensorDriver *driver, uint8_t value, float sample);
+
+    uint32_t getWindows(void) { return _windows; }
+    uint32_t getDropped(void) { return _dropped; }
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    bool _alive;
+    char _source[sizeof(((ConfigData *)nullptr)->sensorWindows)]; // the setting the specs were parsed from
+    AggregateSpec _specs[AGGREGATE_SPECS];
+    AggregateMetric _metrics[AGGREGATE_METRICS];
+    uint8_t _specCount;
+    uint8_t _metricCount;
+    bool _dutyCycling; // when the specs were parsed, windows don't survive deep sleep so there are none
+    uint32_t _windows; // records published since boot
+    uint32_t _dropped; // closed windows replaced by the next before the broker came back
+
+    bool _parseSpec(char *text);
+    int8_t _findSpec(SensorDriver *driver, uint8_t value);
+    void _start(AggregateMetric &metric, uint32_t now);
+    void _close(AggregateMetric &metric);
+    void _publish(AggregateMetric &metric);
+
+#pragma endregion Protected
+};
@@ -0,0 +1,155 @@
+// buttons.cpp : GPIO edges captured in the interrupt, debounced and published from loop()
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "common.h"
+
+// keeps the ring's entry and index writes in order as the other side sees them
+#ifdef ESP_32
+#define BUTTON_BARRIER() __sync_synchronize()
+#elif defined(ESP_8266)
+#define BUTTON_BARRIER() __asm__ __volatile__("" ::: "memory") // one core, only the compiler can reorder
+#endif
+
+// histogram bucket upper bounds, in usec for counting; metrics.cpp labels them in seconds
+static const uint32_t buttonLatencyBoundsUs[BUTTON_LATENCY_BUCKETS] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000};
+
+void Buttons::begin()
+{ // called in the main code setup, handles our initialisation
+  _events = 0;
+  _bounces = 0;
+  _latencySumUs = 0;
+  memset(_latencyBuckets, 0, sizeof(_latencyBuckets));
+#if BUTTON_DEFAULT_PIN >= 0
+  add(BUTTON_DEFAULT_PIN, 0, 1, true);
+#endif
+  _alive = true;
+}
+
+void Buttons::loop()
+{ // called in the main code loop, handles our periodic code
+  if (!_alive || (_count == 0))
+  {
+    return;
+  }
+  ButtonEdge edge;
+  while (_pop(edge))
+  {
+    _edge(edge);
+  }
+  for (uint8_t i = 0; i < _count; i++)
+  {
+    if (_slots[i].settling && ((micros() - _slots[i].acceptedAt) >= BUTTON_DEBOUNCE))
+    {
+      _settle(_slots[i]);
+    }
+  }
+}
+
+bool Buttons::add(uint8_t pin, uint8_t page, uint8_t id, bool activeLow)
+{ // watch a pin, taking its current level as the starting state
+  if (_count == BUTTON_SLOTS)
+  {
+    debug.printLn(String(F("BUTTON: [ERROR] no room for pin ")) + String(pin));
+    return false;
+  }
+  ButtonSlot &slot = _slots[_count];
+  slot.pin = pin;
+  slot.page = page;
+  slot.id = id;
+  slot.activeLow = activeLow;
+  slot.settling = false;
+  pinMode(pin, activeLow ? INPUT_PULLUP : INPUT);
+  slot.pressed = _pressed(slot, digitalRead(pin));
+  slot.acceptedAt = micros();
+  slot.lastEdgeAt = slot.acceptedAt;
+  attachInterruptArg(digitalPinToInterrupt(pin), _interrupt, (void *)(uintptr_t)_count, CHANGE);
+  _count++;
+  debug.printLn(String(F("BUTTON: pin ")) + String(pin) + String(F(" is p[")) + String(page) + String(F("].b[")) + String(id) + String(F("]")));
+  return true;
+}
+
+void IRAM_ATTR Buttons::_interrupt(void *arg)
+{ // every watched pin lands here, arg is its slot
+  buttons._capture((uint8_t)(uintptr_t)arg);
+}
+
+void IRAM_ATTR Buttons::_capture(uint8_t index)
+{ // the producer: timestamp the edge and push it, never block and never touch the heap
+  const uint32_t at = micros();
+  const uint16_t head = _head;
+  if ((uint16_t)(head - _tail) == BUTTON_QUEUE_SIZE)
+  { // loop() has fallen this far behind, the state is re-read when it settles anyway
+    _dropped = _dropped + 1;
+    return;
+  }
+  ButtonEdge &edge = _queue[head & (BUTTON_QUEUE_SIZE - 1)];
+  edge.at = at;
+  edge.index = index;
+  edge.level = digitalRead(_slots[index].pin);
+  BUTTON_BARRIER(); // the entry is complete before it is published
+  _head = head + 1;
+}
+
+bool Buttons::_pop(ButtonEdge &edge)
+{ // the consumer: take the oldest edge, if there is one
+  const uint16_t tail = _tail;
+  if (tail == _head)
+  {
+    return false;
+  }
+  BUTTON_BARRIER(); // read the entry only after seeing it published
+  edge = _queue[tail & (BUTTON_QUEUE_SIZE - 1)];
+  BUTTON_BARRIER(); // and finish reading it before handing the slot back
+  _tail = tail + 1;
+  return true;
+}
+
+void Buttons::_edge(const ButtonEdge &edge)
+{ // the first edge of a change is published straight away, what follows within BUTTON_DEBOUNCE is bounce
+  ButtonSlot &slot = _slots[edge.index];
+  slot.lastEdgeAt = edge.at;
+  if (slot.settling && ((edge.at - slot.acceptedAt) < BUTTON_DEBOUNCE))
+  {
+    _bounces++;
+    return;
+  }
+  slot.settling = false;
+  const bool pressed = _pressed(slot, edge.level);
+  if (pressed != slot.pressed)
+  {
+    _accept(slot, pressed, edge.at);
+  }
+}
+
+void Buttons::_settle(ButtonSlot &slot)
+{ // the bounce is over: if the pin ended up somewhere else, e.g. a tap shorter than the debounce, that is a change too
+  slot.settling = false;
+  const bool pressed = _pressed(slot, digitalRead(slot.pin));
+  if (pressed != slot.pressed)
+  {
+    _accept(slot, pressed, slot.lastEdgeAt);
+  }
+}
+
+void Buttons::_accept(ButtonSlot &slot, bool pressed, uint32_t at)
+{ // publish a debounced change and time it from the edge that caused it
+  slot.pressed = pressed;
+  slot.acceptedAt = at;
+  slot.settling = true;
+  _events++;
+  rules.buttonChanged(slot.page, slot.id, pressed); // before the broker hears of it, local reactions don't wait on the network
+
+  const String state = pressed ? F("ON") : F("OFF");
+  mqtt.publishButtonEvent(String(slot.page), String(slot.id), state);
+  mqtt.publishButtonJSONEvent(String(slot.page), String(slot.id), state);
+
+  const uint32_t latency = micros() - at;
+  _latencySumUs += latency;
+  uint8_t bucket = 0;
+  while ((bucket < BUTTON_LATENCY_BUCKETS) && (latency > buttonLatencyBoundsUs[bucket]))
+  {
+    bucket++;
+  }
+  _latencyBuckets[bucket]++;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+
+#define BUTTON_LATENCY_BUCKETS (11) // edge to publish histogram buckets, plus one implicit +Inf bucket
+
+static_assert((BUTTON_QUEUE_SIZE & (BUTTON_QUEUE_SIZE - 1)) == 0, "BUTTON_QUEUE_SIZE must be a power of two");
+
+// One edge as the interrupt saw it
+struct ButtonEdge
+{
+    uint32_t at;   // micros() in the interrupt
+    uint8_t index; // into the button slots
+    uint8_t level; // pin level just after the edge
+};
+
+// A button or contact on a GPIO, published as p[page].b[id] like a panel button
+struct ButtonSlot
+{
+    uint8_t pin;
+    uint8_t page;
+    uint8_t id;
+    bool activeLow;     // pressed pulls the pin low, so it gets the pullup
+    bool pressed;       // debounced state, as last published
+    bool settling;      // an edge was accepted less than BUTTON_DEBOUNCE ago, further edges are bounce
+    uint32_t acceptedAt; // micros() of the edge that was accepted
+    uint32_t lastEdgeAt; // micros() of the latest edge, accepted or not
+};
+
+class Buttons
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    Buttons(void)
+    {
+        _alive = false;
+        _count = 0;
+        _head = 0;
+        _tail = 0;
+        _dropped = 0;
+    }
+
+    // destructor
+    ~Buttons(void) { _alive = false; }
+
+    void begin();
+    void loop();
+
+    // watch a pin, its edges are captured from then on
+    bool add(uint8_t pin, uint8_t page, uint8_t id, bool activeLow);
+
+    uint8_t getCount(void) { return _count; }
+    uint32_t getEvents(void) { return _events; }
+    uint32_t getBounces(void) { return _bounces; }
+    uint32_t getDropped(void) { return _dropped; }
+    const uint32_t *getLatencyBuckets(void) { return _latencyBuckets; }
+    uint32_t getLatencySumUs(void) { return _latencySumUs; }
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    bool _alive;
+    ButtonSlot _slots[BUTTON_SLOTS];
+    uint8_t _count;
+
+    // single producer (the interrupt), single consumer (loop) ring: each index is written by one side only
+    ButtonEdge _queue[BUTTON_QUEUE_SIZE];
+    volatile uint16_t _head; // next slot the interrupt fills
+    volatile uint16_t _tail; // next slot loop() empties
+    volatile uint32_t _dropped; // edges lost to a full ring
+
+    uint32_t _events;  // debounced changes published
+    uint32_t _bounces; // edges ignored as bounce
+    uint32_t _latencyBuckets[BUTTON_LATENCY_BUCKETS + 1]; // non-cumulative edge to publish histogram, last slot is +Inf
+    uint32_t _latencySumUs;
+
+    static void _interrupt(void *arg);
+    void _capture(uint8_t index);
+    bool _pop(ButtonEdge &edge);
+    void _edge(const ButtonEdge &edge);
+    void _settle(ButtonSlot &slot);
+    void _accept(ButtonSlot &slot, bool pressed, uint32_t at);
+    bool _pressed(const ButtonSlot &slot, uint8_t level) { return slot.activeLow ? (level == LOW) : (level == HIGH); }
+
+#pragma endregion Protected
+};
@@ -23,11 +23,47 @@ COMMON_EXTERN Config config;
 #include "debug.h"
 COMMON_EXTERN Debug debug;
 
+#include "scratch.h"
+COMMON_EXTERN Scratch scratch; // our per loop() scratch arena
+
+#include "heapTrace.h"
+COMMON_EXTERN HeapTrace heapTrace; // our count of allocations after setup()
+
+#include "heapMonitor.h"
+COMMON_EXTERN HeapMonitor heapMonitor; // our heap health and trend alerts
+
 #include "esp.h"
 COMMON_EXTERN Esp esp;  // our ESP8266 Micro/SoC
 
 #include "mqttSvc.h"
 COMMON_EXTERN MqttSvc mqtt;  // our MQTT Object
 
+#include "ota.h"
+COMMON_EXTERN Ota ota; // our firmware update streamer
+
+#include "power.h"
+COMMON_EXTERN Power power; // our deep sleep duty cycle
+
+#include "timeSync.h"
+COMMON_EXTERN TimeSync timeSync; // our wall clock, from SNTP
+
+#include "sensors.h"
+COMMON_EXTERN Sensors sensors; // our sensor drivers and their sampling schedule
+
+#include "aggregator.h"
+COMMON_EXTERN Aggregator aggregator; // our sensor value windows
+
+#include "history.h"
+COMMON_EXTERN History history; // our sensor history on flash
+
+#include "buttons.h"
+COMMON_EXTERN Buttons buttons; // our GPIO edge capture
+
+#include "rules.h"
+COMMON_EXTERN Rules rules; // our local automation
+
+#include "metrics.h"
+COMMON_EXTERN Metrics metrics; // our HTTP counters
+
 #include "web.h"
 COMMON_EXTERN Web web;  // our HTTP Server Object
@@ -1,4 +1,4 @@
-// config_class.cpp : Class internals to support our configuration controls and JSON file on a SPIFFS Partition
+// config_class.cpp : Class internals to support our configuration controls and binary config record in NVS or on SPIFFS
 //
 // ----------------------------------------------------------------------------------------------------------------- //
 
@@ -11,6 +11,136 @@
 #ifdef ESP_32
 #include <ArduinoNvs.h>
 #endif
+#include <stddef.h>
+
+#pragma region Fields
+
+// the text is only read by the web form, so it stays in flash
+#define CONFIG_FIELD_TEXT(member, label, hint, group, type, flags, apply, minimum, maximum) \
+  static const char member##Label[] PROGMEM = label;                                     \
+  static const char member##Hint[] PROGMEM = hint;                                       \
+  static const char member##Group[] PROGMEM = group;
+
+CONFIG_FIELDS(CONFIG_FIELD_TEXT)
+
+// offset and size come from the member itself so the table can't drift from ConfigData
+#define CONFIG_FIELD(member, label, hint, group, type, flags, apply, minimum, maximum) \
+  {                                                                                    \
+    #member, member##Label, member##Hint, member##Group, offsetof(ConfigData, member), \
+        sizeof(((ConfigData *)nullptr)->member), type, flags, apply, minimum, maximum  \
+  },
+
+extern constexpr ConfigField configFields[CONFIG_FIELD_COUNT] = {
+    CONFIG_FIELDS(CONFIG_FIELD)
+};
+
+// ConfigField::size and ConfigJournalEntry::length are a byte each
+#define CONFIG_FIELD_SIZE(member, label, hint, group, type, flags, apply, minimum, maximum) \
+  static_assert(sizeof(((ConfigData *)nullptr)->member) < 256, #member " is too big for ConfigField::size");
+
+CONFIG_FIELDS(CONFIG_FIELD_SIZE)
+
+static constexpr size_t configRollbackSize(size_t index = 0)
+{ // bytes in the APPLY_RECONNECT fields from index on
+  return (index == CONFIG_FIELD_COUNT) ? 0 : ((configFields[index].apply == APPLY_RECONNECT) ? configFields[index].size : 0) + configRollbackSize(index + 1);
+}
+
+static_assert(configRollbackSize() == CONFIG_ROLLBACK_SIZE, "CONFIG_ROLLBACK_SIZE must match the APPLY_RECONNECT fields in configFields");
+
+const ConfigField *Config::getField(const char *name)
+{ // look up a field by a key that came from outside, nullptr if there is none; our own code uses configFields[CONFIG_FIELD_...]
+  for (const ConfigField &field : configFields)
+  {
+    if (strcmp(field.name, name) == 0)
+    {
+      return &field;
+    }
+  }
+  return nullptr;
+}
+
+const char *Config::getFieldText(const ConfigField &field, char *number, size_t size)
+{ // the field as text, as it would be posted back by a form: a string in place, a number written into the caller's buffer
+  const uint8_t *data = _fieldData(field);
+  switch (field.type)
+  {
+  case FIELD_STRING:
+    return (const char *)data;
+  case FIELD_BOOL:
+    snprintf_P(number, size, PSTR("%u"), (*data != 0) ? 1u : 0u);
+    break;
+  case FIELD_UINT8:
+    snprintf_P(number, size, PSTR("%u"), (unsigned int)*data);
+    break;
+  case FIELD_UINT16:
+    snprintf_P(number, size, PSTR("%u"), (unsigned int)*(const uint16_t *)data);
+    break;
+  }
+  return number;
+}
+
+String Config::getFieldValue(const ConfigField &field)
+{ // getFieldText() as a String, for building JSON and log lines
+  char number[8] = {0};
+  return String(getFieldText(field, number, sizeof(number)));
+}
+
+bool Config::setFieldValue(const ConfigField &field, const String &value)
+{ // store text in the field, true if that changed anything
+  uint8_t *data = _fieldData(field);
+  if (field.type == FIELD_STRING)
+  {
+    String text = value;
+    if (field.flags & FIELD_LOWERCASE)
+    {
+      text.toLowerCase();
+    }
+    if (((field.flags & FIELD_REQUIRED) && (text.length() == 0)) || (text == String((const char *)data)))
+    {
+      return false;
+    }
+    text.toCharArray((char *)data, field.size);
+    return true;
+  }
+
+  long number = (field.type == FIELD_BOOL) ? ((value == "on" || value == "true" || value == "1") ? 1 : 0) : value.toInt();
+  number = constrain(number, (long)field.minimum, (long)field.maximum);
+  if (field.type == FIELD_UINT16)
+  {
+    if (*(uint16_t *)data == (uint16_t)number)
+    {
+      return false;
+    }
+    *(uint16_t *)data = (uint16_t)number;
+    return true;
+  }
+  if (*data == (uint8_t)number)
+  {
+    return false;
+  }
+  *data = (uint8_t)number;
+  return true;
+}
+
+bool Config::changeField(const ConfigField &field, const String &value)
+{ // a change made while running: saved once things go quiet, and applied as gently as the field allows
+  if (_pendingApply == APPLY_NONE)
+  { // what is running now, in case MQTT won't connect with the change
+    _keepRollback(false);
+  }
+  if (!setFieldValue(field, value))
+  {
+    return false;
+  }
+  if (field.apply > _pendingApply)
+  {
+    _pendingApply = field.apply;
+  }
+  setSaveNeeded();
+  return true;
+}
+
+#pragma endregion Fields
 
 void Config::begin()
 { // called in the main code setup, handles our initialisation
@@ -22,128 +152,479 @@ void Config::begin()
 
 void Config::loop()
 { // called in the main code loop, handles our periodic code
+  if ((_pendingApply != APPLY_NONE) && ((millis() - _changedAt) >= CONFIG_APPLY_DELAY))
+  {
+    _applyPending();
+  }
+  if (_shouldSaveConfig && ((millis() - _changedAt) >= CONFIG_WRITE_DELAY))
+  { // changes come in bursts, so wait for them to settle and write them all at once
+    flush();
+  }
 }
 
-void Config::readFile()
-{
+void Config::setDefaults()
+{ // These defaults may be overwritten with values saved by the web interface
+  memset(&_record, 0, sizeof(_record));
+  setWIFISSID(DEFAULT_WIFI_SSID);
+  setWIFIPass(DEFAULT_WIFI_PASS);
+
+  // Note that MQTT prefers dotted quad address, but MQTTS prefers fully qualified domain names (fqdn)
+  // Note that MQTTS works best using NTP to obtain Time
+  setMQTTServer(DEFAULT_MQTT_SERVER);
+  setMQTTPort(DEFAULT_MQTT_PORT);
+  setMQTTUser(DEFAULT_MQTT_USER);
+  setMQTTPassword(DEFAULT_MQTT_PASS);
+  setNodeName(DEFAULT_NODE_NAME);
+  setGroupName(DEFAULT_GROUP_NAME);
+  setConfigUser(DEFAULT_CONFIG_USER);
+  setConfigPassword(DEFAULT_CONFIG_PASS);
+  setMDSNEnabled(MDNS_ENABLED);
+  _record.data.debugTelnetEnabled = DEBUG_TELNET_ENABLED ? 1 : 0;
+  setHTTPRateLimit(DEFAULT_HTTP_RATE_LIMIT);
+  setHTTPRateBurst(DEFAULT_HTTP_RATE_BURST);
+  setHTTPMaxInFlight(DEFAULT_HTTP_MAX_IN_FLIGHT);
+  setOTATrialWindow(DEFAULT_OTA_TRIAL_WINDOW);
+  _record.data.sleepInterval = DEFAULT_SLEEP_INTERVAL;
+  setNTPServer(DEFAULT_NTP_SERVER);
+  _record.data.sensorBatch = DEFAULT_SENSOR_BATCH;
+  _record.data.sensorBatchAge = DEFAULT_SENSOR_BATCH_AGE;
+}
+
+static uint32_t configCRC(const uint8_t *data, size_t length)
+{ // plain CRC-32 (IEEE), bitwise rather than tabled since it runs once per boot and once per save
+  uint32_t crc = 0xFFFFFFFF;
+  while (length--)
+  {
+    crc ^= *data++;
+    for (uint8_t bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+// one flush's journal entries when every field has changed, and room to read a whole journal back on ESP8266
+static const size_t configJournalBufferSize = sizeof(ConfigData) + CONFIG_FIELD_COUNT * (sizeof(ConfigJournalEntry) + sizeof(uint32_t));
+static_assert(configJournalBufferSize >= CONFIG_JOURNAL_MAX, "an ESP8266 journal must fit the buffer to be replayed");
+static uint8_t configJournalBuffer[configJournalBufferSize];
+
 #ifdef ESP_32
-  debug.printLn(F("NVS: reading from NVS"));
-  if (NVS.begin())
-  {
-    char configPassword[32];
-    char configUser[32];
-    int debugTelnetEnabled;
-    int mdnsEnabled;
-
-    NVS.getString("nodeName").toCharArray(_nodeName, sizeof(_nodeName));
-    NVS.getString("groupName").toCharArray(_groupName, sizeof(_groupName));
-    NVS.getString("mqttServer").toCharArray(_mqttServer, sizeof(_mqttServer));
-    NVS.getString("mqttPort").toCharArray(_mqttPort, sizeof(_mqttPort));
-    NVS.getString("mqttUser").toCharArray(_mqttUser, sizeof(_mqttUser));
-    NVS.getString("mqttPassword").toCharArray(_mqttPassword, sizeof(_mqttPassword));
-    NVS.getString("configPassword").toCharArray(configPassword, sizeof(configPassword));
-    NVS.getString("configUser").toCharArray(configUser, sizeof(configUser));
-    web.setUser(configUser);
-    debugTelnetEnabled = NVS.getInt("debugTelnetEnabled");
-    debug.enableTelnet(debugTelnetEnabled == 1);
-    mdnsEnabled = NVS.getInt("mdnsEnabled");
-    setMDSNEnabled(mdnsEnabled == 1);
+static const char *configJournalKey(uint8_t number)
+{ // "configLog<n>", one NVS key per flush
+  static char key[16];
+  snprintf_P(key, sizeof(key), PSTR("configLog%u"), number);
+  return key;
+}
+#endif
 
+static bool configRecordValid(const uint8_t *buffer, size_t length)
+{ // is this a whole, uncorrupted record we know how to read?
+  const ConfigHeader *header = (const ConfigHeader *)buffer;
+  if (length < sizeof(ConfigHeader) || header->magic != CONFIG_RECORD_MAGIC || header->version != CONFIG_RECORD_VERSION)
+  {
+    return false;
+  }
+  if (length < sizeof(ConfigHeader) + header->size)
+  {
+    return false;
+  }
+  return configCRC(buffer + sizeof(ConfigHeader), header->size) == header->crc;
+}
+
+void Config::readFile()
+{ // the binary record is the fast path, older firmware's NVS keys or config.json are read once and converted
+  if (_readRecord())
+  {
+    _replayJournal();
+    _persisted = _record.data;
+    apply();
     configPrint();
+    return;
   }
-  else
+
+  setDefaults();
+  _readLegacy();
+  apply();
+  if (_writeRecord())
+  {
+    _removeLegacy();
+  }
+  configPrint();
+}
+
+bool Config::_readRecord()
+{ // read the whole record in one go straight into _record, false if it is missing or damaged
+  // a record from older firmware is shorter and the fields it lacks keep their defaults, a record from newer
+  // firmware is longer and goes through the journal buffer, which is free until the journal is replayed
+  uint8_t *buffer = (uint8_t *)&_record;
+  size_t length = 0;
+  setDefaults();
+
+#ifdef ESP_32
+  debug.printLn(F("NVS: reading config record"));
+  if (!NVS.begin())
   {
     debug.printLn(F("NVS: [ERROR] Failed to start NVS"));
+    return false;
+  }
+  length = NVS.getBlobSize("config");
+  if (length == 0)
+  {
+    debug.printLn(F("NVS: [WARNING] config record not found"));
+    return false;
+  }
+  if (length > sizeof(_record))
+  {
+    buffer = configJournalBuffer;
+  }
+  if ((length > sizeof(configJournalBuffer)) || !NVS.getBlob("config", buffer, length))
+  {
+    debug.printLn(F("NVS: [ERROR] Failed to read config record"));
+    return false;
   }
 #elif defined(ESP_8266)
-  // Read saved config.json from SPIFFS
   debug.printLn(F("SPIFFS: mounting SPIFFS"));
-  if (SPIFFS.begin())
+  if (!SPIFFS.begin())
   {
-    if (SPIFFS.exists("/config.json"))
-    { // File exists, reading and loading
-      debug.printLn(F("SPIFFS: reading /config.json"));
-      File configFile = SPIFFS.open("/config.json", "r");
-      if (configFile)
-      {
-        size_t configFileSize = configFile.size(); // Allocate a buffer to store contents of the file.
-        std::unique_ptr<char[]> buf(new char[configFileSize]);
-        configFile.readBytes(buf.get(), configFileSize);
-
-        DynamicJsonDocument configJson(1024);
-        DeserializationError jsonError = deserializeJson(configJson, buf.get());
-        if (jsonError)
-        { // Couldn't parse the saved config
-          debug.printLn(String(F("SPIFFS: [ERROR] Failed to parse /config.json: ")) + String(jsonError.c_str()));
-        }
-        else
-        {
-          if (!configJson["mqttServer"].isNull())
-          {
-            setMQTTServer(configJson["mqttServer"]);
-          }
-          if (!configJson["mqttPort"].isNull())
-          {
-            setMQTTPort(configJson["mqttPort"]);
-          }
-          if (!configJson["mqttUser"].isNull())
-          {
-            setMQTTUser(configJson["mqttUser"]);
-          }
-          if (!configJson["mqttPassword"].isNull())
-          {
-            setMQTTPassword(configJson["mqttPassword"]);
-          }
-          if (!configJson["nodeName"].isNull())
-          {
-            setNodeName(configJson["nodeName"]);
-          }
-          if (!configJson["groupName"].isNull())
-          {
-            setGroupName(configJson["groupName"]);
-          }
-          if (!configJson["configUser"].isNull())
-          {
-            web.setUser(configJson["configUser"]);
-          }
-          if (!configJson["configPassword"].isNull())
-          {
-            web.setPassword(configJson["configPassword"]);
-          }
-          if (!configJson["debugTelnetEnabled"].isNull())
-          {
-            debug.enableTelnet(configJson["debugTelnetEnabled"]); // debug, config, or both?
-          }
-          if (!configJson["mdnsEnabled"].isNull())
-          {
-            setMDSNEnabled(configJson["mdnsEnabled"]);
-          }
-          String configJsonStr;
-          serializeJson(configJson, configJsonStr);
-          debug.printLn(String(F("SPIFFS: parsed json:")) + configJsonStr);
-        }
+    debug.printLn(F("SPIFFS: [ERROR] Failed to mount FS"));
+    return false;
+  }
+  // a save that was interrupted between removing the old record and renaming the new one leaves only the temp file
+  const char *path = SPIFFS.exists(CONFIG_RECORD_FILE) ? CONFIG_RECORD_FILE : CONFIG_RECORD_TEMP;
+  File configFile = SPIFFS.open(path, "r");
+  if (!configFile)
+  {
+    debug.printLn(F("SPIFFS: [WARNING] config record not found"));
+    return false;
+  }
+  debug.printLn(String(F("SPIFFS: reading ")) + String(path));
+  length = configFile.size();
+  if (length > sizeof(_record))
+  {
+    buffer = configJournalBuffer;
+  }
+  length = configFile.read(buffer, min(length, sizeof(configJournalBuffer)));
+  configFile.close();
+#endif
+
+  if (!configRecordValid(buffer, length))
+  {
+    debug.printLn(F("CONFIG: [ERROR] config record is damaged, using defaults"));
+    return false;
+  }
+  if (buffer != (uint8_t *)&_record)
+  { // we ignore what we don't know about
+    memcpy(&_record.data, buffer + sizeof(ConfigHeader), sizeof(ConfigData));
+  }
+  return true;
+}
+
+bool Config::_writeRecord()
+{ // write the whole record in one go
+  _record.header.magic = CONFIG_RECORD_MAGIC;
+  _record.header.version = CONFIG_RECORD_VERSION;
+  _record.header.size = sizeof(ConfigData);
+  _record.header.crc = configCRC((const uint8_t *)&_record.data, sizeof(ConfigData));
+
+#ifdef ESP_32
+  debug.printLn(F("NVS: Saving config record"));
+  if (!NVS.setBlob("config", (uint8_t *)&_record, sizeof(_record)))
+  {
+    debug.printLn(F("NVS: [ERROR] Failed to save config record"));
+    return false;
+  }
+#elif defined(ESP_8266)
+  debug.printLn(F("SPIFFS: Saving config record"));
+  File configFile = SPIFFS.open(CONFIG_RECORD_TEMP, "w");
+  if (!configFile)
+  {
+    debug.printLn(F("SPIFFS: Failed to open config file for writing"));
+    return false;
+  }
+  size_t written = configFile.write((const uint8_t *)&_record, sizeof(_record));
+  configFile.close();
+  if (written != sizeof(_record))
+  {
+    debug.printLn(F("SPIFFS: [ERROR] Failed to write config record"));
+    SPIFFS.remove(CONFIG_RECORD_TEMP);
+    return false;
+  }
+  // SPIFFS won't rename over an existing file
+  SPIFFS.remove(CONFIG_RECORD_FILE);
+  if (!SPIFFS.rename(CONFIG_RECORD_TEMP, CONFIG_RECORD_FILE))
+  {
+    debug.printLn(F("SPIFFS: [ERROR] Failed to rename config record"));
+    return false;
+  }
+#endif
+
+  // the record now holds everything the journal did. Should we stop before the journal is gone,
+  // replaying it over the new record next boot only rewrites the values it already has
+#ifdef ESP_32
+  for (uint8_t i = 0; i < CONFIG_JOURNAL_KEYS; i++)
+  { // every key that could be there, a damaged one stops replay before the keys after it are counted
+    NVS.erase(configJournalKey(i));
+  }
+#elif defined(ESP_8266)
+  SPIFFS.remove(CONFIG_JOURNAL_FILE);
+#endif
+  _journalSize = 0;
+  _journalKeys = 0;
+  _persisted = _record.data;
+  return true;
+}
+
+void Config::_applyPending()
+{ // bring the running system in line with changed settings, restarting no more than they need
+  const configApply_t pending = _pendingApply;
+  const bool provisioning = esp.isProvisioning(); // nothing is connected yet, so nothing needs restarting
+  _pendingApply = APPLY_NONE;
+  if ((pending == APPLY_REBOOT) && !provisioning)
+  {
+    debug.printLn(F("CONFIG: Restarting to apply changes"));
+    esp.reset(); // flushes the changes first
+    return;
+  }
+
+  apply();
+  web.applyConfig();
+  esp.applyConfig();
+  rules.applyConfig();
+  aggregator.applyConfig();
+  history.applyConfig();
+  timeSync.applyConfig();
+  if ((pending == APPLY_RECONNECT) && !provisioning && !mqtt.reconnect(CONFIG_APPLY_ATTEMPTS))
+  {
+    debug.printLn(F("CONFIG: [ERROR] MQTT won't connect with the changed settings, going back to the previous ones"));
+    _keepRollback(true);
+    mqtt.reconnect(1); // and should that fail too, mqtt.loop() keeps trying as it always has
+  }
+  debug.printLn(F("CONFIG: Changes applied"));
+  flush();
+  mqtt.publishConfig();
+}
+
+void Config::_keepRollback(bool restore)
+{ // copy the APPLY_RECONNECT fields, packed in table order, to the rollback copy or back from it
+  size_t at = 0;
+  for (const ConfigField &field : configFields)
+  {
+    if (field.apply != APPLY_RECONNECT)
+    { // the static_assert on CONFIG_ROLLBACK_SIZE makes sure the rest fit
+      continue;
+    }
+    if (restore)
+    {
+      memcpy(_fieldData(field), _rollback + at, field.size);
+    }
+    else
+    {
+      memcpy(_rollback + at, _fieldData(field), field.size);
+    }
+    at += field.size;
+  }
+}
+
+void Config::_replayJournal()
+{ // apply the changes made since the record was written
+  size_t length = 0;
+  bool intact = true;
+  _journalSize = 0;
+#ifdef ESP_32
+  for (_journalKeys = 0; intact && (_journalKeys < CONFIG_JOURNAL_KEYS); _journalKeys++)
+  { // a key per flush, in the order they were written
+    length = NVS.getBlobSize(configJournalKey(_journalKeys));
+    if (length == 0)
+    {
+      break;
+    }
+    if ((length > sizeof(configJournalBuffer)) || !NVS.getBlob(configJournalKey(_journalKeys), configJournalBuffer, length))
+    {
+      debug.printLn(F("NVS: [ERROR] Failed to read config journal"));
+      intact = false;
+      break;
+    }
+    intact = _replayEntries(configJournalBuffer, length);
+    _journalSize += length;
+  }
+#elif defined(ESP_8266)
+  File journalFile = SPIFFS.open(CONFIG_JOURNAL_FILE, "r");
+  if (!journalFile)
+  {
+    return;
+  }
+  length = journalFile.read(configJournalBuffer, sizeof(configJournalBuffer));
+  intact = (journalFile.size() == length) && _replayEntries(configJournalBuffer, length);
+  journalFile.close();
+  _journalSize = length;
+#endif
+  if (!intact)
+  { // anything after a damaged entry is dropped the next time we flush, by writing the record instead
+    debug.printLn(F("CONFIG: [WARNING] config journal is damaged, replayed up to there"));
+    _journalSize = CONFIG_JOURNAL_MAX;
+  }
+}
+
+bool Config::_replayEntries(const uint8_t *buffer, size_t length)
+{ // apply one run of entries, false when it doesn't check out to the end
+  size_t position = 0;
+  uint16_t entries = 0;
+  while (position + sizeof(ConfigJournalEntry) + sizeof(uint32_t) <= length)
+  {
+    ConfigJournalEntry entry;
+    memcpy(&entry, buffer + position, sizeof(entry));
+    const size_t entrySize = sizeof(entry) + entry.length;
+    if (position + entrySize + sizeof(uint32_t) > length)
+    {
+      break;
+    }
+    uint32_t crc;
+    memcpy(&crc, buffer + position + entrySize, sizeof(crc));
+    if ((crc != configCRC(buffer + position, entrySize)) || (entry.offset + entry.length > sizeof(ConfigData)))
+    {
+      break;
+    }
+    memcpy((uint8_t *)&_record.data + entry.offset, buffer + position + sizeof(entry), entry.length);
+    position += entrySize + sizeof(uint32_t);
+    entries++;
+  }
+  debug.printLn(String(F("CONFIG: replayed ")) + String(entries) + String(F(" config journal entries")));
+  return position == length;
+}
+
+bool Config::_appendJournal(const uint8_t *entries, size_t length)
+{ // add entries to the end of the journal
+#ifdef ESP_32
+  // each flush gets a key of its own, so nothing already written is read back or written again
+  if (!NVS.setBlob(configJournalKey(_journalKeys), (uint8_t *)entries, length))
+  {
+    debug.printLn(F("NVS: [ERROR] Failed to save config journal"));
+    return false;
+  }
+  _journalKeys++;
+#elif defined(ESP_8266)
+  File journalFile = SPIFFS.open(CONFIG_JOURNAL_FILE, "a");
+  if (!journalFile)
+  {
+    debug.printLn(F("SPIFFS: [ERROR] Failed to open config journal"));
+    return false;
+  }
+  size_t written = journalFile.write(entries, length);
+  journalFile.close();
+  if (written != length)
+  {
+    debug.printLn(F("SPIFFS: [ERROR] Failed to write config journal"));
+    return false;
+  }
+#endif
+  _journalSize += length;
+  return true;
+}
+
+void Config::apply()
+{ // push settings that live in other classes out to them
+  debug.enableTelnet(_record.data.debugTelnetEnabled != 0);
+}
+
+void Config::_readLegacy()
+{ // read settings saved by firmware from before the binary record
+#ifdef ESP_32
+  if (NVS.getString("nodeName") == "")
+  { // every legacy save wrote the node name
+    debug.printLn(F("NVS: [WARNING] no saved config, using defaults"));
+    return;
+  }
+  debug.printLn(F("NVS: converting legacy config"));
+  for (const ConfigField &field : configFields)
+  {
+    if (&field == &configFields[CONFIG_FIELD_configUser])
+    { // legacy saves wrote the password here, so keep the default user
+      continue;
+    }
+    // only keys the legacy save wrote, fields added since keep their defaults
+    if (field.type == FIELD_STRING)
+    {
+      String value;
+      if (NVS.getString(field.name, value) && ((value != "") || !(field.flags & FIELD_REQUIRED)))
+      { // the wifi credentials were never kept here, and read back blank
+        value.toCharArray((char *)_fieldData(field), field.size);
       }
-      else
+    }
+    else
+    {
+      const int64_t value = NVS.getInt(field.name, INT64_MIN);
+      if (value != INT64_MIN)
       {
-        debug.printLn(F("SPIFFS: [ERROR] Failed to read /config.json"));
+        setFieldValue(field, String((long)value));
       }
     }
+  }
+#elif defined(ESP_8266)
+  if (!SPIFFS.exists("/config.json"))
+  {
+    debug.printLn(F("SPIFFS: [WARNING] no saved config, using defaults"));
+    return;
+  }
+  // File exists, reading and loading
+  debug.printLn(F("SPIFFS: converting legacy /config.json"));
+  File configFile = SPIFFS.open("/config.json", "r");
+  if (!configFile)
+  {
+    debug.printLn(F("SPIFFS: [ERROR] Failed to read /config.json"));
+    return;
+  }
+  size_t configFileSize = configFile.size(); // Allocate a buffer to store contents of the file.
+  std::unique_ptr<char[]> buf(new char[configFileSize]);
+  configFile.readBytes(buf.get(), configFileSize);
+  configFile.close();
+
+  DynamicJsonDocument configJson(1024);
+  DeserializationError jsonError = deserializeJson(configJson, buf.get(), configFileSize);
+  if (jsonError)
+  { // Couldn't parse the saved config
+    debug.printLn(String(F("SPIFFS: [ERROR] Failed to parse /config.json: ")) + String(jsonError.c_str()));
+    return;
+  }
+  for (const ConfigField &field : configFields)
+  {
+    JsonVariant value = configJson[field.name];
+    if (value.isNull())
+    {
+      continue;
+    }
+    if (field.type == FIELD_STRING)
+    { // saved values are taken as they were, even the optional blank ones
+      value.as<String>().toCharArray((char *)_fieldData(field), field.size);
+    }
     else
     {
-      debug.printLn(F("SPIFFS: [WARNING] /config.json not found, will be created on first config save"));
+      setFieldValue(field, value.is<bool>() ? String(value.as<bool>() ? 1 : 0) : value.as<String>());
     }
   }
-  else
+#endif
+}
+
+void Config::_removeLegacy()
+{ // once the record is safely written the old format is dead weight
+#ifdef ESP_32
+  for (const ConfigField &field : configFields)
   {
-    debug.printLn(F("SPIFFS: [ERROR] Failed to mount FS"));
+    NVS.erase(field.name, false);
+  }
+  NVS.commit();
+#elif defined(ESP_8266)
+  if (SPIFFS.exists("/config.json"))
+  {
+    SPIFFS.remove("/config.json");
   }
 #endif
 }
 
 void Config::saveCallback()
 { // Callback notifying us of the need to save config
-  debug.printLn(F("SPIFFS: Configuration changed, flagging for save"));
-  _shouldSaveConfig = true;
+  debug.printLn(F("CONFIG: Configuration changed, flagging for save"));
+  setSaveNeeded();
 }
 
 void Config::saveFileIfNeeded()
@@ -155,67 +636,59 @@ void Config::saveFileIfNeeded()
 }
 
 void Config::saveFile()
-{
-#ifdef ESP_32
-  // Save the custom parameters to NVS
-  debug.printLn(F("NVS: Saving config"));
-
-  NVS.setString("nodeName", _nodeName);
-  NVS.setString("groupName", _groupName);
-  NVS.setString("mqttServer", _mqttServer);
-  NVS.setString("mqttPort", _mqttPort);
-  NVS.setString("mqttUser", _mqttUser);
-  NVS.setString("mqttPassword", _mqttPassword);
-  NVS.setString("configPassword", web.getPassword());
-  NVS.setString("configUser", web.getPassword());
-  NVS.setInt("debugTelnetEnabled", debug.getTelnetEnabled() ? 1 : 0);
-  NVS.setInt("mdnsEnabled", getMDNSEnabled() ? 1 : 0);
+{ // write out pending changes now rather than waiting for them to settle
+  flush();
+}
 
-  NVS.commit();
+void Config::flush()
+{ // journal the fields that differ from storage, compacting into a fresh record when the journal is full
+  _shouldSaveConfig = false;
 
-  configPrint();
-#elif defined(ESP_8266)
-  // Save the custom parameters to config.json
-  debug.printLn(F("SPIFFS: Saving config"));
-  DynamicJsonDocument jsonConfigValues(1024);
-  jsonConfigValues["mqttServer"] = _mqttServer;
-  jsonConfigValues["mqttPort"] = _mqttPort;
-  jsonConfigValues["mqttUser"] = _mqttUser;
-  jsonConfigValues["mqttPassword"] = _mqttPassword;
-  jsonConfigValues["nodeName"] = _nodeName;
-  jsonConfigValues["groupName"] = _groupName;
-  jsonConfigValues["configUser"] = web.getUser();
-  jsonConfigValues["configPassword"] = web.getPassword();
-  jsonConfigValues["debugTelnetEnabled"] = debug.getTelnetEnabled();
-  jsonConfigValues["mdnsEnabled"] = _mdnsEnabled;
-
-  debug.printLn(String(F("SPIFFS: mqttServer = ")) + String(_mqttServer));
-  debug.printLn(String(F("SPIFFS: mqttPort = ")) + String(_mqttPort));
-  debug.printLn(String(F("SPIFFS: mqttUser = ")) + String(_mqttUser));
-  debug.printLn(String(F("SPIFFS: mqttPassword = ")) + String(_mqttPassword));
-  debug.printLn(String(F("SPIFFS: nodeName = ")) + String(_nodeName));
-  debug.printLn(String(F("SPIFFS: groupName = ")) + String(_groupName));
-  debug.printLn(String(F("SPIFFS: configUser = ")) + String(web.getUser()));
-  debug.printLn(String(F("SPIFFS: configPassword = ")) + String(web.getPassword()));
-  debug.printLn(String(F("SPIFFS: debugTelnetEnabled = ")) + String(debug.getTelnetEnabled()));
-  debug.printLn(String(F("SPIFFS: mdnsEnabled = ")) + String(_mdnsEnabled));
-
-  File configFile = SPIFFS.open("/config.json", "w");
-  if (!configFile)
+  uint8_t *entries = configJournalBuffer;
+  size_t length = 0;
+  uint8_t changed = 0;
+  for (const ConfigField &field : configFields)
   {
-    debug.printLn(F("SPIFFS: Failed to open config file for writing"));
+    const uint8_t *current = _fieldData(field);
+    if (memcmp(current, (const uint8_t *)&_persisted + field.offset, field.size) == 0)
+    {
+      continue;
+    }
+    ConfigJournalEntry entry = {field.offset, field.size, 0};
+    uint8_t *start = entries + length;
+    memcpy(start, &entry, sizeof(entry));
+    memcpy(start + sizeof(entry), current, field.size);
+    const uint32_t crc = configCRC(start, sizeof(entry) + field.size);
+    memcpy(start + sizeof(entry) + field.size, &crc, sizeof(crc));
+    length += sizeof(entry) + field.size + sizeof(crc);
+    changed++;
+  }
+  if (changed == 0)
+  {
+    return;
+  }
+
+  debug.printLn(String(F("CONFIG: Saving ")) + String(changed) + String(F(" changed fields")));
+  bool saved;
+  if ((_journalSize + length > CONFIG_JOURNAL_MAX) || (_journalKeys == CONFIG_JOURNAL_KEYS))
+  {
+    saved = _writeRecord();
   }
   else
   {
-    serializeJson(jsonConfigValues, configFile);
-    configFile.close();
+    saved = _appendJournal(entries, length);
+  }
+  if (saved)
+  {
+    _persisted = _record.data;
+    configPrint();
   }
-#endif
-  _shouldSaveConfig = false;
 }
 
 void Config::clearFileSystem()
 { // Clear out all local storage
+  _persisted = _record.data; // nothing left for the flush on reset to write
+  _shouldSaveConfig = false;
 #ifdef ESP_32
   debug.printLn(F("RESET: Formatting NVS"));
   NVS.eraseAll();
@@ -236,14 +709,9 @@ void Config::clearFileSystem()
 
 void Config::configPrint()
 {
-  debug.printLn(String(F("NVS: mqttServer = ")) + String(_mqttServer));
-  debug.printLn(String(F("NVS: mqttPort = ")) + String(_mqttPort));
-  debug.printLn(String(F("NVS: mqttUser = ")) + String(_mqttUser));
-  debug.printLn(String(F("NVS: mqttPassword = ")) + String(_mqttPassword));
-  debug.printLn(String(F("NVS: nodeName = ")) + String(_nodeName));
-  debug.printLn(String(F("NVS: groupName = ")) + String(_groupName));
-  debug.printLn(String(F("NVS: configUser = ")) + String(web.getUser()));
-  debug.printLn(String(F("NVS: configPassword = ")) + String(web.getPassword()));
-  debug.printLn(String(F("NVS: debugTelnetEnabled = ")) + String(debug.getTelnetEnabled()));
-  debug.printLn(String(F("NVS: mdnsEnabled = ")) + String(_mdnsEnabled));
+  for (const ConfigField &field : configFields)
+  {
+    const bool masked = (field.flags & FIELD_SECRET) && (_fieldData(field)[0] != '\0');
+    debug.printLn(String(F("CONFIG: ")) + String(field.name) + String(F(" = ")) + (masked ? String(CONFIG_MASK) : getFieldValue(field)));
+  }
 }
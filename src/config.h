@@ -3,6 +3,175 @@
 #include "settings.h"
 #include <Arduino.h>
 
+// Every persisted setting, laid out so the whole thing is read and written as one binary record.
+// Fields are ordered largest alignment last with no implicit padding, and new fields are only ever
+// appended: a record saved by older firmware is shorter, and the fields it lacks keep their defaults.
+struct ConfigData
+{
+    char wifiSSID[32]; // Leave unset for wireless autoconfig. Note that these values will be lost
+    char wifiPass[64]; // when updating, but that's probably OK because they will be saved in EEPROM.
+    // Note that MQTT prefers dotted quad address, but MQTTS prefers fully qualified domain names (fqdn)
+    char mqttServer[64];
+    char mqttPort[6];
+    char mqttUser[32];
+    char mqttPassword[32];
+    char nodeName[16];
+    char groupName[16];
+    char configUser[32];     // admin user for the web pages and OTA
+    char configPassword[32]; // admin password, blank for no authentication
+    uint8_t mdnsEnabled;     // mDNS is enabled
+    uint8_t debugTelnetEnabled; // telnet debug output is enabled
+    uint8_t httpMaxInFlight; // HTTP requests handled at once
+    uint8_t reserved;        // keeps the 16 bit fields aligned
+    uint16_t httpRateLimit;  // HTTP requests per second per client, 0 for unlimited
+    uint16_t httpRateBurst;  // HTTP requests per client allowed back to back
+    uint16_t otaTrialWindow; // seconds a new firmware must stay healthy before it is kept
+    char staticIP[16];       // dotted quad, blank for DHCP
+    char staticGateway[16];
+    char staticSubnet[16];
+    char staticDNS[16];
+    uint16_t sleepInterval;  // seconds of deep sleep between reports, 0 to stay awake
+    uint16_t reserved2;      // keeps the record a whole number of 32 bit words
+    char wifiSSID2[32];      // other networks to roam to, blank when unused
+    char wifiPass2[64];
+    char wifiSSID3[32];
+    char wifiPass3[64];
+    char rules[240];         // local automation, see rules.h
+    char sensorWindows[96];  // sensor values published as one record per window, see aggregator.h
+    char historyMetrics[64]; // sensor values kept on flash for /api/history, see history.h
+    char ntpServer[64];      // SNTP server for the epoch timestamps on telemetry, see timeSync.h
+    uint8_t sensorBatch;     // samples of a sensor per MQTT message
+    uint8_t reserved3;       // keeps the 16 bit field aligned
+    uint16_t sensorBatchAge; // seconds the oldest sample of a batch may wait
+};
+
+// What precedes ConfigData in storage
+struct ConfigHeader
+{
+    uint32_t magic;   // CONFIG_RECORD_MAGIC
+    uint16_t version; // CONFIG_RECORD_VERSION, bumped only for changes that are not appends
+    uint16_t size;    // sizeof(ConfigData) of the firmware that wrote the record
+    uint32_t crc;     // CRC-32 of the size bytes of ConfigData that follow
+};
+
+struct ConfigRecord
+{
+    ConfigHeader header;
+    ConfigData data;
+};
+
+#define CONFIG_RECORD_MAGIC (0x47464341) // "ACFG"
+#define CONFIG_RECORD_VERSION (1)
+#define CONFIG_RECORD_FILE "/config.bin"
+#define CONFIG_RECORD_TEMP "/config.tmp"
+#define CONFIG_JOURNAL_FILE "/config.jnl"
+
+// Changes since the record was last written are appended to a journal, one entry per changed field.
+// Each entry is this header, then the field's bytes, then a CRC-32 of both; replay stops at the first
+// entry that doesn't check out, which is where a write was cut short.
+struct ConfigJournalEntry
+{
+    uint16_t offset; // into ConfigData
+    uint8_t length;  // bytes of field data that follow
+    uint8_t reserved;
+};
+
+static_assert(sizeof(ConfigData) % 4 == 0, "ConfigData must not pick up trailing padding");
+
+// How a ConfigData field is stored
+enum configFieldType_t : uint8_t
+{
+    FIELD_STRING, // zero terminated char array
+    FIELD_BOOL,   // uint8_t, 0 or 1
+    FIELD_UINT8,
+    FIELD_UINT16
+};
+
+// What it takes for a change to a field to take effect, in increasing order of disruption
+enum configApply_t : uint8_t
+{
+    APPLY_NONE,
+    APPLY_LIVE,      // picked up straight away, e.g. telnet, mDNS, admin credentials
+    APPLY_RECONNECT, // needs a new MQTT connection, rolled back if that can't be made
+    APPLY_REBOOT     // needs a restart, e.g. the node name is baked into too many places
+};
+
+#define FIELD_SECRET (0x01)    // masked in forms and logs, a masked value posted back means unchanged
+#define FIELD_REQUIRED (0x02)  // never saved blank
+#define FIELD_NUMERIC (0x04)   // a string holding a number, e.g. the MQTT port
+#define FIELD_LOWERCASE (0x08) // lowercase letters, numbers, and _ only
+#define FIELD_FORM (0x10)      // shown on the web config page
+#define FIELD_PORTAL (0x20)    // shown on the config page while the setup network is up
+#define FIELD_NODE (0x40)      // this node's own, never set for a whole group
+
+// One entry per setting, so storage, printing, the web form and the setup network all walk the same list
+struct ConfigField
+{
+    const char *name;  // key in NVS, JSON and form posts
+    PGM_P label;       // shown to the user
+    PGM_P hint;        // shown after the label, "" for (required)/(optional)
+    PGM_P group;       // heading that starts a new section of the form, or ""
+    uint16_t offset;   // into ConfigData
+    uint8_t size;      // bytes in ConfigData, including the terminator for strings
+    configFieldType_t type;
+    uint8_t flags;     // FIELD_*
+    configApply_t apply;
+    uint16_t minimum;  // for numbers
+    uint16_t maximum;
+};
+
+// Every setting as CONFIG_FIELD(member, label, hint, group, type, flags, apply, minimum, maximum). Expanded here into
+// the field indexes and in config.cpp into configFields, so the two can't drift; new settings go on the end
+#define CONFIG_FIELDS(CONFIG_FIELD) \
+    CONFIG_FIELD(wifiSSID, "WiFi SSID", "", "", FIELD_STRING, FIELD_REQUIRED | FIELD_FORM | FIELD_PORTAL, APPLY_REBOOT, 0, 0) \
+    CONFIG_FIELD(wifiPass, "WiFi Password", "", "", FIELD_STRING, FIELD_REQUIRED | FIELD_SECRET | FIELD_FORM | FIELD_PORTAL, APPLY_REBOOT, 0, 0) \
+    CONFIG_FIELD(nodeName, "Node Name", "required. lowercase letters, numbers, and _ only", "Node Name", FIELD_STRING, FIELD_REQUIRED | FIELD_LOWERCASE | FIELD_FORM | FIELD_PORTAL | FIELD_NODE, APPLY_REBOOT, 0, 0) \
+    CONFIG_FIELD(groupName, "Group Name", "", "", FIELD_STRING, FIELD_REQUIRED | FIELD_FORM | FIELD_PORTAL, APPLY_RECONNECT, 0, 0) \
+    CONFIG_FIELD(mqttServer, "MQTT Server", "", "MQTT Broker", FIELD_STRING, FIELD_REQUIRED | FIELD_FORM | FIELD_PORTAL, APPLY_RECONNECT, 0, 0) \
+    CONFIG_FIELD(mqttPort, "MQTT Port", "", "", FIELD_STRING, FIELD_REQUIRED | FIELD_NUMERIC | FIELD_FORM | FIELD_PORTAL, APPLY_RECONNECT, 0, 0) \
+    CONFIG_FIELD(mqttUser, "MQTT User", "", "", FIELD_STRING, FIELD_FORM | FIELD_PORTAL, APPLY_RECONNECT, 0, 0) \
+    CONFIG_FIELD(mqttPassword, "MQTT Password", "", "", FIELD_STRING, FIELD_SECRET | FIELD_FORM | FIELD_PORTAL, APPLY_RECONNECT, 0, 0) \
+    CONFIG_FIELD(configUser, "Admin Username", "", "Admin Access", FIELD_STRING, FIELD_FORM | FIELD_PORTAL, APPLY_LIVE, 0, 0) \
+    CONFIG_FIELD(configPassword, "Admin Password", "", "", FIELD_STRING, FIELD_SECRET | FIELD_FORM | FIELD_PORTAL, APPLY_LIVE, 0, 0) \
+    CONFIG_FIELD(debugTelnetEnabled, "Telnet debug output enabled", "", "Options", FIELD_BOOL, FIELD_FORM, APPLY_LIVE, 0, 1) \
+    CONFIG_FIELD(mdnsEnabled, "mDNS enabled", "", "", FIELD_BOOL, FIELD_FORM, APPLY_LIVE, 0, 1) \
+    CONFIG_FIELD(httpRateLimit, "HTTP requests per second per client", "0 for unlimited", "Limits", FIELD_UINT16, FIELD_FORM, APPLY_LIVE, 0, 1000) \
+    CONFIG_FIELD(httpRateBurst, "HTTP requests per client back to back", "", "", FIELD_UINT16, FIELD_FORM, APPLY_LIVE, 1, 1000) \
+    CONFIG_FIELD(httpMaxInFlight, "HTTP requests handled at once", "", "", FIELD_UINT8, FIELD_FORM, APPLY_LIVE, 1, 8) \
+    CONFIG_FIELD(otaTrialWindow, "Seconds new firmware must stay healthy", "0 to keep it at once", "", FIELD_UINT16, FIELD_FORM, APPLY_LIVE, 0, OTA_TRIAL_DEADLINE / ASECOND) \
+    CONFIG_FIELD(staticIP, "Static IP address", "blank for DHCP", "Static IP", FIELD_STRING, FIELD_FORM | FIELD_NODE, APPLY_REBOOT, 0, 0) \
+    CONFIG_FIELD(staticGateway, "Gateway", "", "", FIELD_STRING, FIELD_FORM, APPLY_REBOOT, 0, 0) \
+    CONFIG_FIELD(staticSubnet, "Subnet mask", "", "", FIELD_STRING, FIELD_FORM, APPLY_REBOOT, 0, 0) \
+    CONFIG_FIELD(staticDNS, "DNS server", "", "", FIELD_STRING, FIELD_FORM, APPLY_REBOOT, 0, 0) \
+    CONFIG_FIELD(sleepInterval, "Seconds asleep between reports", "0 to stay awake", "Power", FIELD_UINT16, FIELD_FORM, APPLY_LIVE, 0, POWER_SLEEP_MAX) \
+    CONFIG_FIELD(wifiSSID2, "Second WiFi SSID", "blank if unused", "Other Networks", FIELD_STRING, FIELD_FORM, APPLY_LIVE, 0, 0) \
+    CONFIG_FIELD(wifiPass2, "Second WiFi Password", "", "", FIELD_STRING, FIELD_SECRET | FIELD_FORM, APPLY_LIVE, 0, 0) \
+    CONFIG_FIELD(wifiSSID3, "Third WiFi SSID", "blank if unused", "", FIELD_STRING, FIELD_FORM, APPLY_LIVE, 0, 0) \
+    CONFIG_FIELD(wifiPass3, "Third WiFi Password", "", "", FIELD_STRING, FIELD_SECRET | FIELD_FORM, APPLY_LIVE, 0, 0) \
+    CONFIG_FIELD(rules, "Rules", "e.g. button 0.1 on -> gpio 5 toggle; blank for none", "Automation", FIELD_STRING, FIELD_FORM, APPLY_LIVE, 0, 0) \
+    CONFIG_FIELD(sensorWindows, "Sensor windows", "e.g. fake1.temperature=60/p95 fake2.*=300 in seconds, blank to publish every sample, ignored while duty cycling", "Sensors", FIELD_STRING, FIELD_FORM, APPLY_LIVE, 0, 0) \
+    CONFIG_FIELD(historyMetrics, "Sensor history", "e.g. fake1.temperature fake2.humidity, blank for none", "", FIELD_STRING, FIELD_FORM, APPLY_LIVE, 0, 0) \
+    CONFIG_FIELD(sensorBatch, "Samples per sensor message", "1 to publish each sample as it is read", "", FIELD_UINT8, FIELD_FORM, APPLY_LIVE, 1, SENSOR_BATCH_SAMPLES) \
+    CONFIG_FIELD(sensorBatchAge, "Seconds a batch may wait", "", "", FIELD_UINT16, FIELD_FORM, APPLY_LIVE, 1, 3600) \
+    CONFIG_FIELD(ntpServer, "NTP Server", "for the timestamps on telemetry, blank for none", "Time", FIELD_STRING, FIELD_FORM, APPLY_LIVE, 0, 0)
+
+#define CONFIG_FIELD_ID(member, label, hint, group, type, flags, apply, minimum, maximum) CONFIG_FIELD_##member,
+
+// Where each setting is in configFields, e.g. configFields[CONFIG_FIELD_wifiSSID]
+enum configFieldId_t : uint8_t
+{
+    CONFIG_FIELDS(CONFIG_FIELD_ID)
+    CONFIG_FIELD_COUNT
+};
+
+extern const ConfigField configFields[CONFIG_FIELD_COUNT];
+
+#define CONFIG_MASK ("********") // stands in for a secret in forms and logs
+
+// the fields marked APPLY_RECONNECT, the only ones a failed apply has to put back; config.cpp checks this against configFields
+#define CONFIG_ROLLBACK_SIZE (sizeof(ConfigData::groupName) + sizeof(ConfigData::mqttServer) + sizeof(ConfigData::mqttPort) + \
+                              sizeof(ConfigData::mqttUser) + sizeof(ConfigData::mqttPassword))
+
 class Config
 {
 #pragma region Private
@@ -17,21 +186,13 @@ public:
     Config(void)
     {
         _alive = true;
-        setWIFISSID(DEFAULT_WIFI_SSID);
-        setWIFIPass(DEFAULT_WIFI_PASS);
-
-        // These defaults may be overwritten with values saved by the web interface
-        // Note that MQTT prefers dotted quad address, but MQTTS prefers fully qualified domain names (fqdn)
-        // Note that MQTTS works best using NTP to obtain Time
-        setMQTTServer(DEFAULT_MQTT_SERVER);
-        setMQTTPort(DEFAULT_MQTT_PORT);
-        setMQTTUser(DEFAULT_MQTT_USER);
-        setMQTTPassword(DEFAULT_MQTT_PASS);
-        setNodeName(DEFAULT_NODE_NAME);
-        setGroupName(DEFAULT_GROUP_NAME);
-        setMDSNEnabled(MDNS_ENABLED);
-
-        _shouldSaveConfig = false; // Flag to save json config to SPIFFS
+        setDefaults();
+        _persisted = _record.data;
+        _journalSize = 0;
+        _journalKeys = 0;
+        _shouldSaveConfig = false; // Flag to save the config record
+        _changedAt = 0;
+        _pendingApply = APPLY_NONE;
     }
 
     // destructor
@@ -42,6 +203,8 @@ public:
 
     void loop();
 
+    void setDefaults();
+
     void readFile();
 
     void saveCallback();
@@ -50,72 +213,139 @@ public:
 
     void saveFile();
 
+    void flush();
+
     void clearFileSystem();
 
     // we are going to have quite a count of getters and setters
     // can we streamline them? (basic C++ syntax says "no")
 
-    char *getWIFISSID(void) { return _wifiSSID; }
+    char *getWIFISSID(void) { return _record.data.wifiSSID; }
     void setWIFISSID(const char *value)
     {
-        strncpy(_wifiSSID, value, 32);
-        _wifiSSID[31] = '\0';
+        strncpy(_record.data.wifiSSID, value, 32);
+        _record.data.wifiSSID[31] = '\0';
     }
 
-    char *getWIFIPass(void) { return _wifiPass; }
+    char *getWIFIPass(void) { return _record.data.wifiPass; }
     void setWIFIPass(const char *value)
     {
-        strncpy(_wifiPass, value, 64);
-        _wifiPass[63] = '\0';
+        strncpy(_record.data.wifiPass, value, 64);
+        _record.data.wifiPass[63] = '\0';
     }
 
-    char *getMQTTServer(void) { return _mqttServer; }
+    char *getMQTTServer(void) { return _record.data.mqttServer; }
     void setMQTTServer(const char *value)
     {
-        strncpy(_mqttServer, value, 64);
-        _mqttServer[63] = '\0';
+        strncpy(_record.data.mqttServer, value, 64);
+        _record.data.mqttServer[63] = '\0';
     }
 
-    char *getMQTTPort(void) { return _mqttPort; }
+    char *getMQTTPort(void) { return _record.data.mqttPort; }
     void setMQTTPort(const char *value)
     {
-        strncpy(_mqttPort, value, 6);
-        _mqttPort[5] = '\0';
+        strncpy(_record.data.mqttPort, value, 6);
+        _record.data.mqttPort[5] = '\0';
     }
 
-    char *getMQTTUser(void) { return _mqttUser; }
+    char *getMQTTUser(void) { return _record.data.mqttUser; }
     void setMQTTUser(const char *value)
     {
-        strncpy(_mqttUser, value, 32);
-        _mqttUser[31] = '\0';
+        strncpy(_record.data.mqttUser, value, 32);
+        _record.data.mqttUser[31] = '\0';
     }
 
-    char *getMQTTPassword(void) { return _mqttPassword; }
+    char *getMQTTPassword(void) { return _record.data.mqttPassword; }
     void setMQTTPassword(const char *value)
     {
-        strncpy(_mqttPassword, value, 32);
-        _mqttPassword[31] = '\0';
+        strncpy(_record.data.mqttPassword, value, 32);
+        _record.data.mqttPassword[31] = '\0';
     }
 
-    char *getNodeName(void) { return _nodeName; }
+    char *getNodeName(void) { return _record.data.nodeName; }
     void setNodeName(const char *value)
     {
-        strncpy(_nodeName, value, 16);
-        _nodeName[15] = '\0';
+        strncpy(_record.data.nodeName, value, 16);
+        _record.data.nodeName[15] = '\0';
     }
 
-    char *getGroupName(void) { return _groupName; }
+    char *getGroupName(void) { return _record.data.groupName; }
     void setGroupName(const char *value)
     {
-        strncpy(_groupName, value, 16);
-        _groupName[15] = '\0';
+        strncpy(_record.data.groupName, value, 16);
+        _record.data.groupName[15] = '\0';
     }
 
-    bool getMDNSEnabled(void) { return _mdnsEnabled; }
-    void setMDSNEnabled(bool value) { _mdnsEnabled = value; }
+    char *getConfigUser(void) { return _record.data.configUser; }
+    void setConfigUser(const char *value)
+    {
+        strncpy(_record.data.configUser, value, 32);
+        _record.data.configUser[31] = '\0';
+    }
+
+    char *getConfigPassword(void) { return _record.data.configPassword; }
+    void setConfigPassword(const char *value)
+    {
+        strncpy(_record.data.configPassword, value, 32);
+        _record.data.configPassword[31] = '\0';
+    }
+
+    char *getStaticIP(void) { return _record.data.staticIP; }
+    char *getStaticGateway(void) { return _record.data.staticGateway; }
+    char *getStaticSubnet(void) { return _record.data.staticSubnet; }
+    char *getStaticDNS(void) { return _record.data.staticDNS; }
+
+    uint16_t getSleepInterval(void) { return _record.data.sleepInterval; }
+    char *getWIFISSID2(void) { return _record.data.wifiSSID2; }
+    char *getWIFIPass2(void) { return _record.data.wifiPass2; }
+    char *getWIFISSID3(void) { return _record.data.wifiSSID3; }
+    char *getWIFIPass3(void) { return _record.data.wifiPass3; }
+    char *getRules(void) { return _record.data.rules; }
+    char *getSensorWindows(void) { return _record.data.sensorWindows; }
+    char *getHistoryMetrics(void) { return _record.data.historyMetrics; }
+    char *getNTPServer(void) { return _record.data.ntpServer; }
+    void setNTPServer(const char *value)
+    {
+        strncpy(_record.data.ntpServer, value, 64);
+        _record.data.ntpServer[63] = '\0';
+    }
+    uint8_t getSensorBatch(void) { return _record.data.sensorBatch; }
+    uint16_t getSensorBatchAge(void) { return _record.data.sensorBatchAge; }
+
+    bool getMDNSEnabled(void) { return _record.data.mdnsEnabled != 0; }
+    void setMDSNEnabled(bool value) { _record.data.mdnsEnabled = value ? 1 : 0; }
+
+    uint16_t getHTTPRateLimit(void) { return _record.data.httpRateLimit; }
+    void setHTTPRateLimit(uint16_t value) { _record.data.httpRateLimit = value; }
+
+    uint16_t getHTTPRateBurst(void) { return _record.data.httpRateBurst; }
+    void setHTTPRateBurst(uint16_t value) { _record.data.httpRateBurst = (value == 0) ? 1 : value; }
+
+    uint8_t getHTTPMaxInFlight(void) { return _record.data.httpMaxInFlight; }
+    void setHTTPMaxInFlight(uint8_t value) { _record.data.httpMaxInFlight = (value == 0) ? 1 : value; }
+
+    uint16_t getOTATrialWindow(void) { return _record.data.otaTrialWindow; }
+    void setOTATrialWindow(uint16_t value) { _record.data.otaTrialWindow = value; }
+
+    static const ConfigField *getField(const char *name);
+    static const __FlashStringHelper *getFieldHint(const ConfigField &field)
+    {
+        return (pgm_read_byte(field.hint) != '\0') ? FPSTR(field.hint) : ((field.flags & FIELD_REQUIRED) ? F("required") : F("optional"));
+    }
+    const char *getFieldText(const ConfigField &field, char *number, size_t size);
+    String getFieldValue(const ConfigField &field);
+    bool setFieldValue(const ConfigField &field, const String &value);
+    bool changeField(const ConfigField &field, const String &value);
+
+    void apply(void);
+    configApply_t getPendingApply(void) { return _pendingApply; }
 
     bool getSaveNeeded(void) { return _shouldSaveConfig; }
-    void setSaveNeeded(void) { _shouldSaveConfig = true; }
+    void setSaveNeeded(void)
+    {
+        _shouldSaveConfig = true;
+        _changedAt = millis();
+    }
 
     float getVersion(void) { return _version; }
 
@@ -123,23 +353,28 @@ public:
 
 protected:
     void configPrint(void);
-    
+    bool _readRecord(void);
+    bool _writeRecord(void);
+    void _replayJournal(void);
+    bool _replayEntries(const uint8_t *buffer, size_t length);
+    bool _appendJournal(const uint8_t *entries, size_t length);
+    void _applyPending(void);
+    void _keepRollback(bool restore);
+    void _readLegacy(void);
+    void _removeLegacy(void);
+
     bool _alive;
 
-    char _wifiSSID[32]; // Leave unset for wireless autoconfig. Note that these values will be lost
-    char _wifiPass[64]; // when updating, but that's probably OK because they will be saved in EEPROM.
+    uint8_t *_fieldData(const ConfigField &field) { return (uint8_t *)&_record.data + field.offset; }
 
-    // These defaults may be overwritten with values saved by the web interface
-    // Note that MQTT prefers dotted quad address, but MQTTS prefers fully qualified domain names (fqdn)
-    // Note that MQTTS works best using NTP to obtain Time
-    char _mqttServer[64];
-    char _mqttPort[6];
-    char _mqttUser[32];
-    char _mqttPassword[32];
-    char _nodeName[16];
-    char _groupName[16];
-    bool _mdnsEnabled;        // mDNS is enabled
-    bool _shouldSaveConfig;   // Flag to save json config to SPIFFS
+    ConfigRecord _record;     // every persisted setting, read and written in one piece
+    ConfigData _persisted;    // what storage holds, changes are found by comparing against it
+    size_t _journalSize;      // bytes in the journal since the record was last written
+    uint8_t _journalKeys;     // NVS keys it is spread over on ESP32, one per flush
+    bool _shouldSaveConfig;   // Flag to save the config record
+    uint32_t _changedAt;      // millis() of the last change, writes wait for CONFIG_WRITE_DELAY of quiet
+    configApply_t _pendingApply; // the most disruptive kind of change waiting to be applied
+    uint8_t _rollback[CONFIG_ROLLBACK_SIZE]; // APPLY_RECONNECT fields before the pending changes, to go back to if MQTT won't connect
     float _version = VERSION; // Current software release version
 
 #pragma endregion Protected
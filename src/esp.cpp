@@ -1,6 +1,10 @@
 #include "common.h"
 #include <ArduinoOTA.h>
 #include <ArduinoJson.h>
+#include <DNSServer.h>
+#ifdef ESP_32
+#include <esp_wifi.h>
+#endif
 
 // TODO: Class These!
 WiFiClient wifiClient; // client for OTA
@@ -8,20 +12,22 @@ WiFiClient wifiClient; // client for OTA
 // a reference to our global copy of self, so we can make working callbacks
 extern Esp esp;
 
-// Function implementing callback cannot itself be a class member
-static void configSaveCallback()
-{ // Callback notifying our config class of the need to save config
-    config.saveCallback();
-}
+DNSServer dnsServer; // answers every name with our address while the setup network is up
 
-// Function implementing callback cannot itself be a class member
-void configWiFiCallback(ESP_WiFiManager *myWiFiManager)
-{
-  debug.printLn(F("WIFI: Failed to connect to assigned AP, entering config mode"));
-    while (millis() < 800)
-    { // for factory-reset system this will be called before display is responsive. give it a second.
-        delay(10);
+static const uint32_t wifiCacheMagic = 0x57494632; // "WIF2", the layout that carries no lease
+
+#ifdef ESP_32
+// survives a restart but not a power cycle, like the ESP8266 RTC user memory
+RTC_NOINIT_ATTR WiFiCache rtcWiFiCache;
+#endif
+
+static uint32_t wifiHash(const uint8_t *data, size_t length, uint32_t hash = 2166136261)
+{ // FNV-1a, enough to tell a stale or foreign cache from ours
+    while (length--)
+    {
+        hash = (hash ^ *data++) * 16777619;
     }
+    return hash;
 }
 
 static void resetCallback()
@@ -30,7 +36,20 @@ static void resetCallback()
 }
 
 void Esp::begin()
-{                // called in the main code setup, handles our initialisation
+{ // called in the main code setup, handles our initialisation
+    _lastConnectTime = 0;
+    _lastConnectFast = false;
+    _bootToOnlineTime = 0;
+    _reconnects = 0;
+    _roams = 0;
+    _roamScanning = false;
+    _roamScanAt = 0;
+    _linkSampleAt = 0;
+    _linkNext = 0;
+    _linkSamples = 0;
+    _portalActive = false;
+    _portalJoining = false;
+    _loadWiFiCache();
     wiFiSetup(); // Start up networking
     // in the original setup() routine, there were other calls here
     // so we have bought setupOTA forward in time...
@@ -39,6 +58,11 @@ void Esp::begin()
 
 void Esp::loop()
 { // called in the main code loop, handles our periodic code
+    if (_portalActive)
+    { // nothing to reconnect to until we've been told where
+        _portalLoop();
+        return;
+    }
     while ((WiFi.status() != WL_CONNECTED) || (WiFi.localIP().toString() == "0.0.0.0"))
     { // Check WiFi is connected and that we have a valid IP, retry until we do.
         // NB: tight-looping here breaks code that depends on running periodically, like MQTT clients and ArduinoOTA
@@ -49,11 +73,14 @@ void Esp::loop()
         }
         wiFiReconnect();
     }
+    _sampleLink();
+    _roam();
 }
 
 void Esp::reset()
 {
     debug.printLn(F("RESET: ESP reset"));
+    config.flush(); // don't lose changes still waiting to be written
     mqtt.goodbye();
 #ifdef ESP_32
     ESP.restart();
@@ -70,114 +97,400 @@ void Esp::wiFiSetup()
     WiFi.setAutoReconnect(true);         // Tell WiFi to autoreconnect if connection has dropped
     WiFi.setSleep(false); // Disable WiFi sleep modes to prevent occasional disconnects
 
-    if (String(config.getWIFISSID()) == "")
-    { // If the sketch has not defined a static wifiSSID use WiFiManager to collect required information from the user.
-
-        // id/name, placeholder/prompt, default value, length, extra tags
-        ESP_WMParameter custom_nodeNameHeader("<br/><br/><b>Node Name</b>");
-        ESP_WMParameter custom_nodeName("nodeName", "Node (required. lowercase letters, numbers, and _ only)", config.getNodeName(), 15, " maxlength=15 required pattern='[a-z0-9_]*'");
-        ESP_WMParameter custom_groupName("groupName", "Group Name (required)", config.getGroupName(), 15, " maxlength=15 required");
-        ESP_WMParameter custom_mqttHeader("<br/><br/><b>MQTT Broker</b>");
-        ESP_WMParameter custom_mqttServer("mqttServer", "MQTT Server", config.getMQTTServer(), 63, " maxlength=39");
-        ESP_WMParameter custom_mqttPort("mqttPort", "MQTT Port", config.getMQTTPort(), 5, " maxlength=5 type='number'");
-        ESP_WMParameter custom_mqttUser("mqttUser", "MQTT User", config.getMQTTUser(), 31, " maxlength=31");
-        ESP_WMParameter custom_mqttPassword("mqttPassword", "MQTT Password", config.getMQTTPassword(), 31, " maxlength=31 type='password'");
-        ESP_WMParameter custom_configHeader("<br/><br/><b>Admin access</b>");
-        ESP_WMParameter custom_configUser("configUser", "Config User", web.getUser(), 15, " maxlength=31'");
-        ESP_WMParameter custom_configPassword("configPassword", "Config Password", web.getPassword(), 31, " maxlength=31 type='password'");
-
-        ESP_WiFiManager wifiManager;
-
-        wifiManager.setSaveConfigCallback(configSaveCallback); // set config save notify callback
-        wifiManager.setCustomHeadElement(web.getStyle());      // add custom style
-        wifiManager.addParameter(&custom_nodeNameHeader);
-        wifiManager.addParameter(&custom_nodeName);
-        wifiManager.addParameter(&custom_groupName);
-        wifiManager.addParameter(&custom_mqttHeader);
-        wifiManager.addParameter(&custom_mqttServer);
-        wifiManager.addParameter(&custom_mqttPort);
-        wifiManager.addParameter(&custom_mqttUser);
-        wifiManager.addParameter(&custom_mqttPassword);
-        wifiManager.addParameter(&custom_configHeader);
-        wifiManager.addParameter(&custom_configUser);
-        wifiManager.addParameter(&custom_configPassword);
-
-        // Timeout config portal after connectTimeout seconds, useful if configured wifi network was temporarily unavailable
-        wifiManager.setTimeout(_connectTimeout);
-
-        wifiManager.setAPCallback(configWiFiCallback);
-
-        // Fetches SSID and pass from EEPROM and tries to connect
-        // If it does not connect it starts an access point with the specified name
-        // and goes into a blocking loop awaiting configuration.
-        if (!wifiManager.autoConnect(_wifiConfigAP, _wifiConfigPass))
-        { // Reset and try again
+    String storedSSID, storedPass;
+    _credentials(storedSSID, storedPass);
+    if ((String(config.getWIFISSID()) == "") && ((storedSSID == "") || !_join(WIFI_STORED_CONNECT_TIMEOUT)))
+    { // If the sketch has not defined a static wifiSSID, and the network left in the SDK isn't there, open our setup network
+        // and carry on: esp.loop() runs it alongside everything else and moves us over once we're given a network
+        _startPortal();
+        return;
+    }
+    else if (String(config.getWIFISSID()) == "")
+    { // joined on what WiFiManager left in the SDK: take it into our config, so the config page shows the network in use
+        config.setFieldValue(configFields[CONFIG_FIELD_wifiSSID], storedSSID);
+        config.setFieldValue(configFields[CONFIG_FIELD_wifiPass], storedPass);
+        config.setSaveNeeded();
+    }
+    else if (String(config.getWIFISSID()) != "")
+    { // wifiSSID has been defined, so attempt to connect to it forever
+        debug.printLn(WIFI, String(F("Connecting to WiFi network: ")) + String(config.getWIFISSID()));
+        if (!_join(_joinTimeout(_connectTimeout)))
+        { // If we've been trying to connect for connectTimeout seconds, reboot and try again
             debug.printLn(WIFI, F("WIFI: Failed to connect and hit timeout"));
+            power.giveUp();
             reset();
         }
+    }
+    // If you get here you have connected to WiFi
+    debug.printLn(WIFI, String(F("WIFI: Connected successfully and assigned IP: ")) + WiFi.localIP().toString());
+}
 
-        // Read updated parameters
-        config.setMQTTServer(custom_mqttServer.getValue());
-        config.setMQTTPort(custom_mqttPort.getValue());
-        config.setMQTTUser(custom_mqttUser.getValue());
-        config.setMQTTPassword(custom_mqttPassword.getValue());
-        config.setNodeName(custom_nodeName.getValue());
-        config.setGroupName(custom_groupName.getValue());
-        web.setUser(custom_configUser.getValue());
-        web.setPassword(custom_configPassword.getValue());
+void Esp::wiFiReconnect()
+{ // Existing WiFi connection dropped, try to reconnect
+    debug.printLn(WIFI, F("Reconnecting to WiFi network..."));
+    _reconnects++;
+    if (!_join(_joinTimeout(_reConnectTimeout)))
+    { // If we've been trying to reconnect for reConnectTimeout seconds, reboot and try again
+        debug.printLn(WIFI, F("WIFI: Failed to reconnect and hit timeout"));
+        power.giveUp();
+        reset();
+    }
+}
+
+uint32_t Esp::_joinTimeout(uint32_t seconds)
+{ // a duty cycling node sleeps through the rest of its cycle rather than spend its battery waiting on WiFi
+    const uint32_t timeout = seconds * ASECOND;
+    return power.isDutyCycling() ? min(timeout, (uint32_t)POWER_AWAKE_LIMIT) : timeout;
+}
 
-        config.saveFileIfNeeded();
+bool Esp::_join(uint32_t timeout)
+{ // join one of our networks, going straight to the last good access point when we know it and scanning when that fails
+    const uint32_t started = millis();
+    String ssid, pass;
+    WiFi.mode(WIFI_STA);
+
+    _lastConnectFast = false;
+    for (uint8_t i = 0; (i < WIFI_CANDIDATES) && (_wifiCache.magic == wifiCacheMagic); i++)
+    { // find the network the cache was learned on
+        if (_candidate(i, ssid, pass) && (_wifiCache.ssidHash == wifiHash((const uint8_t *)ssid.c_str(), ssid.length())))
+        {
+            break;
+        }
+        ssid = "";
     }
-    else
-    { // wifiSSID has been defined, so attempt to connect to it forever
-        debug.printLn(WIFI, String(F("Connecting to WiFi network: ")) + String(config.getWIFISSID()));
+    if (ssid != "")
+    {
+        _configureIP();
+        WiFi.begin(ssid.c_str(), pass.c_str(), _wifiCache.channel, _wifiCache.bssid);
+        _lastConnectFast = _waitConnected(WIFI_FAST_CONNECT_TIMEOUT);
+        if (!_lastConnectFast)
+        { // the access point moved or went away
+            debug.printLn(WIFI, F("WIFI: fast connect failed, scanning"));
+            WiFi.disconnect();
+            _wifiCache.magic = 0;
+        }
+    }
+    if (!_lastConnectFast)
+    {
+        _configureIP();
+        String other, otherPass;
+        _candidate(0, ssid, pass);
+        if (_candidate(1, other, otherPass) || _candidate(2, other, otherPass))
+        { // with a choice of networks, take the strongest access point of any of them
+            const int8_t best = _bestNetwork(WiFi.scanNetworks(), INT8_MIN, ssid, pass);
+            if (best >= 0)
+            {
+                WiFi.begin(ssid.c_str(), pass.c_str(), WiFi.channel(best), WiFi.BSSID(best));
+            }
+            else
+            { // nothing we know is in range, let the SDK keep looking for the main one
+                WiFi.begin(ssid.c_str(), pass.c_str());
+            }
+            WiFi.scanDelete();
+        }
+        else
+        {
+            WiFi.begin(ssid.c_str(), pass.c_str());
+        }
+        if (!_waitConnected(timeout))
+        {
+            return false;
+        }
+    }
+
+    _lastConnectTime = millis() - started;
+    if (_bootToOnlineTime == 0)
+    {
+        _bootToOnlineTime = millis();
+    }
+    _saveWiFiCache(ssid);
+    debug.printLn(WIFI, String(F("WIFI: joined ")) + WiFi.BSSIDstr() + String(F(" on channel ")) + String(WiFi.channel()) + String(F(" in ")) + String(_lastConnectTime) + String(_lastConnectFast ? F("ms (fast)") : F("ms")));
+    return true;
+}
+
+void Esp::joinNetwork(void)
+{ // start joining our network in the background while the setup network stays up, esp.loop() sees it through
+    String ssid, pass;
+    _credentials(ssid, pass);
+    if (!_portalActive || (ssid == ""))
+    {
+        return;
+    }
+    debug.printLn(WIFI, String(F("WIFI: setup network joining ")) + ssid);
+    WiFi.hostname(config.getNodeName()); // may have been set along with the network
+    _configureIP();
+    WiFi.begin(ssid.c_str(), pass.c_str());
+    _portalJoining = true;
+    _portalJoinAt = millis();
+}
+
+void Esp::_startPortal(void)
+{ // our own setup network, with DNS pointing every name at the config page
+    debug.printLn(WIFI, String(F("WIFI: no network to join, setup network ")) + String(_wifiConfigAP) + String(F(" is up")));
+    WiFi.mode(WIFI_AP_STA);
+    WiFi.softAP(_wifiConfigAP, _wifiConfigPass);
+    dnsServer.start(53, "*", WiFi.softAPIP());
+    _portalActive = true;
+    _portalJoining = false;
+    _portalJoinAt = millis();
+}
+
+void Esp::_portalLoop(void)
+{ // serve DNS for the setup network, and move over to our own network once we are on it
+    dnsServer.processNextRequest();
+    if (!_portalJoining)
+    { // a network that was down when we started, a router rebooting after a power cut say, gets another try now and again
+        if ((millis() - _portalJoinAt) >= WIFI_PORTAL_RETRY_INTERVAL)
+        {
+            joinNetwork();
+            _portalJoinAt = millis();
+        }
+        return;
+    }
+    if ((WiFi.status() == WL_CONNECTED) && WiFi.localIP().isSet())
+    {
+        String ssid, pass;
+        _credentials(ssid, pass);
+        _lastConnectTime = millis() - _portalJoinAt;
+        _bootToOnlineTime = millis();
+        _saveWiFiCache(ssid);
+        dnsServer.stop();
+        WiFi.softAPdisconnect(true);
         WiFi.mode(WIFI_STA);
-        WiFi.begin(config.getWIFISSID(), config.getWIFIPass());
+        _portalActive = false;
+        _portalJoining = false;
+        debug.printLn(WIFI, String(F("WIFI: joined ")) + ssid + String(F(" with IP ")) + WiFi.localIP().toString() + String(F(", setup network closed")));
+    }
+    else if ((millis() - _portalJoinAt) >= WIFI_PORTAL_JOIN_TIMEOUT)
+    { // stop searching, the setup network can't be used while the radio hops channels looking for ours
+        debug.printLn(WIFI, F("WIFI: [WARNING] setup network could not join, waiting for new settings"));
+        WiFi.disconnect();
+        _portalJoining = false;
+        _portalJoinAt = millis();
+    }
+}
+
+bool Esp::_candidate(uint8_t index, String &ssid, String &pass)
+{ // one of the networks we may join, false if that slot is unused
+    switch (index)
+    {
+    case 0:
+        _credentials(ssid, pass);
+        break;
+    case 1:
+        ssid = config.getWIFISSID2();
+        pass = config.getWIFIPass2();
+        break;
+    case 2:
+        ssid = config.getWIFISSID3();
+        pass = config.getWIFIPass3();
+        break;
+    default:
+        ssid = "";
+        pass = "";
+        break;
+    }
+    return ssid != "";
+}
 
-        uint32_t wifiReconnectTimer = millis();
-        while (WiFi.status() != WL_CONNECTED)
+int8_t Esp::_bestNetwork(int8_t found, int32_t floor, String &ssid, String &pass)
+{ // the strongest scan result above floor on any of our networks, other than the one we are on, or -1
+    int8_t best = -1;
+    int32_t bestRSSI = floor;
+    for (int8_t i = 0; i < found; i++)
+    {
+        if ((WiFi.RSSI(i) <= bestRSSI) || ((WiFi.status() == WL_CONNECTED) && (memcmp(WiFi.BSSID(i), WiFi.BSSID(), 6) == 0)))
         {
-            delay(500);
-            if (millis() >= (wifiReconnectTimer + (_connectTimeout * ASECOND)))
-            { // If we've been trying to reconnect for connectTimeout seconds, reboot and try again
-                debug.printLn(WIFI, F("WIFI: Failed to connect and hit timeout"));
-                reset();
+            continue;
+        }
+        String candidateSSID, candidatePass;
+        for (uint8_t c = 0; c < WIFI_CANDIDATES; c++)
+        {
+            if (_candidate(c, candidateSSID, candidatePass) && (WiFi.SSID(i) == candidateSSID))
+            {
+                best = i;
+                bestRSSI = WiFi.RSSI(i);
+                ssid = candidateSSID;
+                pass = candidatePass;
+                break;
             }
         }
     }
-    // If you get here you have connected to WiFi
-    debug.printLn(WIFI, String(F("WIFI: Connected successfully and assigned IP: ")) + WiFi.localIP().toString());
+    return best;
 }
 
-void Esp::wiFiReconnect()
-{ // Existing WiFi connection dropped, try to reconnect
-    debug.printLn(WIFI, F("Reconnecting to WiFi network..."));
-    WiFi.mode(WIFI_STA);
-    WiFi.begin(config.getWIFISSID(), config.getWIFIPass());
+void Esp::_roam(void)
+{ // when the signal gets poor look for a better access point in the background, and move if one is clearly better
+    if (_roamScanning)
+    {
+        const int8_t found = WiFi.scanComplete();
+        if (found == WIFI_SCAN_RUNNING)
+        {
+            return;
+        }
+        _roamScanning = false;
+        String ssid, pass;
+        const int32_t current = WiFi.RSSI();
+        const int8_t best = _bestNetwork(found, current + WIFI_ROAM_HYSTERESIS, ssid, pass);
+        if (best < 0)
+        {
+            WiFi.scanDelete();
+            return;
+        }
+        uint8_t bssid[6];
+        memcpy(bssid, WiFi.BSSID(best), sizeof(bssid));
+        const int32_t channel = WiFi.channel(best);
+        debug.printLn(WIFI, String(F("WIFI: roaming from ")) + WiFi.BSSIDstr() + String(F(" (")) + String(current) + String(F("dBm) to ")) + printHex8(bssid, sizeof(bssid)) + String(F(" (")) + String(WiFi.RSSI(best)) + String(F("dBm) on ")) + ssid);
+        WiFi.scanDelete();
+
+        const uint32_t started = millis();
+        _configureIP();
+        WiFi.begin(ssid.c_str(), pass.c_str(), channel, bssid);
+        const bool joined = _waitConnected(WIFI_FAST_CONNECT_TIMEOUT);
+        const uint8_t *joinedBSSID = joined ? WiFi.BSSID() : nullptr;
+        if ((joinedBSSID != nullptr) && (memcmp(joinedBSSID, bssid, sizeof(bssid)) == 0))
+        { // the SDK may have gone back to the old access point rather than the one we asked for
+            _roams++;
+            _lastConnectTime = millis() - started;
+            _lastConnectFast = true;
+            _saveWiFiCache(ssid);
+        }
+        // otherwise loop() finds us disconnected and reconnects the usual way, or we are still where we were
+        return;
+    }
+    if ((WiFi.RSSI() < WIFI_ROAM_THRESHOLD) && ((millis() - _roamScanAt) >= WIFI_ROAM_SCAN_INTERVAL))
+    {
+        _roamScanAt = millis();
+        _roamScanning = (WiFi.scanNetworks(true) == WIFI_SCAN_RUNNING);
+    }
+}
 
-    uint32_t wifiReconnectTimer = millis();
-    while (WiFi.status() != WL_CONNECTED)
+void Esp::_sampleLink(void)
+{ // keep a short history of the signal strength for telemetry
+    if ((_linkSamples != 0) && ((millis() - _linkSampleAt) < WIFI_LINK_SAMPLE_INTERVAL))
     {
-        delay(500);
-        if (millis() >= (wifiReconnectTimer + (_reConnectTimeout * ASECOND)))
-        { // If we've been trying to reconnect for reConnectTimeout seconds, reboot and try again
-            debug.printLn(WIFI, F("WIFI: Failed to reconnect and hit timeout"));
-            reset();
+        return;
+    }
+    _linkSampleAt = millis();
+    _linkHistory[_linkNext] = WiFi.RSSI();
+    _linkNext = (_linkNext + 1) % WIFI_LINK_HISTORY;
+    if (_linkSamples < WIFI_LINK_HISTORY)
+    {
+        _linkSamples++;
+    }
+}
+
+String Esp::getLinkHistory(void)
+{ // the RSSI samples as a JSON array, oldest first
+    String history = "[";
+    for (uint8_t i = 0; i < _linkSamples; i++)
+    {
+        if (i != 0)
+        {
+            history += ",";
         }
+        history += String(_linkHistory[(_linkNext + WIFI_LINK_HISTORY - _linkSamples + i) % WIFI_LINK_HISTORY]);
     }
+    return history + "]";
+}
+
+bool Esp::_waitConnected(uint32_t timeout)
+{ // wait for an association and an address, handling nothing else
+    const uint32_t started = millis();
+    while ((WiFi.status() != WL_CONNECTED) || !WiFi.localIP().isSet())
+    {
+        if ((millis() - started) >= timeout)
+        {
+            return false;
+        }
+        delay(10);
+    }
+    return true;
+}
+
+void Esp::_credentials(String &ssid, String &pass)
+{ // our network, from config or else wherever WiFiManager left it in the SDK
+    if (config.getWIFISSID()[0] != '\0')
+    {
+        ssid = config.getWIFISSID();
+        pass = config.getWIFIPass();
+        return;
+    }
+#ifdef ESP_32
+    wifi_config_t stored;
+    if (esp_wifi_get_config(WIFI_IF_STA, &stored) == 0)
+    {
+        ssid = String((const char *)stored.sta.ssid).substring(0, sizeof(stored.sta.ssid));
+        pass = String((const char *)stored.sta.password).substring(0, sizeof(stored.sta.password));
+    }
+#elif defined(ESP_8266)
+    ssid = WiFi.SSID();
+    pass = WiFi.psk();
+#endif
+}
+
+void Esp::_configureIP(void)
+{ // static addressing from config, or DHCP
+    IPAddress ip, gateway, subnet, dns;
+    if (ip.fromString(config.getStaticIP()) && gateway.fromString(config.getStaticGateway()) && subnet.fromString(config.getStaticSubnet()))
+    {
+        if (!dns.fromString(config.getStaticDNS()))
+        {
+            dns = gateway;
+        }
+        WiFi.config(ip, gateway, subnet, dns);
+    }
+    else
+    { // all zeros turns DHCP back on
+        WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
+    }
+}
+
+void Esp::_loadWiFiCache(void)
+{
+#ifdef ESP_32
+    _wifiCache = rtcWiFiCache;
+#elif defined(ESP_8266)
+    ESP.rtcUserMemoryRead(RTC_BLOCK_WIFI, (uint32_t *)&_wifiCache, sizeof(_wifiCache));
+#endif
+    if ((_wifiCache.magic != wifiCacheMagic) || (_wifiCache.check != wifiHash((const uint8_t *)&_wifiCache, offsetof(WiFiCache, check))))
+    { // cold boot, or not ours
+        memset(&_wifiCache, 0, sizeof(_wifiCache));
+    }
+}
+
+void Esp::_saveWiFiCache(const String &ssid)
+{ // remember where we are for next time
+    _wifiCache.magic = wifiCacheMagic;
+    _wifiCache.ssidHash = wifiHash((const uint8_t *)ssid.c_str(), ssid.length());
+    memcpy(_wifiCache.bssid, WiFi.BSSID(), sizeof(_wifiCache.bssid));
+    _wifiCache.channel = WiFi.channel();
+    _wifiCache.reserved = 0;
+    _wifiCache.check = wifiHash((const uint8_t *)&_wifiCache, offsetof(WiFiCache, check));
+#ifdef ESP_32
+    rtcWiFiCache = _wifiCache;
+#elif defined(ESP_8266)
+    ESP.rtcUserMemoryWrite(RTC_BLOCK_WIFI, (uint32_t *)&_wifiCache, sizeof(_wifiCache));
+#endif
+}
+
+void Esp::applyConfig()
+{ // settings we hold on to that can change while running
+    ArduinoOTA.setPassword(config.getConfigPassword());
 }
 
 void Esp::setupOta()
 { // (mostly) boilerplate OTA setup from library examples
 
     ArduinoOTA.setHostname(config.getNodeName());
-    ArduinoOTA.setPassword(web.getPassword());
+    ArduinoOTA.setPassword(config.getConfigPassword());
 
     ArduinoOTA.onStart([]() {
         debug.printLn(F("ESP OTA: update start"));
     });
     ArduinoOTA.onEnd([]() {
         debug.printLn(F("ESP OTA: update complete"));
+        ota.beginTrial();
         resetCallback();
     });
     ArduinoOTA.onProgress([](uint32_t progress, uint32_t total) {
@@ -3,7 +3,17 @@
 #include "common.h"
 #include "settings.h"
 #include <Arduino.h>
-#include <ESP_WiFiManager.h>
+
+// The last good connection, kept in RTC memory so a reconnect or warm boot can skip the scan and DHCP
+struct WiFiCache
+{
+    uint32_t magic;    // marks the record as ours
+    uint32_t ssidHash; // the network the rest was learned on
+    uint8_t bssid[6];  // access point we were associated with
+    uint8_t channel;   // and its channel
+    uint8_t reserved;  // the address isn't kept: DHCP always runs, so an expired lease can't be reused
+    uint32_t check;    // hash of everything above
+};
 
 class Esp
 {
@@ -27,10 +37,20 @@ public:
     void reset();
     void wiFiSetup();
     void wiFiReconnect();
+    void joinNetwork(void);
+    bool isProvisioning(void) { return _portalActive; }
     void setupOta();
+    void applyConfig();
 
     String getMacHex(void);
 
+    uint32_t getLastConnectTime(void) { return _lastConnectTime; }
+    bool getLastConnectFast(void) { return _lastConnectFast; }
+    uint32_t getBootToOnlineTime(void) { return _bootToOnlineTime; }
+    uint16_t getReconnects(void) { return _reconnects; }
+    uint16_t getRoams(void) { return _roams; }
+    String getLinkHistory(void);
+
     const char *getWiFiConfigPass(void) { return _wifiConfigPass; }
 
     const char *getWiFiConfigAP(void) { return _wifiConfigAP; }
@@ -50,6 +70,35 @@ protected:
     const uint32_t _connectTimeout = CONNECTION_TIMEOUT;         // Timeout for WiFi and MQTT connection attempts in seconds
     const uint32_t _reConnectTimeout = RECONNECT_TIMEOUT;        // Timeout for WiFi reconnection attempts in seconds
     uint8_t _espMac[6];                                          // Byte array to store our MAC address
+    WiFiCache _wifiCache;                                        // where we last connected, from RTC memory
+    uint32_t _lastConnectTime;                                   // msec the last WiFi connection took
+    bool _lastConnectFast;                                       // it went straight to the cached access point
+    uint32_t _bootToOnlineTime;                                  // msec from boot to the first WiFi connection
+    uint16_t _reconnects;                                        // WiFi reconnections since boot
+    uint16_t _roams;                                             // moves to a better access point since boot
+    bool _roamScanning;                                          // a background scan for a better access point is running
+    uint32_t _roamScanAt;                                        // millis() the last one started
+    uint32_t _linkSampleAt;                                      // millis() of the last link quality sample
+    int8_t _linkHistory[WIFI_LINK_HISTORY];                      // RSSI samples, a ring
+    uint8_t _linkNext;                                           // where the next sample goes
+    uint8_t _linkSamples;                                        // how many of them are filled
+    bool _portalActive;                                          // our setup network is up, waiting to be told which network to join
+    bool _portalJoining;                                         // and is trying the one it was given
+    uint32_t _portalJoinAt;                                      // millis() that try, or the last one, started
+
+    uint32_t _joinTimeout(uint32_t seconds);
+    bool _join(uint32_t timeout);
+    void _startPortal(void);
+    void _portalLoop(void);
+    bool _candidate(uint8_t index, String &ssid, String &pass);
+    int8_t _bestNetwork(int8_t found, int32_t floor, String &ssid, String &pass);
+    void _roam(void);
+    void _sampleLink(void);
+    bool _waitConnected(uint32_t timeout);
+    void _credentials(String &ssid, String &pass);
+    void _configureIP(void);
+    void _loadWiFiCache(void);
+    void _saveWiFiCache(const String &ssid);
 
 #pragma endregion Protected
 };
\ No newline at end of file
@@ -0,0 +1,165 @@
+// heapMonitor.cpp : Heap sampling, fragmentation trend alerts and a planned reboot before we run out
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "common.h"
+
+void HeapMonitor::begin()
+{ // called in the main code setup, handles our initialisation
+  memset(_samples, 0, sizeof(_samples));
+  _next = 0;
+  _count = 0;
+  _minFree = UINT32_MAX;
+  _minLargestBlock = UINT32_MAX;
+  _trendNext = 0;
+  _trendCount = 0;
+  _trendMin = UINT32_MAX;
+  _trendAt = millis();
+  _slope = 0;
+  _alert = HEAP_OK;
+  _activityAt = 0;
+  _sample();
+  _alive = true;
+}
+
+void HeapMonitor::loop()
+{ // called in the main code loop, handles our periodic code
+  if ((millis() - _sampledAt) < HEAP_SAMPLE_INTERVAL)
+  {
+    return;
+  }
+  _sample();
+  _trendMin = min(_trendMin, getLatest().largestBlock);
+  if ((millis() - _trendAt) >= HEAP_TREND_INTERVAL)
+  { // close the trend point, a day's projection wants hours behind it rather than the last few minutes
+    _trend[_trendNext] = _trendMin;
+    _trendNext = (_trendNext + 1) % HEAP_TREND_HISTORY;
+    if (_trendCount < HEAP_TREND_HISTORY)
+    {
+      _trendCount++;
+    }
+    _trendMin = UINT32_MAX;
+    _trendAt += HEAP_TREND_INTERVAL;
+    _slope = _fitSlope();
+  }
+
+  const heapAlert_t alert = _assess();
+  if (alert != _alert)
+  {
+    _alert = alert;
+    debug.printLn(String(F("HEAP: ")) + getAlertName() + String(F(", largest block ")) + String(getLatest().largestBlock) + String(F(" of ")) + String(getNeeded()) + String(F(" needed, trend ")) + String(_slope) + String(F(" bytes/hour")));
+    _publish();
+  }
+
+  if ((_alert == HEAP_CRITICAL) && HEAP_GRACEFUL_REBOOT && _quiet())
+  { // better now, cleanly, than an out of memory crash half way through something
+    debug.printLn(F("HEAP: [WARNING] restarting before the heap runs out"));
+    mqtt.publishStatusSubTopic("/heap", F("{\"alert\":\"rebooting\"}"));
+    esp.reset();
+  }
+}
+
+uint32_t HeapMonitor::getNeeded(void)
+{ // the largest single allocation we may still have to make: the String the MQTT client copies a full packet into,
+  // the flash sector buffer an update starts with, or a page that outgrows the scratch arena moving to the heap
+  return max(max((uint32_t)mqtt.getMaxPacketSize(), (uint32_t)HEAP_UPDATE_BLOCK), (uint32_t)SCRATCH_SIZE);
+}
+
+const char *HeapMonitor::getAlertName(void)
+{
+  static const char *const names[] = {"ok", "trending", "low", "critical"};
+  return names[_alert];
+}
+
+void HeapMonitor::_sample(void)
+{
+  HeapSample &sample = _samples[_next];
+  sample.free = ESP.getFreeHeap();
+#ifdef ESP_32
+  sample.largestBlock = ESP.getMaxAllocHeap();
+  sample.fragmentation = (sample.free == 0) ? 0 : (100 - ((sample.largestBlock * 100) / sample.free));
+#elif defined(ESP_8266)
+  sample.largestBlock = ESP.getMaxFreeBlockSize();
+  sample.fragmentation = ESP.getHeapFragmentation();
+#endif
+  _next = (_next + 1) % HEAP_SAMPLE_HISTORY;
+  if (_count < HEAP_SAMPLE_HISTORY)
+  {
+    _count++;
+  }
+  _minFree = min(_minFree, sample.free);
+  _minLargestBlock = min(_minLargestBlock, sample.largestBlock);
+  _sampledAt = millis();
+}
+
+int32_t HeapMonitor::_fitSlope(void)
+{ // least squares slope of the largest block across the trend ring, in bytes per hour
+  if (_trendCount < (HEAP_TREND_HISTORY / 4))
+  { // too short a time to call it a trend
+    return 0;
+  }
+  const uint8_t oldest = (_trendNext + HEAP_TREND_HISTORY - _trendCount) % HEAP_TREND_HISTORY;
+  const float meanX = (_trendCount - 1) / 2.0f;
+  float meanY = 0;
+  for (uint8_t i = 0; i < _trendCount; i++)
+  {
+    meanY += _trend[(oldest + i) % HEAP_TREND_HISTORY];
+  }
+  meanY /= _trendCount;
+  float covariance = 0;
+  float variance = 0;
+  for (uint8_t i = 0; i < _trendCount; i++)
+  { // oldest first
+    const float dx = i - meanX;
+    covariance += dx * (_trend[(oldest + i) % HEAP_TREND_HISTORY] - meanY);
+    variance += dx * dx;
+  }
+  return (int32_t)((covariance / variance) * (3600.0f * ASECOND / HEAP_TREND_INTERVAL));
+}
+
+heapAlert_t HeapMonitor::_assess(void)
+{ // compare the largest block, and where it is heading, against what we need
+  const uint32_t largest = getLatest().largestBlock;
+  const uint32_t needed = getNeeded();
+  if (largest < ((needed * HEAP_CRITICAL_PERCENT) / 100))
+  {
+    return HEAP_CRITICAL;
+  }
+  if (largest < ((needed * HEAP_LOW_PERCENT) / 100))
+  {
+    return HEAP_LOW;
+  }
+  if ((_slope < 0) && (largest > needed) && (((largest - needed) / (uint32_t)(-_slope)) < HEAP_ALERT_HORIZON))
+  {
+    return HEAP_TRENDING;
+  }
+  return HEAP_OK;
+}
+
+void HeapMonitor::_publish(void)
+{ // say what changed, retained next to our status so it is there for whoever looks
+  if (!mqtt.clientIsConnected())
+  {
+    return;
+  }
+  const HeapSample &latest = getLatest();
+  ScratchString payload;
+  payload.add(F("{\"alert\":\"")).add(getAlertName()).add(F("\","));
+  payload.add(F("\"largestBlock\":")).add(latest.largestBlock).add(F(","));
+  payload.add(F("\"needed\":")).add(getNeeded()).add(F(","));
+  payload.add(F("\"free\":")).add(latest.free).add(F(","));
+  payload.add(F("\"fragmentation\":")).add(latest.fragmentation).add(F(","));
+  payload.add(F("\"slope\":")).add(_slope).add(F(","));
+  payload.add(F("\"minFree\":")).add(_minFree).add(F(","));
+  payload.add(F("\"minLargestBlock\":")).add(_minLargestBlock).add(F("}"));
+  mqtt.publishStatusSubTopic("/heap", payload.c_str());
+}
+
+bool HeapMonitor::_quiet(void)
+{ // nothing in progress that a restart would cut short
+  if (ota.isRunning() || (config.getPendingApply() != APPLY_NONE))
+  {
+    return false;
+  }
+  return (millis() - _activityAt) >= HEAP_QUIET_TIME;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+
+// One look at the heap
+struct HeapSample
+{
+    uint32_t free;         // bytes free in total
+    uint32_t largestBlock; // biggest single allocation that would succeed
+    uint8_t fragmentation; // percent, 0 when all the free space is in one block
+};
+
+// how worried we are about the heap
+enum heapAlert_t
+{
+    HEAP_OK,       // the largest block is comfortably bigger than we need
+    HEAP_TRENDING, // it is shrinking and will reach what we need within HEAP_ALERT_HORIZON
+    HEAP_LOW,      // it is within HEAP_ALERT_FACTOR of what we need
+    HEAP_CRITICAL  // it is about to be too small, reboot at the next quiet moment
+};
+
+class HeapMonitor
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    HeapMonitor(void) { _alive = false; }
+
+    // destructor
+    ~HeapMonitor(void) { _alive = false; }
+
+    void begin();
+    void loop();
+    void activity(void) { _activityAt = millis(); }
+
+    const HeapSample &getLatest(void) { return _samples[(_next + HEAP_SAMPLE_HISTORY - 1) % HEAP_SAMPLE_HISTORY]; }
+    uint32_t getMinFree(void) { return _minFree; }
+    uint32_t getMinLargestBlock(void) { return _minLargestBlock; }
+    int32_t getSlope(void) { return _slope; }
+    uint32_t getNeeded(void);
+    heapAlert_t getAlert(void) { return _alert; }
+    const char *getAlertName(void);
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    bool _alive;
+    HeapSample _samples[HEAP_SAMPLE_HISTORY]; // ring of the latest samples
+    uint8_t _next;                            // where the next sample goes
+    uint8_t _count;                           // how many of them are filled
+    uint32_t _sampledAt;                      // millis() of the latest sample
+    uint32_t _minFree;                        // lowest free heap seen since boot
+    uint32_t _minLargestBlock;                // smallest largest block seen since boot
+    uint32_t _trend[HEAP_TREND_HISTORY];      // ring of the smallest largest block in each HEAP_TREND_INTERVAL
+    uint8_t _trendNext;                       // where the next trend point goes
+    uint8_t _trendCount;                      // how many of them are filled
+    uint32_t _trendMin;                       // smallest largest block in the point being gathered
+    uint32_t _trendAt;                        // millis() it was started
+    int32_t _slope;                           // largest block trend over the trend ring, bytes per hour
+    heapAlert_t _alert;                       // where we are now
+    uint32_t _activityAt;                     // millis() of the latest request or command, for finding a quiet moment
+
+    void _sample(void);
+    int32_t _fitSlope(void);
+    heapAlert_t _assess(void);
+    void _publish(void);
+    bool _quiet(void);
+
+#pragma endregion Protected
+};
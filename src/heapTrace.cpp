@@ -0,0 +1,186 @@
+// heapTrace.cpp : Heap allocations after setup(), counted by call site, to find what still allocates in loop()
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "common.h"
+#include <inttypes.h>
+#ifdef ESP_32
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#elif defined(ESP_8266)
+#include <coredecls.h> // can_yield()
+#endif
+
+#if HEAP_TRACE
+
+#ifdef ESP_32
+static TaskHandle_t loopTask = nullptr; // the WiFi and lwIP tasks allocate all the time, only loop() is ours to fix
+#endif
+
+static inline bool heapTraceInLoop(void)
+{ // true when the allocation comes from our code rather than the SDK
+#ifdef ESP_32
+  return xTaskGetCurrentTaskHandle() == loopTask;
+#elif defined(ESP_8266)
+  return can_yield(); // only true in the loop() context, not in SDK callbacks or interrupts
+#endif
+}
+
+static_assert(HEAP_TRACE_DEPTH <= 4, "heapTraceCallers() walks at most 4 frames");
+
+// the malloc caller alone is nearly always operator new or String, so a site is told apart by a few frames above it
+static void IRAM_ATTR __attribute__((noinline)) heapTraceCallers(uint32_t *callers)
+{ // return addresses of whoever asked for the memory, innermost first, zero past the last one found
+  memset(callers, 0, sizeof(uint32_t) * HEAP_TRACE_DEPTH);
+#ifdef ESP_32
+  // the windowed ABI keeps a frame chain; frame 0 is the wrapper, and the chain ends with an address below the code
+#define HEAP_TRACE_FRAME(n)                                            \
+  if (HEAP_TRACE_DEPTH > n)                                            \
+  {                                                                    \
+    callers[n] = (uint32_t)(uintptr_t)__builtin_return_address(n + 1); \
+    if (callers[n] < 0x40000000)                                       \
+    {                                                                  \
+      callers[n] = 0;                                                  \
+      return;                                                          \
+    }                                                                  \
+  }
+  HEAP_TRACE_FRAME(0)
+  HEAP_TRACE_FRAME(1)
+  HEAP_TRACE_FRAME(2)
+  HEAP_TRACE_FRAME(3)
+#undef HEAP_TRACE_FRAME
+#elif defined(ESP_8266)
+  // call0 code keeps no frame chain, so take the words up the stack that point into flash code, the same guess
+  // the exception decoder makes from a stack dump; the odd stale one shows up as a site that doesn't make sense
+  uint32_t marker = 0;
+  const volatile uint32_t *word = &marker;
+  uint8_t found = 0;
+  for (uint8_t i = 0; (i < HEAP_TRACE_SCAN) && (found < HEAP_TRACE_DEPTH); i++)
+  {
+    const uint32_t value = word[i];
+    if ((value >= 0x40201000) && (value < 0x40300000))
+    {
+      callers[found++] = value;
+    }
+  }
+#endif
+}
+
+// linked in place of the real ones by -Wl,--wrap=malloc etc, see the heaptrace environments in platformio.ini
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t count, size_t size);
+extern "C" void *__real_realloc(void *pointer, size_t size);
+
+extern "C" void *IRAM_ATTR __wrap_malloc(size_t size)
+{
+  if (heapTraceInLoop())
+  {
+    uint32_t callers[HEAP_TRACE_DEPTH];
+    heapTraceCallers(callers);
+    heapTrace.record(callers, size);
+  }
+  return __real_malloc(size);
+}
+
+extern "C" void *IRAM_ATTR __wrap_calloc(size_t count, size_t size)
+{
+  if (heapTraceInLoop())
+  {
+    uint32_t callers[HEAP_TRACE_DEPTH];
+    heapTraceCallers(callers);
+    heapTrace.record(callers, count * size);
+  }
+  return __real_calloc(count, size);
+}
+
+extern "C" void *IRAM_ATTR __wrap_realloc(void *pointer, size_t size)
+{
+  if (heapTraceInLoop())
+  {
+    uint32_t callers[HEAP_TRACE_DEPTH];
+    heapTraceCallers(callers);
+    heapTrace.record(callers, size);
+  }
+  return __real_realloc(pointer, size);
+}
+
+#endif
+
+void HeapTrace::begin()
+{ // called in the main code setup, handles our initialisation
+  _armed = false;
+  memset(_sites, 0, sizeof(_sites));
+  _allocations = 0;
+  _bytes = 0;
+  _unrecorded = 0;
+  _reportedAt = 0;
+  _reportedAllocations = 0;
+  _alive = true;
+}
+
+void HeapTrace::arm()
+{ // called at the end of setup(), everything allocated from here on is counted
+#if HEAP_TRACE
+#ifdef ESP_32
+  loopTask = xTaskGetCurrentTaskHandle();
+#endif
+  _reportedAt = millis();
+  _armed = true;
+  debug.printLn(F("HEAP: tracing allocations made after setup()"));
+#endif
+}
+
+void HeapTrace::loop()
+{ // called in the main code loop, handles our periodic code
+  if (_armed && (_allocations != _reportedAllocations) && ((millis() - _reportedAt) >= HEAP_TRACE_REPORT_INTERVAL))
+  {
+    _report();
+  }
+}
+
+void IRAM_ATTR HeapTrace::record(const uint32_t *callers, size_t size)
+{ // called from inside malloc, so it must not allocate itself
+  if (!_armed)
+  {
+    return;
+  }
+#if HEAP_TRACE_TRAP
+  abort(); // the backtrace shows who it was
+#endif
+  _allocations++;
+  _bytes += size;
+  for (uint8_t i = 0; i < HEAP_TRACE_SITES; i++)
+  {
+    if ((_sites[i].count == 0) || (memcmp(_sites[i].callers, callers, sizeof(_sites[i].callers)) == 0))
+    {
+      memcpy(_sites[i].callers, callers, sizeof(_sites[i].callers));
+      _sites[i].count++;
+      _sites[i].bytes += size;
+      return;
+    }
+  }
+  _unrecorded++;
+}
+
+void HeapTrace::_report(void)
+{ // log the call sites, addresses to be decoded with addr2line against the firmware .elf
+  _armed = false; // our own logging allocates
+  debug.printLn(String(F("HEAP: ")) + String(_allocations) + String(F(" allocations, ")) + String(_bytes) + String(F(" bytes after setup(), by call site:")));
+  for (uint8_t i = 0; (i < HEAP_TRACE_SITES) && (_sites[i].count != 0); i++)
+  {
+    char line[32 + HEAP_TRACE_DEPTH * 11];
+    int at = snprintf_P(line, sizeof(line), PSTR("HEAP:   %6" PRIu32 " %8" PRIu32), _sites[i].count, _sites[i].bytes);
+    for (uint8_t frame = 0; (frame < HEAP_TRACE_DEPTH) && (_sites[i].callers[frame] != 0); frame++)
+    {
+      at += snprintf_P(line + at, sizeof(line) - at, PSTR(" 0x%08" PRIx32), _sites[i].callers[frame]);
+    }
+    debug.printLn(line);
+  }
+  if (_unrecorded != 0)
+  {
+    debug.printLn(String(F("HEAP:   and ")) + String(_unrecorded) + String(F(" from call sites the table had no room for")));
+  }
+  _reportedAt = millis();
+  _reportedAllocations = _allocations;
+  _armed = true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+
+// One place in the code that allocated from the heap after setup()
+struct HeapTraceSite
+{
+    uint32_t callers[HEAP_TRACE_DEPTH]; // return addresses, the code that called malloc first, then its callers; decode with addr2line
+    uint32_t count;                     // allocations made from there, 0 for an unused entry
+    uint32_t bytes;                     // and their total size
+};
+
+// Counts heap allocations made from loop() once setup() is done, by call site.
+// Only does anything in a HEAP_TRACE build, where malloc, calloc and realloc are wrapped at link time.
+class HeapTrace
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    HeapTrace(void) { _alive = false; }
+
+    // destructor
+    ~HeapTrace(void) { _alive = false; }
+
+    void begin();
+    void loop();
+    void arm();
+    void record(const uint32_t *callers, size_t size);
+
+    uint32_t getAllocations(void) { return _allocations; }
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    bool _alive;
+    volatile bool _armed;                   // setup() is done and we are counting
+    HeapTraceSite _sites[HEAP_TRACE_SITES]; // fixed table, filled in order of first allocation
+    uint32_t _allocations;                  // allocations since arm()
+    uint32_t _bytes;                        // and their total size
+    uint32_t _unrecorded;                   // allocations from call sites that didn't fit in the table
+    uint32_t _reportedAt;                   // millis() of the last report
+    uint32_t _reportedAllocations;          // _allocations at that report
+
+    void _report(void);
+
+#pragma endregion Protected
+};
@@ -0,0 +1,81 @@
+// heatshrink.cpp : Streaming LZSS decoder used to unpack compressed firmware images on their way into flash
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "heatshrink.h"
+
+bool HeatshrinkDecoder::begin(uint8_t windowBits, uint8_t lookaheadBits)
+{ // parameters come from the image header, refuse anything our window cannot hold
+  if ((windowBits < 4) || (windowBits > HEATSHRINK_MAX_WINDOW_BITS) || (lookaheadBits < 3) || (lookaheadBits >= windowBits))
+  {
+    _windowBits = 0;
+    return false;
+  }
+  _windowBits = windowBits;
+  _lookaheadBits = lookaheadBits;
+  memset(_window, 0, sizeof(_window));
+  _head = 0;
+  _bits = 0;
+  _bitCount = 0;
+  _symbolBits = 0;
+  _state = DECODE_TAG;
+  return true;
+}
+
+void HeatshrinkDecoder::sink(const uint8_t *data, size_t length, heatshrinkSink_t out)
+{ // feed compressed bytes in, any amount at a time, decoded bytes come out through out()
+  for (size_t i = 0; i < length; i++)
+  {
+    _bits = (_bits << 8) | data[i];
+    _bitCount += 8;
+
+    bool progress = true;
+    while (progress)
+    {
+      progress = false;
+      if ((_state == DECODE_TAG) && (_bitCount >= 1))
+      {
+        _bitCount--;
+        _state = ((_bits >> _bitCount) & 1) ? DECODE_LITERAL : DECODE_BACKREF;
+        _symbolBits = 1;
+        progress = true;
+      }
+      else if ((_state == DECODE_LITERAL) && (_bitCount >= 8))
+      {
+        _bitCount -= 8;
+        _emit((_bits >> _bitCount) & 0xFF, out);
+        _state = DECODE_TAG;
+        _symbolBits = 0;
+        progress = true;
+      }
+      else if ((_state == DECODE_BACKREF) && (_bitCount >= _windowBits + _lookaheadBits))
+      {
+        _bitCount -= _windowBits;
+        const uint16_t offset = ((_bits >> _bitCount) & ((1 << _windowBits) - 1)) + 1;
+        _bitCount -= _lookaheadBits;
+        uint16_t count = ((_bits >> _bitCount) & ((1 << _lookaheadBits) - 1)) + 1;
+        const uint16_t mask = (1 << _windowBits) - 1;
+        while (count-- > 0)
+        {
+          _emit(_window[(_head - offset) & mask], out);
+        }
+        _state = DECODE_TAG;
+        _symbolBits = 0;
+        progress = true;
+      }
+    }
+    _bits &= (1UL << _bitCount) - 1;
+  }
+}
+
+bool HeatshrinkDecoder::isComplete(void)
+{ // true when whatever input is left over is only the padding of the final byte
+  return (_windowBits != 0) && ((_symbolBits + _bitCount) < 8);
+}
+
+void HeatshrinkDecoder::_emit(uint8_t value, heatshrinkSink_t out)
+{
+  _window[_head & ((1 << _windowBits) - 1)] = value;
+  _head++;
+  out(value);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+
+// receives each byte the decoder produces
+typedef void (*heatshrinkSink_t)(uint8_t value);
+
+// Streaming decoder for heatshrink (LZSS) compressed data, as written by tools/ota_pack.py or the heatshrink CLI.
+// Bits are read MSB first: a 1 tag bit is followed by an 8 bit literal, a 0 tag bit by a back-reference
+// of windowBits (offset - 1) and lookaheadBits (count - 1).
+class HeatshrinkDecoder
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    HeatshrinkDecoder(void) { _windowBits = 0; }
+
+    bool begin(uint8_t windowBits, uint8_t lookaheadBits);
+    void sink(const uint8_t *data, size_t length, heatshrinkSink_t out);
+    bool isComplete(void);
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    enum decodeState_t
+    {
+        DECODE_TAG,
+        DECODE_LITERAL,
+        DECODE_BACKREF
+    };
+
+    uint8_t _window[1 << HEATSHRINK_MAX_WINDOW_BITS]; // the last 2^windowBits bytes produced
+    uint16_t _head;                                   // where the next produced byte goes in the window
+    uint8_t _windowBits;
+    uint8_t _lookaheadBits;
+    uint32_t _bits;          // input bits not yet consumed, right aligned
+    uint8_t _bitCount;       // how many of them there are
+    uint8_t _symbolBits;     // bits already consumed for the symbol being decoded
+    decodeState_t _state;
+
+    void _emit(uint8_t value, heatshrinkSink_t out);
+
+#pragma endregion Protected
+};
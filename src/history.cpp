@@ -0,0 +1,472 @@
+// history.cpp : Selected sensor values kept on flash in fixed size rings, raw and rolled up, for when the broker isn't there
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "common.h"
+#include <FS.h>
+#include <inttypes.h>
+#ifdef ESP_32
+#include <SPIFFS.h>
+#endif
+
+// a ring file per level, and the seconds each of its entries covers
+static const char *const historyFiles[HISTORY_LEVELS] = {"/history0.bin", "/history1.bin", "/history2.bin"};
+static const uint32_t historySteps[HISTORY_LEVELS] = {0, HISTORY_ROLLUP_STEP, HISTORY_ROLLUP2_STEP};
+
+static uint8_t historyPutVarint(uint8_t *out, uint32_t value)
+{ // seven bits a byte, low first, top bit set on all but the last
+  uint8_t length = 0;
+  while (value >= 0x80)
+  {
+    out[length++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[length++] = value;
+  return length;
+}
+
+static uint32_t historyGetVarint(const uint8_t *in, uint16_t &position, uint16_t end)
+{ // the other way, stopping at the end of the block whatever the bytes say
+  uint32_t value = 0;
+  uint8_t shift = 0;
+  while ((position < end) && (shift < 35))
+  {
+    const uint8_t byte = in[position++];
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+    {
+      break;
+    }
+    shift += 7;
+  }
+  return value;
+}
+
+static uint32_t historyZigzag(int32_t value) { return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31); }
+static int32_t historyUnzigzag(uint32_t value) { return (int32_t)(value >> 1) ^ -(int32_t)(value & 1); }
+
+static void historyNumber(char *out, size_t size, int32_t hundredths)
+{ // a value in hundredths as a decimal, without going through float
+  const uint32_t magnitude = (hundredths < 0) ? -(uint32_t)hundredths : hundredths;
+  snprintf_P(out, size, PSTR("%s%" PRIu32 ".%02" PRIu32), (hundredths < 0) ? "-" : "", magnitude / 100, magnitude % 100);
+}
+
+void History::begin()
+{ // called in the main code setup, handles our initialisation
+#ifdef ESP_32
+  if (!SPIFFS.begin(true))
+  {
+    debug.printLn(F("HISTORY: [ERROR] Failed to mount FS"));
+    return;
+  }
+#elif defined(ESP_8266)
+  if (!SPIFFS.begin())
+  { // normally mounted already, for the config
+    debug.printLn(F("HISTORY: [ERROR] Failed to mount FS"));
+    return;
+  }
+#endif
+  _clockBase = 0;
+  for (uint8_t level = 0; level < HISTORY_LEVELS; level++)
+  {
+    _scan(level);
+  }
+  _flushedAt = millis();
+  _alive = true;
+  applyConfig();
+}
+
+void History::loop()
+{ // called in the main code loop, handles our periodic code
+  if (!_alive || (_metricCount == 0))
+  {
+    return;
+  }
+  const uint32_t time = now();
+  for (uint8_t level = 1; level < HISTORY_LEVELS; level++)
+  { // close rollups whose period is over, even if their sensor has gone quiet
+    for (uint8_t metric = 0; metric < _metricCount; metric++)
+    {
+      HistoryRollup &rollup = _rollups[level][metric];
+      if ((rollup.count != 0) && ((time - rollup.start) >= historySteps[level]))
+      {
+        _append(level, metric, rollup.start, lroundf(rollup.mean), rollup.minimum, rollup.maximum);
+        rollup.count = 0;
+      }
+    }
+  }
+  if ((millis() - _flushedAt) >= HISTORY_FLUSH_INTERVAL)
+  { // the blocks still filling are rewritten in place, so a restart loses at most this much
+    _flushedAt = millis();
+    for (uint8_t level = 0; level < HISTORY_LEVELS; level++)
+    {
+      if (_blocks[level].header.used != 0)
+      {
+        _write(level);
+      }
+    }
+  }
+}
+
+void History::applyConfig()
+{ // parse the historyMetrics setting; metric numbers change with it, so blocks from before are left out of queries
+  if (!_alive || (strcmp(_source, config.getHistoryMetrics()) == 0))
+  {
+    return;
+  }
+  for (uint8_t level = 0; level < HISTORY_LEVELS; level++)
+  { // keep what was gathered under the old numbering
+    if ((_metricCount != 0) && (_blocks[level].header.used != 0))
+    {
+      _write(level);
+      _nextSequence[level]++;
+    }
+  }
+  strncpy(_source, config.getHistoryMetrics(), sizeof(_source));
+  _source[sizeof(_source) - 1] = '\0';
+  _hash = 2166136261u;
+  for (const char *c = _source; *c != '\0'; c++)
+  { // FNV-1a
+    _hash = (_hash ^ (uint8_t)*c) * 16777619u;
+  }
+
+  _metricCount = 0;
+  char text[sizeof(_source)];
+  memcpy(text, _source, sizeof(text));
+  char *save;
+  for (char *name = strtok_r(text, " ,", &save); name != nullptr; name = strtok_r(nullptr, " ,", &save))
+  {
+    char *dot = strchr(name, '.');
+    if ((_metricCount == HISTORY_METRICS) || (dot == nullptr) ||
+        ((size_t)(dot - name) >= sizeof(HistoryMetric::sensor)) || (strlen(dot + 1) >= sizeof(HistoryMetric::value)))
+    {
+      debug.printLn(String(F("HISTORY: [ERROR] cannot keep ")) + String(name));
+      continue;
+    }
+    *dot = '\0';
+    strcpy(_metrics[_metricCount].sensor, name);
+    strcpy(_metrics[_metricCount].value, dot + 1);
+    _metricCount++;
+  }
+  memset(_rollups, 0, sizeof(_rollups));
+  for (uint8_t level = 0; level < HISTORY_LEVELS; level++)
+  {
+    _startBlock(level);
+  }
+  debug.printLn(String(F("HISTORY: keeping ")) + String(_metricCount) + String(F(" metrics")));
+}
+
+uint32_t History::now(void)
+{ // seconds on the history clock, which carries on from the newest block on flash across restarts,
+  // and jumps forward to epoch time once SNTP has it; it never goes back, so entries stay in order
+  const uint32_t uptime = millis() / ASECOND;
+  if (timeSync.isSynced() && (timeSync.epoch() > (_clockBase + uptime)))
+  {
+    _clockBase = timeSync.epoch() - uptime;
+  }
+  return _clockBase + uptime;
+}
+
+void History::record(SensorDriver *driver, const float *values)
+{ // a sensor sample: the values we keep go into the raw ring and the rollups
+  if (!_alive)
+  {
+    return;
+  }
+  const uint32_t time = now();
+  for (uint8_t metric = 0; metric < _metricCount; metric++)
+  {
+    if (strcmp(_metrics[metric].sensor, driver->name()) != 0)
+    {
+      continue;
+    }
+    for (uint8_t value = 0; value < driver->values(); value++)
+    {
+      if (strcmp(_metrics[metric].value, driver->valueName(value)) == 0)
+      {
+        const int32_t hundredths = lroundf(values[value] * 100);
+        _append(0, metric, time, hundredths, hundredths, hundredths);
+        for (uint8_t level = 1; level < HISTORY_LEVELS; level++)
+        {
+          _roll(level, metric, time, hundredths);
+        }
+      }
+    }
+  }
+}
+
+int8_t History::findMetric(const char *name)
+{ // "sensor.value" to its metric number, -1 if we don't keep it
+  const char *dot = strchr(name, '.');
+  if (dot == nullptr)
+  {
+    return -1;
+  }
+  for (uint8_t metric = 0; metric < _metricCount; metric++)
+  {
+    if ((strlen(_metrics[metric].sensor) == (size_t)(dot - name)) && (strncmp(_metrics[metric].sensor, name, dot - name) == 0) &&
+        (strcmp(_metrics[metric].value, dot + 1) == 0))
+    {
+      return metric;
+    }
+  }
+  return -1;
+}
+
+// Turns the entries of one metric into points, a step at a time, as the blocks holding them are read
+class HistoryReader
+{
+public:
+  HistoryReader(uint8_t metric, uint32_t from, uint32_t to, uint32_t step, metricsEmit_t emit)
+  {
+    _metric = metric;
+    _from = from;
+    _to = to;
+    _step = step;
+    _emit = emit;
+    _first = true;
+    _count = 0;
+  }
+
+  void decode(const HistoryBlock &block);
+  void flush(void);
+
+protected:
+  uint8_t _metric;
+  uint32_t _from;
+  uint32_t _to;
+  uint32_t _step;
+  metricsEmit_t _emit;
+  bool _first;      // no point sent yet, so no comma before the next
+  uint32_t _bucket; // start of the step being gathered
+  uint32_t _count;  // entries in it
+  int32_t _minimum;
+  int32_t _maximum;
+  int64_t _sum;
+};
+
+void HistoryReader::decode(const HistoryBlock &block)
+{ // walk a block's entries, keeping those for our metric and range
+  int32_t previous[HISTORY_METRICS] = {0};
+  uint32_t time = block.header.first;
+  uint16_t position = 0;
+  const uint16_t used = min((uint16_t)sizeof(block.data), block.header.used);
+  while (position < used)
+  {
+    const uint8_t metric = block.data[position++];
+    if (metric >= HISTORY_METRICS)
+    { // not something we wrote
+      return;
+    }
+    time += historyGetVarint(block.data, position, used);
+    const int32_t value = previous[metric] + historyUnzigzag(historyGetVarint(block.data, position, used));
+    int32_t low = value;
+    int32_t high = value;
+    if (block.header.level != 0)
+    {
+      low = value - (int32_t)historyGetVarint(block.data, position, used);
+      high = value + (int32_t)historyGetVarint(block.data, position, used);
+    }
+    previous[metric] = value;
+    if ((metric != _metric) || (time < _from) || (time > _to))
+    {
+      continue;
+    }
+    const uint32_t bucket = (_step == 0) ? time : time - (time % _step);
+    if ((_count != 0) && (bucket != _bucket))
+    {
+      flush();
+    }
+    if (_count == 0)
+    {
+      _bucket = bucket;
+      _minimum = low;
+      _maximum = high;
+      _sum = 0;
+    }
+    _minimum = min(_minimum, low);
+    _maximum = max(_maximum, high);
+    _sum += value;
+    _count++;
+  }
+}
+
+void HistoryReader::flush(void)
+{ // one point, [time,mean,min,max], for the step gathered so far
+  if (_count == 0)
+  {
+    return;
+  }
+  char mean[16], low[16], high[16], line[64];
+  historyNumber(mean, sizeof(mean), (int32_t)(_sum / (int32_t)_count));
+  historyNumber(low, sizeof(low), _minimum);
+  historyNumber(high, sizeof(high), _maximum);
+  const int length = snprintf_P(line, sizeof(line), PSTR("%s[%" PRIu32 ",%s,%s,%s]"), _first ? "" : ",", _bucket, mean, low, high);
+  _emit(line, length);
+  _first = false;
+  _count = 0;
+}
+
+void History::query(uint8_t metric, uint32_t from, uint32_t to, uint32_t step, metricsEmit_t emit)
+{ // read the coarsest level that still gives step, a block at a time, and hand the points on as they are decoded
+  uint8_t level = 0;
+  while ((level + 1 < HISTORY_LEVELS) && (step >= historySteps[level + 1]))
+  {
+    level++;
+  }
+  char line[96];
+  const int length = snprintf_P(line, sizeof(line), PSTR("{\"metric\":\"%s.%s\",\"now\":%" PRIu32 ",\"level\":%u,\"points\":["),
+                                _metrics[metric].sensor, _metrics[metric].value, now(), level);
+  emit(line, length);
+
+  HistoryReader reader(metric, from, to, step, emit);
+  File file = SPIFFS.open(historyFiles[level], "r");
+  if (file)
+  { // oldest first: the ring slot after the newest written is the oldest still there
+    static HistoryBlock block; // too big for the ESP8266's stack alongside the web server's
+    for (uint32_t i = 0; i < HISTORY_BLOCKS; i++)
+    {
+      const uint32_t slot = (_nextSequence[level] + i) % HISTORY_BLOCKS;
+      file.seek(slot * sizeof(HistoryBlock));
+      if ((file.read((uint8_t *)&block.header, sizeof(block.header)) != sizeof(block.header)) ||
+          (block.header.magic != HISTORY_MAGIC) || (block.header.level != level) || (block.header.metrics != _hash) ||
+          (block.header.sequence >= _nextSequence[level]) || (block.header.last < from) || (block.header.first > to))
+      { // empty, another numbering, the block still filling (its RAM copy is newer), or out of range
+        continue;
+      }
+      if (file.read(block.data, sizeof(block.data)) == sizeof(block.data))
+      {
+        reader.decode(block);
+      }
+      yield();
+    }
+    file.close();
+  }
+  if (_blocks[level].header.used != 0)
+  {
+    reader.decode(_blocks[level]);
+  }
+  reader.flush();
+  emit("]}", 2);
+}
+
+void History::_scan(uint8_t level)
+{ // find where the ring carries on, making the file at full size if it isn't there
+  _nextSequence[level] = 0;
+  File file = SPIFFS.open(historyFiles[level], "r");
+  if (file && (file.size() == HISTORY_BLOCKS * sizeof(HistoryBlock)))
+  {
+    HistoryBlockHeader header;
+    for (uint32_t slot = 0; slot < HISTORY_BLOCKS; slot++)
+    {
+      file.seek(slot * sizeof(HistoryBlock));
+      if ((file.read((uint8_t *)&header, sizeof(header)) == sizeof(header)) && (header.magic == HISTORY_MAGIC) && (header.level == level))
+      {
+        _nextSequence[level] = max(_nextSequence[level], header.sequence + 1);
+        if ((header.last + 1) > _clockBase)
+        { // our clock starts where the store left off
+          _clockBase = header.last + 1;
+        }
+      }
+    }
+    file.close();
+    return;
+  }
+  if (file)
+  {
+    file.close();
+  }
+  debug.printLn(String(F("HISTORY: creating ")) + String(historyFiles[level]));
+  file = SPIFFS.open(historyFiles[level], "w");
+  if (!file)
+  {
+    debug.printLn(String(F("HISTORY: [ERROR] cannot create ")) + String(historyFiles[level]));
+    return;
+  }
+  static const uint8_t zeros[64] = {0};
+  for (uint32_t written = 0; written < HISTORY_BLOCKS * sizeof(HistoryBlock); written += sizeof(zeros))
+  {
+    file.write(zeros, sizeof(zeros));
+  }
+  file.close();
+}
+
+void History::_startBlock(uint8_t level)
+{ // an empty block for the next slot of the ring
+  memset(&_blocks[level], 0, sizeof(HistoryBlock));
+  _blocks[level].header.magic = HISTORY_MAGIC;
+  _blocks[level].header.sequence = _nextSequence[level];
+  _blocks[level].header.metrics = _hash;
+  _blocks[level].header.level = level;
+  memset(_previous[level], 0, sizeof(_previous[level]));
+}
+
+void History::_append(uint8_t level, uint8_t metric, uint32_t time, int32_t mean, int32_t minimum, int32_t maximum)
+{ // encode an entry onto the level's block, writing the block out and starting the next when it is full
+  HistoryBlock &block = _blocks[level];
+  uint8_t entry[1 + 4 * 5];
+  uint8_t length = 0;
+  entry[length++] = metric;
+  length += historyPutVarint(entry + length, ((block.header.used != 0) && (time > block.header.last)) ? time - block.header.last : 0);
+  length += historyPutVarint(entry + length, historyZigzag(mean - _previous[level][metric]));
+  if (level != 0)
+  {
+    length += historyPutVarint(entry + length, max(0, mean - minimum));
+    length += historyPutVarint(entry + length, max(0, maximum - mean));
+  }
+  if (block.header.used + length > sizeof(block.data))
+  {
+    _write(level);
+    _nextSequence[level]++;
+    _startBlock(level);
+    _append(level, metric, time, mean, minimum, maximum); // again, against the new block
+    return;
+  }
+  if (block.header.used == 0)
+  {
+    block.header.first = time;
+    block.header.last = time;
+  }
+  memcpy(block.data + block.header.used, entry, length);
+  block.header.used += length;
+  block.header.last = max(block.header.last, time);
+  _previous[level][metric] = mean;
+}
+
+void History::_roll(uint8_t level, uint8_t metric, uint32_t time, int32_t value)
+{ // fold a sample into the level's period, closing the period first if the sample is past it
+  HistoryRollup &rollup = _rollups[level][metric];
+  if ((rollup.count != 0) && ((time - rollup.start) >= historySteps[level]))
+  {
+    _append(level, metric, rollup.start, lroundf(rollup.mean), rollup.minimum, rollup.maximum);
+    rollup.count = 0;
+  }
+  if (rollup.count == 0)
+  {
+    rollup.start = time - (time % historySteps[level]);
+    rollup.minimum = value;
+    rollup.maximum = value;
+    rollup.mean = value;
+  }
+  else
+  {
+    rollup.minimum = min(rollup.minimum, value);
+    rollup.maximum = max(rollup.maximum, value);
+    rollup.mean += (value - rollup.mean) / (rollup.count + 1);
+  }
+  rollup.count++;
+}
+
+bool History::_write(uint8_t level)
+{ // the block into its ring slot
+  File file = SPIFFS.open(historyFiles[level], "r+");
+  if (!file)
+  {
+    debug.printLn(String(F("HISTORY: [ERROR] cannot write ")) + String(historyFiles[level]));
+    return false;
+  }
+  file.seek((_blocks[level].header.sequence % HISTORY_BLOCKS) * sizeof(HistoryBlock));
+  const bool written = file.write((const uint8_t *)&_blocks[level], sizeof(HistoryBlock)) == sizeof(HistoryBlock);
+  file.close();
+  return written;
+}
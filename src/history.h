@@ -0,0 +1,108 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+#include "config.h"
+#include "metrics.h"
+
+class SensorDriver;
+
+#define HISTORY_LEVELS (3) // raw samples, then two rollups
+
+// What starts every block of the store, on flash and in RAM
+struct HistoryBlockHeader
+{
+    uint32_t magic;    // HISTORY_MAGIC, anything else is an empty slot
+    uint32_t sequence; // blocks written to this level before this one, the oldest is overwritten first
+    uint32_t first;    // history clock of the first entry
+    uint32_t last;     // and of the latest
+    uint32_t metrics;  // hash of the historyMetrics setting the metric numbers come from
+    uint16_t used;     // bytes of entries
+    uint8_t level;
+    uint8_t reserved;
+};
+
+#define HISTORY_MAGIC (0x54534948) // "HIST"
+
+// Entries are a metric number, the seconds since the previous entry, and the value in hundredths as a zigzag varint
+// difference from that metric's previous value in the block; rollups add how far min and max are from the mean.
+struct HistoryBlock
+{
+    HistoryBlockHeader header;
+    uint8_t data[HISTORY_BLOCK_SIZE - sizeof(HistoryBlockHeader)];
+};
+
+// One metric's rollup in progress at one level
+struct HistoryRollup
+{
+    uint32_t start; // history clock the period began
+    uint32_t count;
+    int32_t minimum; // hundredths
+    int32_t maximum;
+    float mean;
+};
+
+// One metric named in the historyMetrics setting
+struct HistoryMetric
+{
+    char sensor[16];
+    char value[16];
+};
+
+class History
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    History(void)
+    {
+        _alive = false;
+        _metricCount = 0;
+        _source[0] = '\0';
+    }
+
+    // destructor
+    ~History(void) { _alive = false; }
+
+    void begin();
+    void loop();
+    void applyConfig();
+
+    void record(SensorDriver *driver, const float *values);
+    int8_t findMetric(const char *name);
+    // stream what we have for metric between from and to, in step second buckets (0 for every entry), as JSON
+    void query(uint8_t metric, uint32_t from, uint32_t to, uint32_t step, metricsEmit_t emit);
+
+    uint32_t now(void);
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    bool _alive;
+    char _source[sizeof(((ConfigData *)nullptr)->historyMetrics)]; // the setting the metric numbers come from
+    uint32_t _hash;           // of _source, stamped on every block
+    HistoryMetric _metrics[HISTORY_METRICS];
+    uint8_t _metricCount;
+    HistoryBlock _blocks[HISTORY_LEVELS];                  // the block being filled at each level
+    int32_t _previous[HISTORY_LEVELS][HISTORY_METRICS];    // each metric's latest value in that block
+    uint32_t _nextSequence[HISTORY_LEVELS];
+    HistoryRollup _rollups[HISTORY_LEVELS][HISTORY_METRICS]; // level 0 is raw and doesn't use its row
+    uint32_t _clockBase;      // history clock at millis() 0, carries on from the newest block on flash, epoch once synced
+    uint32_t _flushedAt;      // millis() the partly filled blocks were last written
+
+    void _scan(uint8_t level);
+    void _startBlock(uint8_t level);
+    void _append(uint8_t level, uint8_t metric, uint32_t time, int32_t mean, int32_t minimum, int32_t maximum);
+    void _roll(uint8_t level, uint8_t metric, uint32_t time, int32_t value);
+    bool _write(uint8_t level);
+
+#pragma endregion Protected
+};
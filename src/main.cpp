@@ -10,6 +10,9 @@ void setup()
   Serial.begin(9600); // Serial - LCD RX (after swap), debug TX
 
   debug.begin();
+  scratch.begin();
+  heapTrace.begin();
+  heapMonitor.begin();
 
   debug.printLn(SYSTEM, String(F("SYSTEM: Starting v")) + String(VERSION));
 #ifdef ESP_32
@@ -23,6 +26,8 @@ void setup()
 #endif
 
   config.begin();
+  ota.begin(); // count this boot against a firmware on trial before anything can hang
+  power.begin();
   esp.begin();
 
 #ifdef ESP_32
@@ -32,15 +37,33 @@ void setup()
 #endif
 
   web.begin();
-  mqtt.begin();
+  timeSync.begin();
+  sensors.begin();
+  aggregator.begin();
+  history.begin();
+  buttons.begin();
+  rules.begin();
+  mqtt.begin(); // after everything that has to work without a broker, its first attempt can take a while
 
   debug.printLn(SYSTEM, F("SYSTEM: System init complete."));
+  heapTrace.arm();
 }
 
 void loop()
 {
+  config.loop();
   esp.loop();
   mqtt.loop();
+  timeSync.loop();
+  buttons.loop(); // early, the edges have been waiting since the interrupt
   ArduinoOTA.handle(); // Arduino OTA loop
+  ota.loop();
   web.loop();
+  sensors.loop();
+  aggregator.loop();
+  history.loop();
+  power.loop();
+  heapMonitor.loop();
+  heapTrace.loop();
+  scratch.loop(); // last, everything built in the arena this time round has been sent
 }
\ No newline at end of file
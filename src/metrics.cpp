@@ -0,0 +1,214 @@
+// metrics.cpp : Per-route HTTP counters and a Prometheus text rendering of them
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "common.h"
+#include <stdarg.h>
+#include <inttypes.h>
+
+// path of each route_t, used as the "route" label
+static const char *const routeNames[ROUTE_COUNT] = {"/", "/saveConfig", "/resetConfig", "/reboot", "/login", "/logout", "/metrics", "/update", "/api/history", "notfound"};
+
+// histogram bucket upper bounds, in msec for counting and in seconds for the "le" label
+static const uint16_t latencyBoundsMs[METRICS_LATENCY_BUCKETS] = {5, 10, 25, 50, 100, 250, 500, 1000, 2500};
+static const char *const latencyLabels[METRICS_LATENCY_BUCKETS] = {"0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1", "2.5"};
+
+// "le" labels for the button edge to publish histogram, its bounds are in buttons.cpp
+static const char *const buttonLatencyLabels[BUTTON_LATENCY_BUCKETS] = {"0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25"};
+
+void Metrics::begin()
+{ // called in the main code setup, handles our initialisation
+  memset(_routes, 0, sizeof(_routes));
+  memset(_clients, 0, sizeof(_clients));
+  _clientsEvicted = 0;
+  _inRequest = false;
+  _alive = true;
+}
+
+void Metrics::requestStart(route_t route, uint32_t clientIP)
+{ // a handler is about to run
+  _currentRoute = route;
+  _requestStart = millis();
+  _inRequest = true;
+  _routes[route].requests++;
+  _countClient(clientIP);
+}
+
+void Metrics::responseSent(int code, size_t bytes)
+{ // the handler sent a response, account for it against the route in flight
+  if (!_inRequest)
+  {
+    return;
+  }
+  RouteStats *stats = &_routes[_currentRoute];
+  if (code >= 100 && code < 600)
+  {
+    stats->statusClass[(code / 100) - 1]++;
+  }
+  stats->bytesSent += bytes;
+}
+
+void Metrics::bytesSent(size_t bytes)
+{ // more body bytes for the route in flight, for responses streamed in pieces
+  if (_inRequest)
+  {
+    _routes[_currentRoute].bytesSent += bytes;
+  }
+}
+
+void Metrics::requestEnd()
+{ // the handler returned, record how long it took
+  if (!_inRequest)
+  {
+    return;
+  }
+  _inRequest = false;
+  const uint32_t elapsed = millis() - _requestStart;
+  RouteStats *stats = &_routes[_currentRoute];
+  stats->latencySumMs += elapsed;
+  uint8_t bucket = 0;
+  while ((bucket < METRICS_LATENCY_BUCKETS) && (elapsed > latencyBoundsMs[bucket]))
+  {
+    bucket++;
+  }
+  stats->latencyBuckets[bucket]++;
+}
+
+void Metrics::_countClient(uint32_t clientIP)
+{ // bump the counter for this address, evicting the longest idle one when the table is full
+  ClientStats *slot = nullptr;
+  ClientStats *oldest = &_clients[0];
+  for (uint8_t i = 0; i < METRICS_CLIENT_SLOTS; i++)
+  {
+    if (_clients[i].requests != 0 && _clients[i].ip == clientIP)
+    {
+      slot = &_clients[i];
+      break;
+    }
+    if (_clients[i].requests == 0)
+    { // empty slots always win
+      oldest = &_clients[i];
+    }
+    else if (oldest->requests != 0 && (int32_t)(_clients[i].lastSeen - oldest->lastSeen) < 0)
+    {
+      oldest = &_clients[i];
+    }
+  }
+  if (slot == nullptr)
+  {
+    if (oldest->requests != 0)
+    {
+      _clientsEvicted++;
+    }
+    slot = oldest;
+    slot->ip = clientIP;
+    slot->requests = 0;
+  }
+  slot->requests++;
+  slot->lastSeen = millis();
+}
+
+void Metrics::_emitf(metricsEmit_t emit, PGM_P format, ...)
+{ // format one line into a fixed buffer and hand it on, no heap involved
+  static char line[160];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf_P(line, sizeof(line), format, args);
+  va_end(args);
+  if (length < 0)
+  {
+    return;
+  }
+  if ((size_t)length >= sizeof(line))
+  {
+    length = sizeof(line) - 1;
+  }
+  emit(line, length);
+}
+
+void Metrics::render(metricsEmit_t emit)
+{ // Prometheus text exposition format, version 0.0.4
+  static const char *const statusLabels[5] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+
+  _emitf(emit, PSTR("# HELP esp_http_requests_total HTTP responses by route and status class.\n# TYPE esp_http_requests_total counter\n"));
+  for (uint8_t route = 0; route < ROUTE_COUNT; route++)
+  {
+    for (uint8_t status = 0; status < 5; status++)
+    {
+      if (_routes[route].statusClass[status] != 0)
+      {
+        _emitf(emit, PSTR("esp_http_requests_total{route=\"%s\",code=\"%s\"} %" PRIu32 "\n"), routeNames[route], statusLabels[status], _routes[route].statusClass[status]);
+      }
+    }
+  }
+
+  _emitf(emit, PSTR("# HELP esp_http_requests_received_total HTTP requests by route, answered or not.\n# TYPE esp_http_requests_received_total counter\n"));
+  for (uint8_t route = 0; route < ROUTE_COUNT; route++)
+  {
+    if (_routes[route].requests != 0)
+    {
+      _emitf(emit, PSTR("esp_http_requests_received_total{route=\"%s\"} %" PRIu32 "\n"), routeNames[route], _routes[route].requests);
+    }
+  }
+
+  _emitf(emit, PSTR("# HELP esp_http_response_bytes_total HTTP response body bytes sent by route.\n# TYPE esp_http_response_bytes_total counter\n"));
+  for (uint8_t route = 0; route < ROUTE_COUNT; route++)
+  {
+    _emitf(emit, PSTR("esp_http_response_bytes_total{route=\"%s\"} %" PRIu32 "\n"), routeNames[route], _routes[route].bytesSent);
+  }
+
+  _emitf(emit, PSTR("# HELP esp_http_request_duration_seconds HTTP handler run time by route.\n# TYPE esp_http_request_duration_seconds histogram\n"));
+  for (uint8_t route = 0; route < ROUTE_COUNT; route++)
+  {
+    const RouteStats *stats = &_routes[route];
+    uint32_t cumulative = 0;
+    for (uint8_t bucket = 0; bucket < METRICS_LATENCY_BUCKETS; bucket++)
+    {
+      cumulative += stats->latencyBuckets[bucket];
+      _emitf(emit, PSTR("esp_http_request_duration_seconds_bucket{route=\"%s\",le=\"%s\"} %" PRIu32 "\n"), routeNames[route], latencyLabels[bucket], cumulative);
+    }
+    cumulative += stats->latencyBuckets[METRICS_LATENCY_BUCKETS];
+    _emitf(emit, PSTR("esp_http_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %" PRIu32 "\n"), routeNames[route], cumulative);
+    _emitf(emit, PSTR("esp_http_request_duration_seconds_sum{route=\"%s\"} %" PRIu32 ".%03" PRIu32 "\n"), routeNames[route], stats->latencySumMs / 1000, stats->latencySumMs % 1000);
+    _emitf(emit, PSTR("esp_http_request_duration_seconds_count{route=\"%s\"} %" PRIu32 "\n"), routeNames[route], cumulative);
+  }
+
+  _emitf(emit, PSTR("# HELP esp_http_client_requests_total HTTP requests by remote address, most recently active only.\n# TYPE esp_http_client_requests_total counter\n"));
+  for (uint8_t i = 0; i < METRICS_CLIENT_SLOTS; i++)
+  {
+    if (_clients[i].requests != 0)
+    {
+      const uint32_t ip = _clients[i].ip;
+      _emitf(emit, PSTR("esp_http_client_requests_total{ip=\"%" PRIu32 ".%" PRIu32 ".%" PRIu32 ".%" PRIu32 "\"} %" PRIu32 "\n"), ip & 0xFF, (ip >> 8) & 0xFF, (ip >> 16) & 0xFF, (ip >> 24) & 0xFF, _clients[i].requests);
+    }
+  }
+  _emitf(emit, PSTR("# HELP esp_http_clients_evicted_total Remote addresses dropped from the client table.\n# TYPE esp_http_clients_evicted_total counter\nesp_http_clients_evicted_total %" PRIu32 "\n"), _clientsEvicted);
+
+  if (buttons.getCount() != 0)
+  {
+    _emitf(emit, PSTR("# HELP esp_button_latency_seconds Time from a GPIO edge in the interrupt to its MQTT publish.\n# TYPE esp_button_latency_seconds histogram\n"));
+    const uint32_t *buckets = buttons.getLatencyBuckets();
+    uint32_t cumulative = 0;
+    for (uint8_t bucket = 0; bucket < BUTTON_LATENCY_BUCKETS; bucket++)
+    {
+      cumulative += buckets[bucket];
+      _emitf(emit, PSTR("esp_button_latency_seconds_bucket{le=\"%s\"} %" PRIu32 "\n"), buttonLatencyLabels[bucket], cumulative);
+    }
+    cumulative += buckets[BUTTON_LATENCY_BUCKETS];
+    _emitf(emit, PSTR("esp_button_latency_seconds_bucket{le=\"+Inf\"} %" PRIu32 "\n"), cumulative);
+    _emitf(emit, PSTR("esp_button_latency_seconds_sum %" PRIu32 ".%06" PRIu32 "\n"), buttons.getLatencySumUs() / 1000000, buttons.getLatencySumUs() % 1000000);
+    _emitf(emit, PSTR("esp_button_latency_seconds_count %" PRIu32 "\n"), cumulative);
+    _emitf(emit, PSTR("# HELP esp_button_bounces_total GPIO edges ignored as contact bounce.\n# TYPE esp_button_bounces_total counter\nesp_button_bounces_total %" PRIu32 "\n"), buttons.getBounces());
+    _emitf(emit, PSTR("# HELP esp_button_edges_dropped_total GPIO edges lost to a full capture ring.\n# TYPE esp_button_edges_dropped_total counter\nesp_button_edges_dropped_total %" PRIu32 "\n"), buttons.getDropped());
+  }
+
+  if (timeSync.isSynced())
+  {
+    _emitf(emit, PSTR("# HELP esp_time_syncs_total Times SNTP has set the clock.\n# TYPE esp_time_syncs_total counter\nesp_time_syncs_total %" PRIu32 "\n"), timeSync.getSyncs());
+    _emitf(emit, PSTR("# HELP esp_time_offset_milliseconds How far the clock was out at the latest sync.\n# TYPE esp_time_offset_milliseconds gauge\nesp_time_offset_milliseconds %" PRId32 "\n"), timeSync.getOffsetMs());
+    _emitf(emit, PSTR("# HELP esp_time_drift_ppm How much faster real time runs than our clock.\n# TYPE esp_time_drift_ppm gauge\nesp_time_drift_ppm %" PRId32 "\n"), timeSync.getDriftPpm());
+  }
+
+  _emitf(emit, PSTR("# HELP esp_scratch_high_water_bytes Most scratch arena bytes used in one loop, of %" PRIu32 ".\n# TYPE esp_scratch_high_water_bytes gauge\nesp_scratch_high_water_bytes %" PRIu32 "\n"), (uint32_t)SCRATCH_SIZE, (uint32_t)scratch.getHighWater());
+  _emitf(emit, PSTR("# HELP esp_scratch_overflows_total Pages and payloads that outgrew the scratch arena and went to the heap.\n# TYPE esp_scratch_overflows_total counter\nesp_scratch_overflows_total %" PRIu32 "\n"), scratch.getOverflows());
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+
+// every HTTP route we serve, used to index the per-route counters
+enum route_t
+{
+    ROUTE_ROOT,
+    ROUTE_SAVECONFIG,
+    ROUTE_RESETCONFIG,
+    ROUTE_REBOOT,
+    ROUTE_LOGIN,
+    ROUTE_LOGOUT,
+    ROUTE_METRICS,
+    ROUTE_UPDATE,
+    ROUTE_HISTORY,
+    ROUTE_NOTFOUND,
+    ROUTE_COUNT
+};
+
+#define METRICS_LATENCY_BUCKETS (9) // response time histogram buckets, plus one implicit +Inf bucket
+
+// Counters for one HTTP route
+struct RouteStats
+{
+    uint32_t requests;                                   // requests handled
+    uint32_t statusClass[5];                             // responses by status class 1xx..5xx
+    uint32_t bytesSent;                                  // response body bytes
+    uint32_t latencySumMs;                               // total time spent in the handler
+    uint32_t latencyBuckets[METRICS_LATENCY_BUCKETS + 1]; // non-cumulative histogram, last slot is +Inf
+};
+
+// Request counter for one remote address
+struct ClientStats
+{
+    uint32_t ip;       // IPv4 address as stored by IPAddress
+    uint32_t requests; // requests seen from this address
+    uint32_t lastSeen; // millis() of the latest request, used to pick an eviction victim
+};
+
+// signature of the sink that Metrics::render() hands each rendered chunk to
+typedef void (*metricsEmit_t)(const char *text, size_t length);
+
+class Metrics
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    Metrics(void) { _alive = false; }
+
+    // destructor
+    ~Metrics(void) { _alive = false; }
+
+    void begin();
+
+    void requestStart(route_t route, uint32_t clientIP);
+    void responseSent(int code, size_t bytes);
+    void bytesSent(size_t bytes);
+    void requestEnd();
+
+    void render(metricsEmit_t emit);
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    bool _alive;
+    RouteStats _routes[ROUTE_COUNT];             // per-route counters
+    ClientStats _clients[METRICS_CLIENT_SLOTS];  // most recently active remote addresses
+    uint32_t _clientsEvicted;                    // addresses dropped from the table to make room
+    route_t _currentRoute;                       // route of the request in flight
+    uint32_t _requestStart;                      // millis() when the request in flight started
+    bool _inRequest;                             // a request is being timed
+
+    void _countClient(uint32_t clientIP);
+    void _emitf(metricsEmit_t emit, PGM_P format, ...);
+
+#pragma endregion Protected
+};
@@ -1,6 +1,7 @@
 #include "common.h"
 #include <MQTT.h>
 #include <ArduinoOTA.h>
+#include <ArduinoJson.h>
 
 // Because the mqttClient object is defined outside the class, then the constant it uses must also be outside the class.
 static const uint16_t _mqttMaxPacketSize = MQTT_MAX_PACKET_SIZE; // Size of buffer for incoming MQTT message
@@ -26,9 +27,15 @@ void MqttSvc::begin()
 { // called in the main code setup, handles our initialisation
     _alive = true;
     _statusUpdateTimer = 0;
+    _failures = 0;
+    _attemptAt = 0;
+    _retryDelay = MQTT_RETRY_MIN;
     mqttClient.begin(config.getMQTTServer(), atoi(config.getMQTTPort()), wifiMQTTClient); // Create MQTT service object
     mqttClient.onMessage(mqtt_callback);                                                  // Setup MQTT callback function
-    connect();                                                                            // Connect to MQTT
+    if (!esp.isProvisioning())
+    { // otherwise loop() connects once we're on a network
+        connect();                                                                        // Connect to MQTT
+    }
 }
 
 void MqttSvc::loop()
@@ -37,10 +44,17 @@ void MqttSvc::loop()
     {
         begin();
     }
+    if (esp.isProvisioning())
+    { // no network to find a broker on yet
+        return;
+    }
     if (!mqttClient.connected())
     { // Check MQTT connection
-        debug.printLn("MQTT: not connected, connecting.");
         connect();
+        if (!mqttClient.connected())
+        { // the rest of the loop carries on without us until the next attempt
+            return;
+        }
     }
 
     mqttClient.loop(); // MQTT client loop
@@ -51,123 +65,217 @@ void MqttSvc::loop()
 }
 
 void MqttSvc::connect()
-{ // MQTT connection and subscriptions
-
-    static bool mqttFirstConnect = true; // For the first connection, we want to send an OFF/ON state to
-    // trigger any automations, but skip that if we reconnect while
-    // still running the sketch
+{ // MQTT connection and subscriptions, one attempt per retry delay so buttons, rules and sensors keep running without a broker
+    if (config.getMQTTServer()[0] == '\0')
+    { // nothing to connect to until a broker is set on the web page
+        return;
+    }
+    if ((_failures != 0) && ((millis() - _attemptAt) < _retryDelay))
+    {
+        return;
+    }
+    debug.printLn(F("MQTT: not connected, connecting."));
+    mqttClient.setHost(config.getMQTTServer(), atoi(config.getMQTTPort())); // the broker may have been set since the last attempt
+    _buildTopics();
+    _attemptAt = millis();
+    if (_attempt())
+    {
+        _failures = 0;
+        _retryDelay = MQTT_RETRY_MIN;
+        return;
+    }
+    // a duty cycling node gives up in power.loop() once it has been awake POWER_AWAKE_LIMIT
+    _failures++;
+    debug.printLn(String(F("MQTT connection attempt ")) + String(_failures) + String(F(" failed with rc ")) + String(mqttClient.returnCode()) + String(F(".  Trying again in ")) + String(_retryDelay / ASECOND) + String(F(" seconds.")));
+    _retryDelay = min(_retryDelay * 2, (uint32_t)MQTT_RETRY_MAX);
+}
 
-    // Check to see if we have a broker configured and notify the user if not
-    if (config.getMQTTServer()[0] == 0) // this check could be more elegant, eh?
+bool MqttSvc::reconnect(uint8_t attempts)
+{ // drop the broker connection and connect with the current config, false if that doesn't work within attempts
+    debug.printLn(String(F("MQTT: reconnecting to broker ")) + String(config.getMQTTServer()) + ":" + String(config.getMQTTPort()));
+    goodbye();
+    mqttClient.setHost(config.getMQTTServer(), atoi(config.getMQTTPort()));
+    _buildTopics();
+    for (uint8_t attempt = 1; attempt <= attempts; attempt++)
     {
-        while (config.getMQTTServer()[0] == 0)
-        { // Handle HTTP and OTA while we're waiting for MQTT to be configured
-            yield();
-            web.loop();
-            ArduinoOTA.handle(); // TODO: move this elsewhere!
+        if (_attempt())
+        {
+            _failures = 0;
+            _retryDelay = MQTT_RETRY_MIN;
+            return true;
+        }
+        debug.printLn(String(F("MQTT reconnect attempt ")) + String(attempt) + String(F(" failed with rc ")) + String(mqttClient.returnCode()));
+        if (attempt < attempts)
+        {
+            _wait(CONFIG_APPLY_RETRY_DELAY);
         }
     }
-    // MQTT topic string definitions
+    return false;
+}
+
+void MqttSvc::_buildTopics()
+{ // MQTT topic string definitions
     _stateTopic = "esp/" + String(config.getNodeName()) + "/state";
     _stateJSONTopic = "esp/" + String(config.getNodeName()) + "/state/json";
     _commandTopic = "esp/" + String(config.getNodeName()) + "/command";
     _groupCommandTopic = "esp/" + String(config.getGroupName()) + "/command";
     _statusTopic = "esp/" + String(config.getNodeName()) + "/status";
     _sensorTopic = "esp/" + String(config.getNodeName()) + "/sensor";
+}
+
+bool MqttSvc::_attempt()
+{ // one try at connecting to the broker and subscribing to our topics
+    static bool mqttFirstConnect = true; // For the first connection, we want to send an OFF/ON state to
+    // trigger any automations, but skip that if we reconnect while
+    // still running the sketch
 
     const String commandSubscription = _commandTopic + "/#";
     const String groupCommandSubscription = _groupCommandTopic + "/#";
-    
-    // Loop until we're reconnected to MQTT
-    while (!mqttClient.connected())
-    {
-        // Create a reconnect counter
-        static uint8_t mqttReconnectCount = 0;
 
-        // Generate an MQTT client ID as nodeName + our MAC address
-        _clientId = String(config.getNodeName()) + "-" + esp.getMacHex();
-        debug.printLn(String(F("MQTT: Attempting connection to broker ")) + String(config.getMQTTServer()) + " as clientID " + _clientId);
+    // Generate an MQTT client ID as nodeName + our MAC address
+    _clientId = String(config.getNodeName()) + "-" + esp.getMacHex();
+    debug.printLn(String(F("MQTT: Attempting connection to broker ")) + String(config.getMQTTServer()) + " as clientID " + _clientId);
 
-        // Set keepAlive, cleanSession, timeout
-        mqttClient.setOptions(30, true, 5000);
+    // Set keepAlive, cleanSession, timeout
+    mqttClient.setOptions(30, true, 5000);
 
-        // declare LWT
-        mqttClient.setWill(_statusTopic.c_str(), "OFF");
+    // declare LWT
+    mqttClient.setWill(_statusTopic.c_str(), "OFF");
 
-        if (mqttClient.connect(_clientId.c_str(), config.getMQTTUser(), config.getMQTTPassword()))
-        { // Attempt to connect to broker, setting last will and testament
-            // Subscribe to our incoming topics
-            if (mqttClient.subscribe(commandSubscription))
-            {
-                debug.printLn(String(F("MQTT: subscribed to ")) + commandSubscription);
-            }
-            if (mqttClient.subscribe(groupCommandSubscription))
-            {
-                debug.printLn(String(F("MQTT: subscribed to ")) + groupCommandSubscription);
-            }
-            if (mqttClient.subscribe(_statusTopic))
-            {
-                debug.printLn(String(F("MQTT: subscribed to ")) + _statusTopic);
-            }
+    if (!mqttClient.connect(_clientId.c_str(), config.getMQTTUser(), config.getMQTTPassword()))
+    { // Attempt to connect to broker, setting last will and testament
+        return false;
+    }
 
-            if (mqttFirstConnect)
-            { // Force any subscribed clients to toggle OFF/ON when we first connect.  Sending OFF,
-                // "ON" will be sent by the _statusTopic subscription action.
-                debug.printLn(String(F("MQTT: binary_sensor state: [")) + _statusTopic + "] : [OFF]");
-                mqttClient.publish(_statusTopic, "OFF", true, 1);
-                mqttFirstConnect = false;
-            }
-            else
-            {
-                debug.printLn(String(F("MQTT: binary_sensor state: [")) + _statusTopic + "] : [ON]");
-                mqttClient.publish(_statusTopic, "ON", true, 1);
-            }
+    // Subscribe to our incoming topics
+    if (mqttClient.subscribe(commandSubscription))
+    {
+        debug.printLn(String(F("MQTT: subscribed to ")) + commandSubscription);
+    }
+    if (mqttClient.subscribe(groupCommandSubscription))
+    {
+        debug.printLn(String(F("MQTT: subscribed to ")) + groupCommandSubscription);
+    }
+    if (mqttClient.subscribe(_statusTopic))
+    {
+        debug.printLn(String(F("MQTT: subscribed to ")) + _statusTopic);
+    }
+
+    if (mqttFirstConnect)
+    { // Force any subscribed clients to toggle OFF/ON when we first connect.  Sending OFF,
+        // "ON" will be sent by the _statusTopic subscription action.
+        debug.printLn(String(F("MQTT: binary_sensor state: [")) + _statusTopic + "] : [OFF]");
+        mqttClient.publish(_statusTopic, "OFF", true, 1);
+        mqttFirstConnect = false;
+    }
+    else
+    {
+        debug.printLn(String(F("MQTT: binary_sensor state: [")) + _statusTopic + "] : [ON]");
+        mqttClient.publish(_statusTopic, "ON", true, 1);
+    }
 
-            mqttReconnectCount = 0;
+    publishConfig();
 
-            debug.printLn(F("MQTT: connected"));
-        }
-        else
-        { // Retry until we give up and restart after mqttConnectTimeout seconds
-            mqttReconnectCount++;
-            if (mqttReconnectCount > ((_mqttConnectTimeout / 10) - 1))
-            {
-                debug.printLn(String(F("MQTT connection attempt ")) + String(mqttReconnectCount) + String(F(" failed with rc ")) + String(mqttClient.returnCode()) + String(F(".  Restarting device.")));
-                esp.reset();
-            }
-            debug.printLn(String(F("MQTT connection attempt ")) + String(mqttReconnectCount) + String(F(" failed with rc ")) + String(mqttClient.returnCode()) + String(F(".  Trying again in 30 seconds.")));
-            uint32_t mqttReconnectTimer = millis(); // record current time for our timeout
-            while ((millis() - mqttReconnectTimer) < 30000)
-            { // Handle HTTP and OTA while we're waiting 30sec for MQTT to reconnect
-                web.loop();
-                ArduinoOTA.handle();
-                delay(10);
-            }
-        }
+    debug.printLn(F("MQTT: connected"));
+    return true;
+}
+
+void MqttSvc::_wait(uint32_t period)
+{ // Handle HTTP, OTA, and the local work that doesn't need a broker while we're waiting to try it again
+    uint32_t mqttReconnectTimer = millis(); // record current time for our timeout
+    while ((millis() - mqttReconnectTimer) < period)
+    {
+        buttons.loop(); // rules keep acting on buttons and sensors while the broker is away
+        sensors.loop();
+        history.loop();
+        web.loop();
+        ArduinoOTA.handle();
+        ota.loop();   // a firmware on trial must still be able to roll back from here
+        power.loop(); // and a battery node must still be able to give up and sleep
+        delay(10);
     }
 }
 
 void MqttSvc::callback(String &strTopic, String &strPayload)
 { // Handle incoming commands from MQTT
+    heapMonitor.activity();
     debug.printLn(MQTT, String(F("MQTT IN: '")) + strTopic + "' : '" + strPayload + "'");
 
     if (((strTopic == _commandTopic) || (strTopic == _groupCommandTopic)) && (strPayload == ""))
     {                   // '[...]/device/command' -m '' = No command requested, respond with statusUpdate()
         statusUpdate(); // return status JSON via MQTT
     }
-    else if (strTopic == (_commandTopic + "/statusupdate") || strTopic == (_groupCommandTopic + "/statusupdate"))
+    else if (_isCommand(strTopic, "/statusupdate"))
     {                   // '[...]/device/command/statusupdate' == mqttStatusUpdate()
         statusUpdate(); // return status JSON via MQTT
     }
-    else if (strTopic == (_commandTopic + "/reboot") || strTopic == (_groupCommandTopic + "/reboot"))
+    else if (_isCommand(strTopic, "/reboot"))
     { // '[...]/device/command/reboot' == reboot microcontroller)
         debug.printLn(F("MQTT: Rebooting device"));
         esp.reset();
     }
-    else if (strTopic == (_commandTopic + "/factoryreset") || strTopic == (_groupCommandTopic + "/factoryreset"))
+    else if (_isCommand(strTopic, "/factoryreset"))
     { // '[...]/device/command/factoryreset' == clear all saved settings)
         config.clearFileSystem();
     }
+    else if (_isCommand(strTopic, "/config"))
+    { // '[...]/device/command/config' -m '{"mqttPort":"1884","mdnsEnabled":false}' == change some settings
+        DeserializationError jsonError = deserializeJson(_json, strPayload);
+        if (jsonError || !_json.is<JsonObject>())
+        {
+            debug.printLn(String(F("MQTT: [ERROR] bad config command: ")) + String(jsonError.c_str()));
+            return;
+        }
+        const bool fromGroup = strTopic.startsWith(_groupCommandTopic);
+        for (JsonPair setting : _json.as<JsonObject>())
+        {
+            const ConfigField *field = Config::getField(setting.key().c_str());
+            // only what the web config page can change, and never give a whole group one node's name or address
+            if ((field == nullptr) || !(field->flags & FIELD_FORM) || (fromGroup && (field->flags & FIELD_NODE)))
+            {
+                debug.printLn(String(F("MQTT: [WARNING] config command ignored setting ")) + setting.key().c_str());
+                continue;
+            }
+            JsonVariant value = setting.value();
+            if ((field->flags & FIELD_SECRET) && value.is<const char *>() && (strcmp(value.as<const char *>(), CONFIG_MASK) == 0))
+            { // as published in state/config, so a republished config leaves the secret as it is
+                continue;
+            }
+            config.changeField(*field, value.is<bool>() ? String(value.as<bool>() ? 1 : 0) : value.as<String>());
+        }
+        if (config.getPendingApply() == APPLY_NONE)
+        { // nothing changed, but say what we have so the sender can tell
+            publishConfig();
+        }
+    }
+    else if (_isCommand(strTopic, "/rules"))
+    { // '[...]/device/command/rules' -m 'button 0.1 on -> gpio 5 toggle' == replace the rules, kept like any other setting
+        config.changeField(configFields[CONFIG_FIELD_rules], strPayload);
+    }
+    else if (_isCommand(strTopic, "/ota"))
+    { // '[...]/device/command/ota' -m '{"url":"http://...","md5":"...","sha256":"...","stagger":600}' == pull a firmware update
+        StaticJsonDocument<512> otaJson;
+        DeserializationError jsonError = deserializeJson(otaJson, strPayload);
+        if (jsonError || otaJson["url"].isNull())
+        {
+            debug.printLn(String(F("MQTT: [ERROR] bad ota command: ")) + String(jsonError.c_str()));
+            return;
+        }
+        // spread a group rollout over "stagger" seconds, each node picking its slot from its MAC
+        uint32_t delaySeconds = 0;
+        const uint32_t stagger = otaJson["stagger"] | 0;
+        if (stagger != 0)
+        {
+            const String mac = esp.getMacHex();
+            uint32_t macHash = 5381;
+            for (uint8_t i = 0; i < mac.length(); i++)
+            {
+                macHash = (macHash * 33) ^ (uint8_t)mac[i];
+            }
+            delaySeconds = macHash % stagger;
+        }
+        ota.pull(otaJson["url"], otaJson["md5"] | "", otaJson["sha256"] | "", delaySeconds);
+    }
     else if (strTopic == _statusTopic && strPayload == "OFF")
     { // catch a dangling LWT from a previous connection if it appears
         mqttClient.publish(_statusTopic, "ON");
@@ -177,24 +285,78 @@ void MqttSvc::callback(String &strTopic, String &strPayload)
 void MqttSvc::statusUpdate()
 { // Periodically publish a JSON string indicating system status
     _statusUpdateTimer = millis();
-    String statusPayload = "{";
-    statusPayload += String(F("\"status\":\"available\","));
-    statusPayload += String(F("\"espVersion\":")) + String(VERSION) + String(F(","));
-    statusPayload += String(F("\"espUptime\":")) + String(int32_t(millis() / 1000)) + String(F(","));
-    statusPayload += String(F("\"signalStrength\":")) + String(WiFi.RSSI()) + String(F(","));
-    statusPayload += String(F("\"IP\":\"")) + WiFi.localIP().toString() + String(F("\","));
-    statusPayload += String(F("\"heapFree\":")) + String(ESP.getFreeHeap()) + String(F(","));
+    ScratchString statusPayload;
+    statusPayload.add(F("{\"status\":\"available\","));
+    statusPayload.add(F("\"espVersion\":")).add(String(VERSION)).add(F(","));
+    statusPayload.add(F("\"espUptime\":")).add(int32_t(millis() / 1000)).add(F(","));
+    if (timeSync.isSynced())
+    {
+        char now[24];
+        statusPayload.add(F("\"time\":")).add(timeSync.format(millis(), now, sizeof(now))).add(F(","));
+        statusPayload.add(F("\"timeSyncs\":")).add(timeSync.getSyncs()).add(F(","));
+        statusPayload.add(F("\"timeOffsetMs\":")).add(timeSync.getOffsetMs()).add(F(","));
+        statusPayload.add(F("\"timeDriftPpm\":")).add(timeSync.getDriftPpm()).add(F(","));
+    }
+    statusPayload.add(F("\"signalStrength\":")).add(WiFi.RSSI()).add(F(","));
+    statusPayload.add(F("\"IP\":\"")).add(WiFi.localIP().toString()).add(F("\","));
+    statusPayload.add(F("\"wifiConnectMs\":")).add(esp.getLastConnectTime()).add(F(","));
+    statusPayload.add(F("\"wifiFastConnect\":")).add(esp.getLastConnectFast() ? F("true") : F("false")).add(F(","));
+    statusPayload.add(F("\"wifiReconnects\":")).add(esp.getReconnects()).add(F(","));
+    statusPayload.add(F("\"wifiRoams\":")).add(esp.getRoams()).add(F(","));
+    statusPayload.add(F("\"wifiBSSID\":\"")).add(WiFi.BSSIDstr()).add(F("\","));
+    statusPayload.add(F("\"signalHistory\":")).add(esp.getLinkHistory()).add(F(","));
+    statusPayload.add(F("\"bootToOnlineMs\":")).add(esp.getBootToOnlineTime()).add(F(","));
+    if (power.isDutyCycling())
+    {
+        statusPayload.add(F("\"sleepCycles\":")).add(power.getCycles()).add(F(","));
+        statusPayload.add(F("\"awakeMs\":")).add(power.getAwakeTime()).add(F(","));
+        statusPayload.add(F("\"queued\":")).add(power.getQueued()).add(F(","));
+        statusPayload.add(F("\"queueDropped\":")).add(power.getDropped()).add(F(","));
+    }
+    if (sensors.getCount() != 0)
+    {
+        statusPayload.add(F("\"sensorReadings\":")).add(sensors.getReadings()).add(F(","));
+        statusPayload.add(F("\"sensorErrors\":")).add(sensors.getErrors()).add(F(","));
+        statusPayload.add(F("\"sensorBatches\":")).add(sensors.getBatches()).add(F(","));
+        statusPayload.add(F("\"sensorMessages\":")).add(sensors.getMessages()).add(F(","));
+        statusPayload.add(F("\"sensorDropped\":")).add(sensors.getDropped()).add(F(","));
+        statusPayload.add(F("\"sensorWindows\":")).add(aggregator.getWindows()).add(F(","));
+        statusPayload.add(F("\"sensorWindowsDropped\":")).add(aggregator.getDropped()).add(F(","));
+    }
+    if (buttons.getCount() != 0)
+    {
+        statusPayload.add(F("\"buttonEvents\":")).add(buttons.getEvents()).add(F(","));
+        statusPayload.add(F("\"buttonBounces\":")).add(buttons.getBounces()).add(F(","));
+        statusPayload.add(F("\"buttonDropped\":")).add(buttons.getDropped()).add(F(","));
+    }
+    if (rules.getCount() != 0)
+    {
+        statusPayload.add(F("\"rules\":")).add(rules.getCount()).add(F(","));
+        statusPayload.add(F("\"rulesFired\":")).add(rules.getFired()).add(F(","));
+        statusPayload.add(F("\"ruleMaxUs\":")).add(rules.getMaxEvaluationUs()).add(F(","));
+    }
+    statusPayload.add(F("\"scratchHighWater\":")).add(scratch.getHighWater()).add(F(","));
+    statusPayload.add(F("\"scratchOverflows\":")).add(scratch.getOverflows()).add(F(","));
+#if HEAP_TRACE
+    statusPayload.add(F("\"heapLoopAllocations\":")).add(heapTrace.getAllocations()).add(F(","));
+#endif
+    statusPayload.add(F("\"heapFree\":")).add(ESP.getFreeHeap()).add(F(","));
+    statusPayload.add(F("\"heapMaxBlock\":")).add(heapMonitor.getLatest().largestBlock).add(F(","));
+    statusPayload.add(F("\"heapMinFree\":")).add(heapMonitor.getMinFree()).add(F(","));
+    statusPayload.add(F("\"heapMinMaxBlock\":")).add(heapMonitor.getMinLargestBlock()).add(F(","));
+    statusPayload.add(F("\"heapTrend\":")).add(heapMonitor.getSlope()).add(F(","));
+    statusPayload.add(F("\"heapAlert\":\"")).add(heapMonitor.getAlertName()).add(F("\","));
     #ifdef ESP_32
-    statusPayload += String(F("\"espSdk\":\"")) + String(ESP.getSdkVersion()) + String(F("\""));
+    statusPayload.add(F("\"espSdk\":\"")).add(ESP.getSdkVersion()).add(F("\""));
     #elif defined(ESP_8266)
-    statusPayload += String(F("\"heapFragmentation\":")) + String(ESP.getHeapFragmentation()) + String(F(","));
-    statusPayload += String(F("\"espCore\":\"")) + String(ESP.getCoreVersion()) + String(F("\""));
+    statusPayload.add(F("\"heapFragmentation\":")).add(ESP.getHeapFragmentation()).add(F(","));
+    statusPayload.add(F("\"espCore\":\"")).add(ESP.getCoreVersion()).add(F("\""));
     #endif
-    statusPayload += "}";
+    statusPayload.add("}");
 
-    mqttClient.publish(_sensorTopic, statusPayload, true, 1);
+    mqttClient.publish(_sensorTopic.c_str(), statusPayload.c_str(), statusPayload.length(), true, 1);
     mqttClient.publish(_statusTopic, "ON", true, 1);
-    debug.printLn(String(F("MQTT: status update: ")) + String(statusPayload));
+    debug.printLn(String(F("MQTT: status update: ")) + statusPayload.c_str());
     debug.printLn(String(F("MQTT: binary_sensor state: [")) + _statusTopic + "] : [ON]");
 }
 
@@ -208,6 +370,11 @@ void MqttSvc::publishStateTopic(String msg) { mqttClient.publish(_stateTopic, ms
 
 void MqttSvc::publishStatusTopic(String msg) { mqttClient.publish(_statusTopic, msg); }
 
+void MqttSvc::publishStatusSubTopic(String subtopic, String msg)
+{ // extend the Status Topic with a subtopic, so JSON never lands on the ON/OFF binary_sensor itself
+    _publishOn(_statusTopic, subtopic.c_str(), msg.c_str(), msg.length(), true, 1);
+}
+
 void MqttSvc::publishButtonEvent(String page, String buttonID, String newState)
 { // Publish a message that buttonID on page is now newState
     String mqttButtonTopic = _stateTopic + "/p[" + page + "].b[" + buttonID + "]";
@@ -217,31 +384,99 @@ void MqttSvc::publishButtonEvent(String page, String buttonID, String newState)
 
 void MqttSvc::publishButtonJSONEvent(String page, String buttonID, String newState)
 { // Publish a JSON message stating button = newState, on the State JSON Topic
-    String mqttButtonJSONEvent = String(F("{\"event\":\"p[")) + String(page) + String(F("].b[")) + String(buttonID) + String(F("]\", \"value\":\"")) + newState + String(F(""
-                                                                                                                                                                           "}"));
+    String mqttButtonJSONEvent = String(F("{\"event\":\"p[")) + String(page) + String(F("].b[")) + String(buttonID) + String(F("]\", \"value\":\"")) + newState + String(F("\"}"));
     mqttClient.publish(_stateJSONTopic, mqttButtonJSONEvent);
 }
 
+void MqttSvc::publishConfig()
+{ // Publish the settings in effect, secrets masked, retained on the State Topic
+    _json.clear();
+    for (const ConfigField &field : configFields)
+    {
+        const String value = config.getFieldValue(field);
+        if (field.type == FIELD_BOOL)
+        {
+            _json[field.name] = (value == "1");
+        }
+        else if (field.type != FIELD_STRING)
+        {
+            _json[field.name] = value.toInt();
+        }
+        else if ((field.flags & FIELD_SECRET) && (value.length() != 0))
+        {
+            _json[field.name] = CONFIG_MASK;
+        }
+        else
+        {
+            _json[field.name] = value;
+        }
+    }
+    if (_json.overflowed())
+    { // ArduinoJson drops what doesn't fit without a word, better to publish nothing than half the config
+        debug.printLn(F("MQTT: [ERROR] config does not fit MQTT_JSON_DOCUMENT_SIZE, not published"));
+        return;
+    }
+    ScratchString configPayload;
+    serializeJson(_json, configPayload);
+    _publishOn(_stateTopic, "/config", configPayload.c_str(), configPayload.length(), true, 1);
+}
+
+bool MqttSvc::publishReliable(String subtopic, String msg)
+{ // publish on a Sensor subtopic at QoS1, true once the broker has acknowledged it
+    const bool acknowledged = _publishOn(_sensorTopic, subtopic.c_str(), msg.c_str(), msg.length(), false, 1);
+    if (!acknowledged)
+    {
+        debug.printLn(MQTT, String(F("MQTT: [WARNING] not acknowledged: ")) + _sensorTopic + subtopic);
+    }
+    return acknowledged;
+}
+
+void MqttSvc::publishSensorSubTopic(String subtopic, String reading)
+{ // extend the Sensor Topic with a subtopic and publish a reading on it
+    _publishOn(_sensorTopic, subtopic.c_str(), reading.c_str(), reading.length(), false, 0);
+}
+
 void MqttSvc::publishStatePage(String page)
 { // Publish a page message on the State Topic
-    String mqttPageTopic = _stateTopic + "/page";
-    mqttClient.publish(mqttPageTopic, page);
-    debug.printLn(MQTT, String(F("MQTT OUT: '")) + mqttPageTopic + "' : '" + page + "'");
+    _publishOn(_stateTopic, "/page", page.c_str(), page.length(), false, 0);
 }
 
 void MqttSvc::publishStateSubTopic(String subtopic, String newState)
 { // extend the State Topic with a subtopic and publish a newState message on it
-    String mqttReturnTopic = _stateTopic + subtopic;
-    mqttClient.publish(mqttReturnTopic, newState);
-    debug.printLn(MQTT, String(F("MQTT OUT: '")) + mqttReturnTopic + "' : '" + newState + "]");
+    _publishOn(_stateTopic, subtopic.c_str(), newState.c_str(), newState.length(), false, 0);
+}
+
+bool MqttSvc::_publishOn(const String &topic, const char *subtopic, const char *payload, size_t length, bool retained, int qos)
+{ // publish on topic extended with subtopic, putting the two together in the scratch arena rather than on the heap
+    ScratchString fullTopic;
+    fullTopic.add(topic).add(subtopic);
+    const bool sent = mqttClient.publish(fullTopic.c_str(), payload, length, retained, qos);
+    debug.printLn(MQTT, String(F("MQTT OUT: '")) + fullTopic.c_str() + "' : '" + payload + "'");
+    return sent;
 }
 
+bool MqttSvc::_isCommand(const String &topic, const char *command)
+{ // topic is command under our own command topic or our group's, compared in place rather than building each topic to compare
+    if (topic.startsWith(_commandTopic) && (strcmp(topic.c_str() + _commandTopic.length(), command) == 0))
+    {
+        return true;
+    }
+    return topic.startsWith(_groupCommandTopic) && (strcmp(topic.c_str() + _groupCommandTopic.length(), command) == 0);
+}
 
 uint16_t MqttSvc::getMaxPacketSize(void)
 { // return the (non-class) variable for our network buffer. See note at the top of mqtt_class.cpp
     return _mqttMaxPacketSize;
 }
 
+void MqttSvc::pause()
+{ // disconnect cleanly without saying we are going away, for a node that will be back after a sleep
+    if (mqttClient.connected())
+    {
+        mqttClient.disconnect();
+    }
+}
+
 void MqttSvc::goodbye()
 { // like a Last-Will-and-Testament, publish something when we are going offline
     if (mqttClient.connected())
@@ -2,6 +2,12 @@
 
 #include "settings.h"
 #include <Arduino.h>
+#include <ArduinoJson.h>
+#include "config.h"
+
+// The published config and config commands hold a member per field, with the strings copied: the values fit in
+// ConfigData, and a command's keys are copied from the payload as well
+#define MQTT_JSON_DOCUMENT_SIZE (JSON_OBJECT_SIZE(CONFIG_FIELD_COUNT) + sizeof(ConfigData) + CONFIG_FIELD_COUNT * MQTT_JSON_KEY_SIZE)
 
 class MqttSvc
 {
@@ -22,18 +28,24 @@ public:
     void begin();
     void loop();
     void connect();
+    bool reconnect(uint8_t attempts);
     void callback(String &strTopic, String &strPayload);
     void statusUpdate();
     bool clientIsConnected();
     String clientReturnCode();
     void publishStatusTopic(String msg);
+    void publishStatusSubTopic(String subtopic, String msg);
     void publishStateTopic(String msg);
     void publishButtonEvent(String page, String buttonID, String newState);
     void publishButtonJSONEvent(String page, String buttonID, String newState);
     void publishStatePage(String page);
+    void publishConfig();
+    bool publishReliable(String subtopic, String msg);
     void publishStateSubTopic(String subtopic, String newState);
+    void publishSensorSubTopic(String subtopic, String reading);
     String getClientID(void);
     uint16_t getMaxPacketSize(void);
+    void pause();
     void goodbye();
 
 #pragma endregion Public
@@ -42,7 +54,6 @@ public:
 
 protected:
     const uint32_t _statusUpdateInterval = MQTT_STATUS_UPDATE_INTERVAL; // Time in msec between publishing MQTT status updates (5 minutes)
-    const uint32_t _mqttConnectTimeout = CONNECTION_TIMEOUT;            // Timeout for WiFi and MQTT connection attempts in seconds
 
     bool _alive;                 // Flag that data structures are initialised and functions can run without error
     String _clientId;            // Auto-generated MQTT ClientID
@@ -55,6 +66,16 @@ protected:
     String _statusTopic;         // MQTT topic for publishing device connectivity state
     String _sensorTopic;         // MQTT topic for publishing device information in JSON format
     uint32_t _statusUpdateTimer; // Timer for update check
+    uint16_t _failures;          // connection attempts failed in a row
+    uint32_t _attemptAt;         // millis() of the latest attempt
+    uint32_t _retryDelay;        // msec until the next, doubled after each failure
+    StaticJsonDocument<MQTT_JSON_DOCUMENT_SIZE> _json; // config commands and the published config, kept off the heap
+
+    void _buildTopics(void);
+    bool _isCommand(const String &topic, const char *command);
+    bool _publishOn(const String &topic, const char *subtopic, const char *payload, size_t length, bool retained, int qos);
+    bool _attempt(void);
+    void _wait(uint32_t period);
 
 #pragma endregion Protected
 };
\ No newline at end of file
@@ -0,0 +1,858 @@
+// ota.cpp : Streams firmware images into the update partition, hashing each chunk on the way through
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "common.h"
+#include "heatshrink.h"
+#include <MD5Builder.h>
+#ifdef ESP_32
+#include <ArduinoNvs.h>
+#include <HTTPClient.h>
+#include <Update.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+#elif defined(ESP_8266)
+#include <ESP8266HTTPClient.h>
+#include <Updater.h>
+#include <bearssl/bearssl_hash.h>
+#endif
+
+// The hash contexts are library types, so like our other library objects they live outside the class
+static MD5Builder otaMD5;
+#ifdef ESP_32
+static mbedtls_sha256_context otaSHA256;
+#elif defined(ESP_8266)
+static br_sha256_context otaSHA256;
+#endif
+static HeatshrinkDecoder otaInflate; // unpacks compressed images
+static HTTPClient otaHTTP;        // connection a pulled image streams over
+extern WiFiClient wifiClient;     // client for OTA, see esp.cpp
+
+static const uint32_t otaTrialMagic = 0x4F544131; // "OTA1"
+
+// HeatshrinkDecoder::sink() callback, hands each decompressed byte back to the class
+static void callback_OtaUnpacked(uint8_t value)
+{
+  ota.unpacked(value);
+}
+
+static bool parseHex(const char *hex, uint8_t *out, size_t length)
+{ // decode exactly length bytes of hex, upper or lower case
+  if (strlen(hex) != length * 2)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < length * 2; i++)
+  {
+    char c = tolower(hex[i]);
+    uint8_t nibble;
+    if (c >= '0' && c <= '9')
+    {
+      nibble = c - '0';
+    }
+    else if (c >= 'a' && c <= 'f')
+    {
+      nibble = c - 'a' + 10;
+    }
+    else
+    {
+      return false;
+    }
+    out[i / 2] = (i % 2 == 0) ? (nibble << 4) : (out[i / 2] | nibble);
+  }
+  return true;
+}
+
+void Ota::begin()
+{ // called in the main code setup, handles our initialisation
+  _running = false;
+  _source = "";
+  _size = 0;
+  _received = 0;
+  _written = 0;
+  _error[0] = '\0';
+  _pullState = PULL_IDLE;
+  _healthySince = 0;
+  _trialAnnounced = false;
+
+  // load the trial record, on ESP32 from NVS (opened by config.begin) and on ESP8266 from RTC memory
+#ifdef ESP_32
+  if (!NVS.getBlob("otaTrial", (uint8_t *)&_trial, sizeof(_trial)) || (_trial.magic != otaTrialMagic))
+#elif defined(ESP_8266)
+  if (!ESP.rtcUserMemoryRead(RTC_BLOCK_OTA, (uint32_t *)&_trial, sizeof(_trial)) || (_trial.magic != otaTrialMagic))
+#endif
+  {
+    memset(&_trial, 0, sizeof(_trial));
+    _trial.magic = otaTrialMagic;
+  }
+
+  if (_trial.state == TRIAL_PENDING)
+  { // every boot of a firmware on trial counts, so one that crashes or resets before proving itself runs out of chances
+    _trial.boots++;
+    _trialSave();
+    debug.printLn(String(F("OTA: firmware on trial, boot ")) + String(_trial.boots) + String(F(" of ")) + String(OTA_TRIAL_MAX_BOOTS));
+    if (_trial.boots > OTA_TRIAL_MAX_BOOTS)
+    {
+      _rollback("too many boots");
+    }
+  }
+  _alive = true;
+}
+
+void Ota::beginTrial(void)
+{ // remember where we came from, so a new firmware that never gets healthy can be undone
+  memset(&_trial, 0, sizeof(_trial));
+  _trial.magic = otaTrialMagic;
+  _trial.state = TRIAL_PENDING;
+#ifdef ESP_32
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  if (running != nullptr)
+  {
+    strncpy(_trial.previous, running->label, sizeof(_trial.previous) - 1);
+  }
+#endif
+  _trialSave();
+  debug.printLn(String(F("OTA: new firmware will boot on trial, previous slot ")) + String(_trial.previous));
+}
+
+void Ota::_trialSave(void)
+{
+#ifdef ESP_32
+  NVS.setBlob("otaTrial", (uint8_t *)&_trial, sizeof(_trial));
+#elif defined(ESP_8266)
+  ESP.rtcUserMemoryWrite(RTC_BLOCK_OTA, (uint32_t *)&_trial, sizeof(_trial));
+#endif
+}
+
+void Ota::_trialLoop(void)
+{ // keep the new firmware once WiFi and MQTT have stayed up for the trial window, roll back if that never happens
+  const uint32_t now = millis();
+  if ((WiFi.status() == WL_CONNECTED) && mqtt.clientIsConnected())
+  {
+    if (_healthySince == 0)
+    {
+      _healthySince = (now == 0) ? 1 : now;
+    }
+  }
+  else
+  {
+    _healthySince = 0;
+  }
+
+  if (!_trialAnnounced && (_trial.state != TRIAL_NONE) && mqtt.clientIsConnected())
+  {
+    _trialAnnounced = true;
+    _trialReport((_trial.state == TRIAL_ROLLEDBACK) ? "rolledback" : "trial");
+    if (_trial.state == TRIAL_ROLLEDBACK)
+    { // reported once, this firmware is the known good one
+      _trial.state = TRIAL_NONE;
+      _trialSave();
+    }
+  }
+
+  if (_trial.state != TRIAL_PENDING)
+  {
+    return;
+  }
+  if ((_healthySince != 0) && ((now - _healthySince) >= (config.getOTATrialWindow() * (uint32_t)ASECOND)))
+  {
+    _trial.state = TRIAL_NONE;
+    _trialSave();
+    debug.printLn(F("OTA: firmware healthy, trial passed"));
+    _trialReport("confirmed");
+  }
+  else if (now >= OTA_TRIAL_DEADLINE)
+  {
+    _rollback("not healthy before deadline");
+  }
+}
+
+void Ota::_rollback(const char *reason)
+{ // boot the previous slot again. ESP8266 has no second slot to go back to, so there we can only report it
+  debug.printLn(String(F("OTA: [ERROR] firmware failed its trial: ")) + String(reason));
+#ifdef ESP_32
+  const esp_partition_t *previous = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, _trial.previous);
+  if ((previous != nullptr) && (esp_ota_set_boot_partition(previous) == ESP_OK))
+  {
+    _trial.state = TRIAL_ROLLEDBACK;
+    _trialSave();
+    _trialReport("rollback");
+    debug.printLn(String(F("RESET: rolling back to ")) + String(_trial.previous));
+    esp.reset();
+    return;
+  }
+  debug.printLn(F("OTA: [ERROR] previous slot not bootable, keeping this firmware"));
+#endif
+  _trial.state = TRIAL_NONE;
+  _trialSave();
+  _trialReport("unhealthy");
+}
+
+void Ota::_trialReport(const char *state)
+{ // rollout telemetry goes out retained on '[...]/status/ota'
+  if (!mqtt.clientIsConnected())
+  {
+    return;
+  }
+  String payload = String(F("{\"state\":\"")) + String(state) + String(F("\",\"version\":")) + String(VERSION);
+  payload += String(F(",\"boots\":")) + String(_trial.boots);
+#ifdef ESP_32
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  payload += String(F(",\"partition\":\"")) + String((running != nullptr) ? running->label : "") + String(F("\""));
+  payload += String(F(",\"previous\":\"")) + String(_trial.previous) + String(F("\""));
+#endif
+  if (_healthySince != 0)
+  {
+    payload += String(F(",\"healthyFor\":")) + String((millis() - _healthySince) / ASECOND);
+  }
+  payload += "}";
+  mqtt.publishStatusSubTopic("/ota", payload);
+}
+
+void Ota::loop()
+{ // called in the main code loop, handles our periodic code
+  _trialLoop();
+
+  switch (_pullState)
+  {
+  case PULL_WAITING:
+    if ((int32_t)(millis() - _pullStartAt) >= 0)
+    {
+      _pullState = PULL_CONNECT;
+    }
+    break;
+  case PULL_CONNECT:
+    _pullConnect();
+    break;
+  case PULL_STREAMING:
+    _pullRead();
+    break;
+  default:
+    break;
+  }
+}
+
+bool Ota::pull(const char *url, const char *md5, const char *sha256, uint32_t delaySeconds)
+{ // queue a download, the work happens a chunk at a time in loop()
+  if (_running || (_pullState != PULL_IDLE))
+  {
+    debug.printLn(F("OTA: [ERROR] pull refused, an update is already in progress"));
+    return false;
+  }
+  if ((strncmp(url, "http://", 7) != 0) || (strlen(url) >= sizeof(_pullURL)))
+  {
+    _source = "mqtt";
+    _fail("bad url");
+    return false;
+  }
+  strncpy(_pullURL, url, sizeof(_pullURL));
+  strncpy(_pullMD5, md5, sizeof(_pullMD5) - 1);
+  _pullMD5[sizeof(_pullMD5) - 1] = '\0';
+  strncpy(_pullSHA256, sha256, sizeof(_pullSHA256) - 1);
+  _pullSHA256[sizeof(_pullSHA256) - 1] = '\0';
+  _pullRetries = 0;
+  _received = 0;
+  _pullStartAt = millis() + (delaySeconds * ASECOND);
+  _pullState = PULL_WAITING;
+  debug.printLn(String(F("OTA: pulling ")) + String(_pullURL) + String(F(" in ")) + String(delaySeconds) + String(F("s")));
+  return true;
+}
+
+void Ota::_pullConnect(void)
+{ // ask for everything from the first byte we do not have yet; the connect and headers block for up to OTA_PULL_TIMEOUT
+  static const char *headerKeys[] = {"Content-Range", "Transfer-Encoding"};
+  otaHTTP.end();
+  otaHTTP.setTimeout(OTA_PULL_TIMEOUT);
+#ifdef ESP_32
+  otaHTTP.setConnectTimeout(OTA_PULL_TIMEOUT);
+#endif
+  if (!otaHTTP.begin(wifiClient, _pullURL))
+  {
+    _pullRetry("connect failed");
+    return;
+  }
+  otaHTTP.collectHeaders(headerKeys, 2);
+  otaHTTP.addHeader("Range", String(F("bytes=")) + String(_received) + "-");
+  const int code = otaHTTP.GET();
+
+  if ((code == HTTP_CODE_RANGE_NOT_SATISFIABLE) && _running && (_size == 0) && (_received != 0))
+  { // nothing after the bytes we have, so the connection that ended without a length did end at the end of the image
+    otaHTTP.end();
+    _pullState = PULL_IDLE;
+    if (finish())
+    {
+      esp.reset();
+    }
+    return;
+  }
+  if (((code == HTTP_CODE_OK) || (code == HTTP_CODE_PARTIAL_CONTENT)) && (otaHTTP.header("Transfer-Encoding").length() != 0))
+  { // the chunk headers would be read off the stream as image, so the server has to send it as it is
+    _pullStop("chunked transfer not supported");
+    return;
+  }
+
+  uint32_t total = 0;
+  if (code == HTTP_CODE_PARTIAL_CONTENT)
+  { // "Content-Range: bytes <first>-<last>/<total>", total may be "*"
+    const String range = otaHTTP.header("Content-Range");
+    const int dash = range.indexOf('-');
+    const int slash = range.indexOf('/');
+    if ((dash < 0) || (slash < 0) || ((uint32_t)range.substring(range.indexOf(' ') + 1, dash).toInt() != _received))
+    {
+      _pullRetry("bad content range");
+      return;
+    }
+    total = range.substring(slash + 1).toInt();
+  }
+  else if (code == HTTP_CODE_OK)
+  { // server ignored the range and sent the whole image
+    total = (otaHTTP.getSize() > 0) ? otaHTTP.getSize() : 0;
+    if (_running && (total == 0))
+    { // it can neither resume nor say how long the image is, so we'd never know we had all of it
+      _pullStop("server cannot resume");
+      return;
+    }
+    if (_running)
+    { // can't resume against this server, start over from the first byte
+      abort("server cannot resume");
+      _error[0] = '\0';
+      _received = 0;
+    }
+  }
+  else
+  {
+    _pullRetry((code < 0) ? "connect failed" : "http error");
+    return;
+  }
+
+  if (!_running && (total == 0) && (_pullMD5[0] == '\0') && (_pullSHA256[0] == '\0'))
+  { // with neither, a dropped connection could not be told from the end of the image
+    _pullStop("no length or hash to check the image against");
+    return;
+  }
+  if (!_running && !start("mqtt", total, _pullMD5, _pullSHA256))
+  {
+    otaHTTP.end();
+    _pullState = PULL_IDLE;
+    return;
+  }
+  _pullLastData = millis();
+  _pullState = PULL_STREAMING;
+}
+
+void Ota::_pullRead(void)
+{ // move at most one chunk from the socket to flash, never waiting for more to arrive
+  static uint8_t buffer[OTA_PULL_CHUNK];
+  WiFiClient *stream = otaHTTP.getStreamPtr();
+  const size_t available = (stream != nullptr) ? stream->available() : 0;
+  if (available == 0)
+  { // without a length, the end of the connection may be the end of the image or a drop; asking for what
+    // follows tells them apart, _pullConnect() finishes on a 416
+    if ((stream == nullptr) || !stream->connected() || ((millis() - _pullLastData) >= OTA_PULL_STALL_TIMEOUT))
+    {
+      _pullRetry((_size == 0) ? "connection ended" : "connection dropped");
+    }
+    return;
+  }
+
+  const size_t length = stream->read(buffer, min(available, sizeof(buffer)));
+  if (!write(buffer, length))
+  { // write() has already thrown the image away
+    otaHTTP.end();
+    _pullState = PULL_IDLE;
+    return;
+  }
+  _pullLastData = millis();
+  _pullRetries = 0;
+
+  if ((_size != 0) && (_received == _size))
+  {
+    otaHTTP.end();
+    _pullState = PULL_IDLE;
+    if (finish())
+    {
+      esp.reset();
+    }
+  }
+}
+
+void Ota::_pullStop(const char *reason)
+{ // give up on a pull that retrying won't help
+  otaHTTP.end();
+  _pullState = PULL_IDLE;
+  _source = "mqtt";
+  abort(reason);
+}
+
+void Ota::_pullRetry(const char *reason)
+{ // drop the connection and come back for the rest later, keeping what is already in flash
+  otaHTTP.end();
+  _pullRetries++;
+  if (_pullRetries > OTA_PULL_RETRIES)
+  {
+    _pullState = PULL_IDLE;
+    _source = "mqtt";
+    abort(reason);
+    return;
+  }
+  debug.printLn(String(F("OTA: ")) + String(reason) + String(F(", resuming from byte ")) + String(_received) + String(F(" (attempt ")) + String(_pullRetries) + String(F(")")));
+  _pullStartAt = millis() + (OTA_PULL_RETRY_DELAY * _pullRetries);
+  _pullState = PULL_WAITING;
+}
+
+bool Ota::start(const char *source, uint32_t size, const char *md5, const char *sha256)
+{ // reset the hashes and unpacking state, size may be 0 when the sender does not tell us
+  if (_running)
+  { // leave the update in progress alone
+    debug.printLn(String(F("OTA: [ERROR] ")) + String(source) + String(F(" update refused, one is already in progress")));
+    return false;
+  }
+  _source = source;
+  _size = size;
+  _received = 0;
+  _written = 0;
+  _error[0] = '\0';
+  _reportedPercent = 0;
+  _reportTimer = 0;
+
+  _expectedMD5[0] = '\0';
+  if ((md5 != nullptr) && (md5[0] != '\0'))
+  {
+    uint8_t check[16];
+    if (!parseHex(md5, check, sizeof(check)))
+    {
+      _fail("bad md5");
+      return false;
+    }
+    strncpy(_expectedMD5, md5, sizeof(_expectedMD5) - 1);
+    _expectedMD5[sizeof(_expectedMD5) - 1] = '\0';
+    for (char *c = _expectedMD5; *c != '\0'; c++)
+    {
+      *c = tolower(*c);
+    }
+  }
+  _checkSHA256 = false;
+  if ((sha256 != nullptr) && (sha256[0] != '\0'))
+  {
+    if (!parseHex(sha256, _expectedSHA256, sizeof(_expectedSHA256)))
+    {
+      _fail("bad sha256");
+      return false;
+    }
+    _checkSHA256 = true;
+  }
+
+  // the partition is opened on the first byte of image, once a package header has told us how big it is
+  _flashOpen = false;
+  _format = FORMAT_DETECT;
+  _headerLength = 0;
+  _imageSize = 0;
+  _packageFlags = 0;
+  _deltaState = DELTA_OP;
+  _stageLength = 0;
+  _streamError = nullptr;
+
+  otaMD5.begin();
+#ifdef ESP_32
+  mbedtls_sha256_init(&otaSHA256);
+  mbedtls_sha256_starts_ret(&otaSHA256, 0);
+#elif defined(ESP_8266)
+  br_sha256_init(&otaSHA256);
+#endif
+
+  _running = true;
+  debug.printLn(String(F("OTA: ")) + String(_source) + String(F(" update started, size ")) + String(_size));
+  _report("start");
+  return true;
+}
+
+bool Ota::write(uint8_t *data, size_t length)
+{ // unpack, hash and flash one chunk, nothing is buffered beyond one stage and what the Updater needs for a flash sector
+  if (!_running)
+  {
+    return false;
+  }
+  if ((_size != 0) && (_received + length > _size))
+  {
+    abort("image larger than announced");
+    return false;
+  }
+  _received += length;
+
+  size_t used = 0;
+  if (_format == FORMAT_DETECT)
+  {
+    used = _detect(data, length);
+  }
+  if ((used < length) && (_format == FORMAT_RAW))
+  {
+    _stageBytes(data + used, length - used);
+  }
+  else if (used < length)
+  {
+    if (_packageFlags & OTA_PACKAGE_COMPRESSED)
+    {
+      otaInflate.sink(data + used, length - used, callback_OtaUnpacked);
+    }
+    else
+    {
+      for (size_t i = used; i < length; i++)
+      {
+        unpacked(data[i]);
+      }
+    }
+  }
+  if (_streamError != nullptr)
+  {
+    abort(_streamError);
+    return false;
+  }
+
+  // publish at most every 5% and every 2 seconds, so reporting never costs more than the flash write
+  const uint8_t percent = (_size != 0) ? (uint8_t)((uint64_t)_received * 100 / _size) : 0;
+  if (((_size == 0) || (percent >= _reportedPercent + 5)) && ((millis() - _reportTimer) >= (2 * ASECOND)))
+  {
+    _reportedPercent = percent;
+    _report("running");
+  }
+  return true;
+}
+
+size_t Ota::_detect(const uint8_t *data, size_t length)
+{ // gather the first bytes to tell a plain image (first byte 0xE9) from one of our packages, returns bytes used
+  size_t used = 0;
+  const size_t wanted = (_headerLength < 4) ? 4 : OTA_PACKAGE_HEADER_SIZE;
+  while ((used < length) && (_headerLength < wanted))
+  {
+    _header[_headerLength++] = data[used++];
+  }
+  if (_headerLength < 4)
+  {
+    return used;
+  }
+  if (memcmp(_header, "ABPK", 4) != 0)
+  { // a plain image, what we held back is its first bytes
+    _format = FORMAT_RAW;
+    _imageSize = _size;
+    _stageBytes(_header, _headerLength);
+    return used;
+  }
+  if (_headerLength < OTA_PACKAGE_HEADER_SIZE)
+  { // a package, carry on gathering its header from this chunk or the next
+    return (used < length) ? used + _detect(data + used, length - used) : used;
+  }
+
+  // magic[4] version flags windowBits lookaheadBits imageSize(LE 32) baseMD5[16]
+  _format = FORMAT_PACKAGE;
+  _packageFlags = _header[5];
+  _imageSize = (uint32_t)_header[8] | ((uint32_t)_header[9] << 8) | ((uint32_t)_header[10] << 16) | ((uint32_t)_header[11] << 24);
+  if (_header[4] != OTA_PACKAGE_VERSION)
+  {
+    _streamError = "unknown package version";
+  }
+  else if ((_packageFlags & OTA_PACKAGE_COMPRESSED) && !otaInflate.begin(_header[6], _header[7]))
+  {
+    _streamError = "unsupported compression window";
+  }
+  else if (_packageFlags & OTA_PACKAGE_DELTA)
+  { // a delta only makes sense against the exact image it was made from
+    uint8_t runningMD5[16];
+    parseHex(ESP.getSketchMD5().c_str(), runningMD5, sizeof(runningMD5));
+    _baseSize = ESP.getSketchSize();
+    if (memcmp(runningMD5, &_header[12], sizeof(runningMD5)) != 0)
+    {
+      _streamError = "delta base is not the running firmware";
+    }
+  }
+  debug.printLn(String(F("OTA: package flags ")) + String(_packageFlags) + String(F(", image size ")) + String(_imageSize));
+  return used;
+}
+
+void Ota::unpacked(uint8_t value)
+{ // one byte out of the decompressor, or straight from an uncompressed package payload
+  if (_streamError != nullptr)
+  {
+    return;
+  }
+  if (!(_packageFlags & OTA_PACKAGE_DELTA))
+  {
+    _stageBytes(&value, 1);
+    return;
+  }
+
+  // delta operations: 0x01 <length> <bytes> adds literals, 0x02 <offset> <length> copies from the running image
+  switch (_deltaState)
+  {
+  case DELTA_OP:
+    if ((value != OTA_DELTA_ADD) && (value != OTA_DELTA_COPY))
+    {
+      _streamError = "bad delta operation";
+      return;
+    }
+    _deltaOp = value;
+    _deltaField = 0;
+    _deltaValue = 0;
+    _deltaShift = 0;
+    _deltaState = DELTA_VARINT;
+    break;
+  case DELTA_VARINT:
+    if (_deltaShift > 28)
+    {
+      _streamError = "bad delta varint";
+      return;
+    }
+    _deltaValue |= (uint32_t)(value & 0x7F) << _deltaShift;
+    _deltaShift += 7;
+    if (value & 0x80)
+    {
+      break;
+    }
+    if (_deltaOp == OTA_DELTA_ADD)
+    {
+      _deltaLength = _deltaValue;
+      _deltaState = (_deltaLength != 0) ? DELTA_ADD : DELTA_OP;
+    }
+    else if (_deltaField == 0)
+    { // copy offset, the length follows
+      _deltaOffset = _deltaValue;
+      _deltaField = 1;
+      _deltaValue = 0;
+      _deltaShift = 0;
+    }
+    else
+    {
+      _copyBase(_deltaOffset, _deltaValue);
+      _deltaState = DELTA_OP;
+    }
+    break;
+  case DELTA_ADD:
+    _stageBytes(&value, 1);
+    if (--_deltaLength == 0)
+    {
+      _deltaState = DELTA_OP;
+    }
+    break;
+  }
+}
+
+void Ota::_copyBase(uint32_t offset, uint32_t length)
+{ // stream a run of the running firmware into the new image
+  if ((offset > _baseSize) || (length > _baseSize - offset))
+  {
+    _streamError = "delta copy outside base image";
+    return;
+  }
+#ifdef ESP_32
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  uint8_t buffer[64];
+  while ((length > 0) && (_streamError == nullptr))
+  {
+    const size_t piece = min(length, (uint32_t)sizeof(buffer));
+    if (esp_partition_read(running, offset, buffer, piece) != ESP_OK)
+    {
+      _streamError = "base read failed";
+      return;
+    }
+    _stageBytes(buffer, piece);
+    offset += piece;
+    length -= piece;
+  }
+#elif defined(ESP_8266)
+  // flashRead wants word aligned addresses and sizes, the running sketch starts at flash address 0
+  uint32_t words[16];
+  while ((length > 0) && (_streamError == nullptr))
+  {
+    const uint32_t aligned = offset & ~3UL;
+    const uint32_t skip = offset - aligned;
+    const uint32_t piece = min(length, (uint32_t)sizeof(words) - skip);
+    if (!ESP.flashRead(aligned, words, sizeof(words)))
+    {
+      _streamError = "base read failed";
+      return;
+    }
+    _stageBytes((uint8_t *)words + skip, piece);
+    offset += piece;
+    length -= piece;
+  }
+#endif
+}
+
+void Ota::_stageBytes(const uint8_t *data, size_t length)
+{ // gather rebuilt image bytes so hashing and flash writes happen in stage sized pieces
+  while ((length > 0) && (_streamError == nullptr))
+  {
+    const size_t piece = min(length, sizeof(_stage) - _stageLength);
+    memcpy(&_stage[_stageLength], data, piece);
+    _stageLength += piece;
+    data += piece;
+    length -= piece;
+    if (_stageLength == sizeof(_stage))
+    {
+      _flushStage();
+    }
+  }
+}
+
+void Ota::_flushStage(void)
+{ // hash and write out whatever is staged, opening the update partition on first use
+  if ((_stageLength == 0) || (_streamError != nullptr))
+  {
+    return;
+  }
+  if ((_imageSize != 0) && (_written + _stageLength > _imageSize))
+  {
+    _streamError = "image larger than announced";
+    return;
+  }
+  if (!_flashOpen)
+  {
+#ifdef ESP_32
+    if (!Update.begin((_imageSize != 0) ? _imageSize : UPDATE_SIZE_UNKNOWN))
+#elif defined(ESP_8266)
+    // always claim the whole free space and commit with end(true), so an image that is
+    // complete but fails verification can still be thrown away with end(false)
+    const uint32_t maxSketchSpace = (ESP.getFreeSketchSpace() - 0x1000) & 0xFFFFF000;
+    if ((_imageSize > maxSketchSpace) || !Update.begin(maxSketchSpace))
+#endif
+    {
+      _streamError = "not enough space";
+      return;
+    }
+    _flashOpen = true;
+  }
+
+  otaMD5.add(_stage, _stageLength);
+#ifdef ESP_32
+  mbedtls_sha256_update_ret(&otaSHA256, _stage, _stageLength);
+#elif defined(ESP_8266)
+  br_sha256_update(&otaSHA256, _stage, _stageLength);
+#endif
+
+  if (Update.write(_stage, _stageLength) != _stageLength)
+  {
+    _streamError = "flash write failed";
+    return;
+  }
+  _written += _stageLength;
+  _stageLength = 0;
+}
+
+bool Ota::finish(void)
+{ // verify the rebuilt image against the expected hashes, and only then make it bootable
+  if (!_running)
+  {
+    return false;
+  }
+  if ((_size != 0) && (_received != _size))
+  {
+    abort("image shorter than announced");
+    return false;
+  }
+  if (_format == FORMAT_DETECT)
+  { // fewer bytes than a package header, so it can only be a (very short) plain image
+    _format = FORMAT_RAW;
+    _stageBytes(_header, _headerLength);
+  }
+  if (_format == FORMAT_PACKAGE)
+  {
+    if ((_packageFlags & OTA_PACKAGE_COMPRESSED) && !otaInflate.isComplete())
+    {
+      _streamError = "compressed stream truncated";
+    }
+    else if ((_packageFlags & OTA_PACKAGE_DELTA) && (_deltaState != DELTA_OP))
+    {
+      _streamError = "delta truncated";
+    }
+  }
+  _flushStage();
+  if ((_streamError == nullptr) && ((_written == 0) || ((_imageSize != 0) && (_written != _imageSize))))
+  {
+    _streamError = "rebuilt image has the wrong size";
+  }
+  if (_streamError != nullptr)
+  {
+    abort(_streamError);
+    return false;
+  }
+
+  otaMD5.calculate();
+  char md5[33];
+  otaMD5.getChars(md5);
+  uint8_t sha256[32];
+#ifdef ESP_32
+  mbedtls_sha256_finish_ret(&otaSHA256, sha256);
+  mbedtls_sha256_free(&otaSHA256);
+#elif defined(ESP_8266)
+  br_sha256_out(&otaSHA256, sha256);
+#endif
+
+  if ((_expectedMD5[0] != '\0') && (strcmp(md5, _expectedMD5) != 0))
+  {
+    abort("md5 mismatch");
+    return false;
+  }
+  if (_checkSHA256 && (memcmp(sha256, _expectedSHA256, sizeof(sha256)) != 0))
+  {
+    abort("sha256 mismatch");
+    return false;
+  }
+
+  if (!Update.end(true))
+  {
+    _running = false;
+    _fail("commit failed");
+    return false;
+  }
+  _running = false;
+  debug.printLn(String(F("OTA: update complete, ")) + String(_received) + String(F(" bytes received, ")) + String(_written) + String(F(" bytes written, md5 ")) + String(md5));
+  _report("done");
+  beginTrial();
+  return true;
+}
+
+void Ota::abort(const char *reason)
+{ // throw away a partly written or unverified image, the running firmware is untouched
+  if (_running)
+  {
+    if (_flashOpen)
+    {
+#ifdef ESP_32
+      Update.abort();
+#elif defined(ESP_8266)
+      Update.end(false);
+#endif
+    }
+    _running = false;
+  }
+  _fail(reason);
+}
+
+void Ota::_fail(const char *reason)
+{ // remember and announce why the update did not happen
+  strncpy(_error, reason, sizeof(_error) - 1);
+  _error[sizeof(_error) - 1] = '\0';
+  debug.printLn(String(F("OTA: [ERROR] ")) + String(_error));
+  _report("failed");
+}
+
+void Ota::_report(const char *state)
+{ // progress goes out on '[...]/state/ota' as JSON
+  _reportTimer = millis();
+  if (!mqtt.clientIsConnected())
+  {
+    return;
+  }
+  String payload = String(F("{\"state\":\"")) + String(state) + String(F("\",\"source\":\"")) + String(_source) + String(F("\""));
+  payload += String(F(",\"received\":")) + String(_received) + String(F(",\"size\":")) + String(_size);
+  payload += String(F(",\"written\":")) + String(_written);
+  if (_size != 0)
+  {
+    payload += String(F(",\"progress\":")) + String((uint32_t)((uint64_t)_received * 100 / _size));
+  }
+  if (_error[0] != '\0')
+  {
+    payload += String(F(",\"error\":\"")) + String(_error) + String(F("\""));
+  }
+  payload += "}";
+  mqtt.publishStateSubTopic("/ota", payload);
+}
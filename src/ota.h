@@ -0,0 +1,160 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+
+// Packed images (tools/ota_pack.py) start with a header instead of the 0xE9 image magic:
+// "ABPK" version flags windowBits lookaheadBits imageSize(LE 32) baseMD5[16]
+#define OTA_PACKAGE_HEADER_SIZE (28)
+#define OTA_PACKAGE_VERSION (1)
+#define OTA_PACKAGE_COMPRESSED (0x01) // payload is heatshrink compressed
+#define OTA_PACKAGE_DELTA (0x02)      // payload is a delta against the running image
+#define OTA_DELTA_ADD (0x01)          // <length> <bytes>: literal bytes
+#define OTA_DELTA_COPY (0x02)         // <offset> <length>: bytes from the running image
+
+// how the bytes of an incoming image are to be read
+enum otaFormat_t
+{
+    FORMAT_DETECT,  // not enough bytes yet to tell
+    FORMAT_RAW,     // a plain image, written as it comes
+    FORMAT_PACKAGE  // a packed image, unpacked on the way to flash
+};
+
+// where the delta interpreter is within an operation
+enum otaDeltaState_t
+{
+    DELTA_OP,     // expecting an operation byte
+    DELTA_VARINT, // reading a length or offset
+    DELTA_ADD     // passing literal bytes through
+};
+
+// where a firmware download pulled over HTTP has got to
+enum otaPullState_t
+{
+    PULL_IDLE,      // nothing to do
+    PULL_WAITING,   // waiting out a rollout stagger or a retry back-off
+    PULL_CONNECT,   // (re)open the connection, asking for the bytes we still need
+    PULL_STREAMING  // reading the image a chunk per loop
+};
+
+// health of the firmware we booted, as far as rollback is concerned
+enum otaTrialState_t
+{
+    TRIAL_NONE,      // a firmware that has proven itself, or one flashed by cable
+    TRIAL_PENDING,   // freshly updated, on probation until it has been healthy for the trial window
+    TRIAL_ROLLEDBACK // the previous firmware, restored after the new one failed its trial
+};
+
+// what survives a reboot about the trial, sized in whole 32 bit words for ESP8266 RTC memory
+struct OtaTrial
+{
+    uint32_t magic;    // marks the record as ours
+    uint8_t state;     // otaTrialState_t
+    uint8_t boots;     // boots since the update
+    char previous[18]; // partition label to fall back to (ESP32 only)
+};
+
+class Ota
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    Ota(void) { _alive = false; }
+
+    // destructor
+    ~Ota(void) { _alive = false; }
+
+    void begin();
+    void loop();
+
+    // a firmware image arrives in chunks: start(), write() for each chunk, then finish() or abort()
+    bool start(const char *source, uint32_t size, const char *md5, const char *sha256);
+    bool write(uint8_t *data, size_t length);
+    bool finish(void);
+    void abort(const char *reason);
+
+    // download an image from an http:// URL in the background, starting after delaySeconds
+    bool pull(const char *url, const char *md5, const char *sha256, uint32_t delaySeconds);
+
+    // put a just committed image on probation, call before rebooting into it
+    void beginTrial(void);
+    bool isOnTrial(void) { return _trial.state == TRIAL_PENDING; }
+
+    // called back by the decompressor for each byte it produces
+    void unpacked(uint8_t value);
+
+    bool isRunning(void) { return _running; }
+    uint32_t getWritten(void) { return _written; }
+    const char *getError(void) { return _error; }
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    bool _alive;
+    bool _running;             // an update is in progress
+    const char *_source;       // where the image is coming from: "http", "mqtt"
+    uint32_t _size;            // expected transfer size, 0 when not known up front
+    uint32_t _received;        // bytes taken from the sender so far, what a resumed download continues from
+    uint32_t _written;         // bytes of rebuilt image written to the update partition so far
+    uint32_t _imageSize;       // size of the rebuilt image, 0 when not known up front
+    bool _flashOpen;           // the update partition has been opened
+    const char *_streamError;  // set by the unpacking stages, turned into an abort by write() or finish()
+
+    otaFormat_t _format;                       // plain image or package
+    uint8_t _header[OTA_PACKAGE_HEADER_SIZE];  // first bytes held back until the format is known
+    uint8_t _headerLength;
+    uint8_t _packageFlags;                     // OTA_PACKAGE_ bits from the header
+    uint32_t _baseSize;                        // size of the running image a delta copies from
+    otaDeltaState_t _deltaState;
+    uint8_t _deltaOp;                          // operation being read
+    uint8_t _deltaField;                       // which varint of the operation is being read
+    uint8_t _deltaShift;
+    uint32_t _deltaValue;
+    uint32_t _deltaOffset;                     // copy source, read before the copy length
+    uint32_t _deltaLength;                     // literal bytes still to come
+    uint8_t _stage[OTA_STAGE_SIZE];            // rebuilt image waiting to be hashed and written
+    size_t _stageLength;
+    char _expectedMD5[33];     // lowercase hex, empty when not supplied
+    uint8_t _expectedSHA256[32];
+    bool _checkSHA256;         // an expected SHA-256 was supplied
+    uint8_t _reportedPercent;  // progress last published
+    uint32_t _reportTimer;     // millis() of the last progress publish
+    char _error[48];           // why the last update failed
+
+    otaPullState_t _pullState; // progress of a pulled download
+    char _pullURL[160];        // image location
+    char _pullMD5[33];         // expected hashes, kept for start() once the size is known
+    char _pullSHA256[65];
+    uint32_t _pullStartAt;     // millis() at which PULL_WAITING moves on
+    uint32_t _pullLastData;    // millis() of the last bytes received, to spot a stalled connection
+    uint8_t _pullRetries;      // resume attempts since data last arrived
+
+    OtaTrial _trial;           // probation state of the running firmware
+    uint32_t _healthySince;    // millis() since WiFi and MQTT have both been up, 0 when they are not
+    bool _trialAnnounced;      // the current trial state has been published
+
+    void _trialLoop(void);
+    void _trialSave(void);
+    void _trialReport(const char *state);
+    void _rollback(const char *reason);
+    void _pullConnect(void);
+    void _pullRead(void);
+    void _pullRetry(const char *reason);
+    void _pullStop(const char *reason);
+    size_t _detect(const uint8_t *data, size_t length);
+    void _copyBase(uint32_t offset, uint32_t length);
+    void _stageBytes(const uint8_t *data, size_t length);
+    void _flushStage(void);
+    void _fail(const char *reason);
+    void _report(const char *state);
+
+#pragma endregion Protected
+};
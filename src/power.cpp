@@ -0,0 +1,172 @@
+// power.cpp : Deep sleep duty cycle for battery nodes: wake, report, wait for the acks, sleep again
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "common.h"
+#ifdef ESP_32
+#include <esp_sleep.h>
+#endif
+
+static const uint32_t powerStateMagic = 0x50575232; // "PWR2"
+
+#ifdef ESP_32
+// kept through deep sleep, cleared by a power cycle
+RTC_DATA_ATTR PowerState rtcPowerState;
+#elif defined(ESP_8266)
+static_assert((RTC_BLOCK_POWER * 4) + sizeof(PowerState) <= 512, "PowerState does not fit in RTC user memory");
+#endif
+
+void Power::begin()
+{ // called in the main code setup, handles our initialisation
+#ifdef ESP_32
+  _state = rtcPowerState;
+#elif defined(ESP_8266)
+  ESP.rtcUserMemoryRead(RTC_BLOCK_POWER, (uint32_t *)&_state, sizeof(_state));
+#endif
+  if ((_state.magic != powerStateMagic) || (_state.queued > POWER_QUEUE_SLOTS))
+  { // power on, or not ours
+    memset(&_state, 0, sizeof(_state));
+    _state.magic = powerStateMagic;
+  }
+  _published = false;
+  _publishedAt = 0;
+  _alive = true;
+  if (isDutyCycling())
+  {
+    debug.printLn(String(F("POWER: wake ")) + String(_state.cycles) + String(F(", last awake ")) + String(_state.awakeTime) + String(F("ms, ")) + String(_state.queued) + String(F(" queued")));
+  }
+}
+
+void Power::loop()
+{ // called in the main code loop, handles our periodic code
+  if (!isDutyCycling())
+  {
+    if ((_state.queued != 0) && mqtt.clientIsConnected())
+    { // kept while the broker was away, or while duty cycling was being switched off
+      _drain();
+    }
+    return;
+  }
+  if (ota.isRunning() || ota.isOnTrial() || (config.getPendingApply() != APPLY_NONE) || esp.isProvisioning())
+  { // stay up for an update, a firmware proving itself, settings still to apply, or someone setting us up
+    return;
+  }
+  if (sensors.isConverting() && (millis() < POWER_AWAKE_LIMIT))
+  { // this wake's samples are worth waiting for
+    return;
+  }
+  if (!mqtt.clientIsConnected())
+  {
+    if (millis() >= POWER_AWAKE_LIMIT)
+    { // keep what we have for next time rather than flattening the battery
+      debug.printLn(F("POWER: [WARNING] broker not reached, sleeping anyway"));
+      _sleep();
+    }
+    return;
+  }
+  if (!_published)
+  {
+    if (timeSync.isSyncing())
+    { // a moment more and this wake's samples go out with the time they were read
+      return;
+    }
+    sensors.flush();
+    mqtt.statusUpdate();
+    _drain();
+    _published = true;
+    _publishedAt = millis();
+    return;
+  }
+  if ((millis() - _publishedAt) >= POWER_LISTEN_TIME)
+  {
+    _sleep();
+  }
+}
+
+bool Power::isDutyCycling(void)
+{ // a sleep interval is set
+  return config.getSleepInterval() != 0;
+}
+
+bool Power::queue(const char *subtopic, const char *payload)
+{ // hand a message to MQTT now, or keep it for the next wake when duty cycling
+  if (!isDutyCycling() && mqtt.clientIsConnected() && (_state.queued == 0))
+  {
+    mqtt.publishSensorSubTopic(subtopic, payload);
+    return true;
+  }
+  if ((strlen(subtopic) >= POWER_QUEUE_SUBTOPIC) || (strlen(payload) >= POWER_QUEUE_PAYLOAD))
+  {
+    debug.printLn(String(F("POWER: [ERROR] message too big to queue for ")) + String(subtopic));
+    return false;
+  }
+  if (_state.queued == POWER_QUEUE_SLOTS)
+  { // the newest reading is worth more than the oldest
+    memmove(&_state.queue[0], &_state.queue[1], sizeof(PowerQueued) * (POWER_QUEUE_SLOTS - 1));
+    _state.queued--;
+    _state.dropped++;
+  }
+  PowerQueued &entry = _state.queue[_state.queued++];
+  strncpy(entry.subtopic, subtopic, sizeof(entry.subtopic));
+  strncpy(entry.payload, payload, sizeof(entry.payload));
+  _save();
+  return true;
+}
+
+void Power::giveUp(void)
+{ // we could not connect, a battery node sleeps on it rather than rebooting straight back into the same failure
+  if (isDutyCycling())
+  {
+    debug.printLn(F("POWER: [WARNING] could not connect, sleeping until the next cycle"));
+    _sleep();
+  }
+}
+
+bool Power::_drain(void)
+{ // publish the queue oldest first at QoS1, keeping whatever the broker didn't acknowledge
+  uint8_t sent = 0;
+  while ((sent < _state.queued) && mqtt.publishReliable(String(_state.queue[sent].subtopic), String(_state.queue[sent].payload)))
+  {
+    sent++;
+  }
+  if (sent != 0)
+  {
+    memmove(&_state.queue[0], &_state.queue[sent], sizeof(PowerQueued) * (_state.queued - sent));
+    _state.queued -= sent;
+    _save();
+  }
+  return _state.queued == 0;
+}
+
+void Power::_save(void)
+{
+#ifdef ESP_32
+  rtcPowerState = _state;
+#elif defined(ESP_8266)
+  ESP.rtcUserMemoryWrite(RTC_BLOCK_POWER, (uint32_t *)&_state, sizeof(_state));
+#endif
+}
+
+void Power::_sleep(void)
+{ // record the cycle and go to sleep, waking up as a fresh boot
+  sensors.flush(); // samples not yet sent are kept for the next wake
+  _state.cycles++;
+  _state.awakeTime = millis();
+  _save();
+  config.flush();
+  uint64_t interval = (uint64_t)config.getSleepInterval() * 1000000ULL;
+#ifdef ESP_8266
+  if (interval > ESP.deepSleepMax())
+  { // a record saved before the limit was enforced, or a chip that can't sleep as long as most: longer would never wake
+    interval = ESP.deepSleepMax();
+  }
+#endif
+  debug.printLn(String(F("POWER: awake for ")) + String(_state.awakeTime) + String(F("ms, sleeping for ")) + String((uint32_t)(interval / 1000000ULL)) + String(F("s")));
+  mqtt.pause(); // a clean disconnect, so the broker doesn't publish our will and mark us offline
+#ifdef ESP_32
+  esp_sleep_enable_timer_wakeup(interval);
+  esp_deep_sleep_start();
+#elif defined(ESP_8266)
+  ESP.deepSleep(interval, WAKE_RF_DEFAULT); // needs GPIO16 wired to RST to wake up
+#endif
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+
+// A telemetry message waiting for the next time we are awake and connected
+struct PowerQueued
+{
+    char subtopic[POWER_QUEUE_SUBTOPIC]; // appended to the Sensor Topic
+    char payload[POWER_QUEUE_PAYLOAD];
+};
+
+// What survives deep sleep, sized in whole 32 bit words for ESP8266 RTC memory
+struct PowerState
+{
+    uint32_t magic;     // marks the record as ours
+    uint32_t cycles;    // wake/sleep cycles since power on
+    uint32_t awakeTime; // msec awake in the last cycle
+    uint16_t dropped;   // messages lost to a full queue since power on
+    uint8_t queued;     // entries used in queue
+    uint8_t reserved;
+    PowerQueued queue[POWER_QUEUE_SLOTS];
+};
+
+class Power
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    Power(void) { _alive = false; }
+
+    // destructor
+    ~Power(void) { _alive = false; }
+
+    void begin();
+    void loop();
+
+    // hand a message to MQTT now, or keep it for the next wake when duty cycling
+    bool queue(const char *subtopic, const char *payload);
+
+    // called where we would otherwise reboot after failing to connect: a battery node sleeps on it instead
+    void giveUp(void);
+
+    bool isDutyCycling(void);
+    uint32_t getCycles(void) { return _state.cycles; }
+    uint32_t getAwakeTime(void) { return _state.awakeTime; }
+    uint16_t getDropped(void) { return _state.dropped; }
+    uint8_t getQueued(void) { return _state.queued; }
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    bool _alive;
+    PowerState _state;     // mirrored in RTC memory
+    bool _published;       // this cycle's telemetry has gone out
+    uint32_t _publishedAt; // millis() when it did, we listen for commands a little while after
+
+    bool _drain(void);
+    void _save(void);
+    void _sleep(void);
+
+#pragma endregion Protected
+};
@@ -0,0 +1,405 @@
+// rules.cpp : Rules from the config compiled into tables, run on the device when their inputs change
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "common.h"
+#ifdef ESP_32
+#include <driver/gpio.h>
+#endif
+
+static bool rulesOutputPin(uint8_t pin)
+{ // a pin a rule may drive; GPIO 6-11 are wired to the flash chip, driving one crashes the node
+  if ((pin >= 6) && (pin <= 11))
+  {
+    return false;
+  }
+#ifdef ESP_32
+  return GPIO_IS_VALID_OUTPUT_GPIO(pin);
+#elif defined(ESP_8266)
+  return pin <= 16;
+#endif
+}
+
+void Rules::begin()
+{ // called in the main code setup, handles our initialisation
+  _fired = 0;
+  _maxEvaluationUs = 0;
+  _alive = true;
+  applyConfig();
+}
+
+void Rules::applyConfig()
+{ // compile the rules setting, replacing whatever we had
+  if (!_alive)
+  {
+    return;
+  }
+  if (strcmp(_source, config.getRules()) == 0)
+  { // unchanged, keep what the rules have seen so far
+    return;
+  }
+  _compile(config.getRules());
+  debug.printLn(String(F("RULES: ")) + String(_count) + String(F(" rules loaded")));
+}
+
+void Rules::buttonChanged(uint8_t page, uint8_t id, bool pressed)
+{ // a debounced button change
+  for (uint8_t i = 0; i < _inputCount; i++)
+  {
+    if (_inputs[i].button && (_inputs[i].page == page) && (_inputs[i].id == id))
+    {
+      _changed(i, pressed ? 1.0f : 0.0f);
+    }
+  }
+}
+
+void Rules::sensorRead(SensorDriver *driver, const float *values)
+{ // a new sample, only the values rules use are looked at
+  for (uint8_t i = 0; i < _inputCount; i++)
+  {
+    if (_inputs[i].button || (strcmp(_inputs[i].sensor, driver->name()) != 0))
+    {
+      continue;
+    }
+    for (uint8_t value = 0; value < driver->values(); value++)
+    {
+      if (strcmp(_inputs[i].value, driver->valueName(value)) == 0)
+      {
+        _changed(i, values[value]);
+      }
+    }
+  }
+}
+
+void Rules::_compile(const char *text)
+{ // tokenise a copy of the setting in place, the tables point into it
+  _inputCount = 0;
+  _termCount = 0;
+  _stepCount = 0;
+  _count = 0;
+  strncpy(_source, text, sizeof(_source));
+  _source[sizeof(_source) - 1] = '\0';
+  memcpy(_text, _source, sizeof(_text));
+
+  char *save;
+  uint8_t number = 0;
+  for (char *rule = strtok_r(_text, ";", &save); rule != nullptr; rule = strtok_r(nullptr, ";", &save))
+  {
+    number++;
+    if (strspn(rule, " ") == strlen(rule))
+    { // blank, e.g. after a trailing ';'
+      continue;
+    }
+    if (_count == RULE_SLOTS)
+    {
+      debug.printLn(String(F("RULES: [ERROR] only ")) + String(RULE_SLOTS) + String(F(" rules fit, ignoring the rest")));
+      break;
+    }
+    const uint8_t inputs = _inputCount;
+    const uint8_t terms = _termCount;
+    const uint8_t steps = _stepCount;
+    if (!_compileRule(rule))
+    { // leave it out, and take back any inputs it added
+      debug.printLn(String(F("RULES: [ERROR] cannot understand rule ")) + String(number));
+      _inputCount = inputs;
+      _termCount = terms;
+      _stepCount = steps;
+      for (uint8_t i = 0; i < _inputCount; i++)
+      {
+        _inputs[i].rules &= ~(1 << _count);
+      }
+      continue;
+    }
+    for (uint8_t i = steps; i < _stepCount; i++)
+    { // only once the whole rule is in, a rule left out drives nothing
+      if ((_steps[i].action == ACTION_GPIO_ON) || (_steps[i].action == ACTION_GPIO_OFF) || (_steps[i].action == ACTION_GPIO_TOGGLE))
+      {
+        pinMode(_steps[i].pin, OUTPUT);
+      }
+    }
+  }
+}
+
+bool Rules::_compileRule(char *text)
+{ // terms joined by '&', "->", actions joined by ','
+  char *arrow = strstr(text, "->");
+  if (arrow == nullptr)
+  {
+    return false;
+  }
+  *arrow = '\0';
+  Rule &rule = _rules[_count];
+  rule.firstTerm = _termCount;
+  rule.firstStep = _stepCount;
+  rule.met = false;
+  rule.fired = 0;
+
+  char *save;
+  for (char *term = strtok_r(text, "&", &save); term != nullptr; term = strtok_r(nullptr, "&", &save))
+  {
+    if (!_compileTerm(term, 1 << _count))
+    {
+      return false;
+    }
+  }
+  for (char *step = strtok_r(arrow + 2, ",", &save); step != nullptr; step = strtok_r(nullptr, ",", &save))
+  {
+    if (!_compileStep(step))
+    {
+      return false;
+    }
+  }
+  rule.terms = _termCount - rule.firstTerm;
+  rule.steps = _stepCount - rule.firstStep;
+  if ((rule.terms == 0) || (rule.steps == 0))
+  {
+    return false;
+  }
+  _count++;
+  return true;
+}
+
+bool Rules::_compileTerm(char *text, uint16_t ruleBit)
+{ // "button 0.1 on" or "sensor.value > 21.5"
+  if (_termCount == RULE_TERMS)
+  {
+    return false;
+  }
+  char *save;
+  const char *subject = strtok_r(text, " ", &save);
+  char *second = strtok_r(nullptr, " ", &save);
+  char *third = strtok_r(nullptr, " ", &save);
+  if ((subject == nullptr) || (second == nullptr) || (strtok_r(nullptr, " ", &save) != nullptr))
+  {
+    return false;
+  }
+  RuleTerm &term = _terms[_termCount];
+  int8_t input;
+  if (strcmp(subject, "button") == 0)
+  {
+    char *end;
+    const uint8_t page = strtoul(second, &end, 10);
+    if ((*end != '.') || (third == nullptr))
+    {
+      return false;
+    }
+    const uint8_t id = strtoul(end + 1, &end, 10);
+    if ((*end != '\0') || ((strcmp(third, "on") != 0) && (strcmp(third, "off") != 0)))
+    {
+      return false;
+    }
+    input = _input(true, page, id, nullptr, nullptr);
+    term.op = RULE_EQ;
+    term.operand = (strcmp(third, "on") == 0) ? 1.0f : 0.0f;
+  }
+  else
+  {
+    static const char *const ops[] = {"<", ">", "<=", ">=", "=", "!="};
+    char *dot = strchr((char *)subject, '.');
+    if ((dot == nullptr) || (third == nullptr))
+    {
+      return false;
+    }
+    *dot = '\0';
+    uint8_t op = 0;
+    while ((op < 6) && (strcmp(second, ops[op]) != 0))
+    {
+      op++;
+    }
+    char *end;
+    term.operand = strtod(third, &end);
+    if ((op == 6) || (*end != '\0'))
+    {
+      return false;
+    }
+    input = _input(false, 0, 0, subject, dot + 1);
+    term.op = (ruleOp_t)op;
+  }
+  if (input < 0)
+  {
+    return false;
+  }
+  term.input = input;
+  _inputs[input].rules |= ruleBit;
+  _termCount++;
+  return true;
+}
+
+bool Rules::_compileStep(char *text)
+{ // "gpio 5 toggle" or "publish /subtopic the payload"
+  if (_stepCount == RULE_STEPS)
+  {
+    return false;
+  }
+  char *save;
+  const char *verb = strtok_r(text, " ", &save);
+  char *target = strtok_r(nullptr, " ", &save);
+  if ((verb == nullptr) || (target == nullptr))
+  {
+    return false;
+  }
+  RuleStep &step = _steps[_stepCount];
+  if (strcmp(verb, "gpio") == 0)
+  {
+    char *end;
+    const unsigned long pin = strtoul(target, &end, 10);
+    const char *mode = strtok_r(nullptr, " ", &save);
+    if ((*end != '\0') || (pin > UINT8_MAX) || !rulesOutputPin(pin) || (mode == nullptr) || (strtok_r(nullptr, " ", &save) != nullptr))
+    {
+      return false;
+    }
+    step.pin = pin;
+    if (strcmp(mode, "on") == 0)
+    {
+      step.action = ACTION_GPIO_ON;
+    }
+    else if (strcmp(mode, "off") == 0)
+    {
+      step.action = ACTION_GPIO_OFF;
+    }
+    else if (strcmp(mode, "toggle") == 0)
+    {
+      step.action = ACTION_GPIO_TOGGLE;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  else if ((strcmp(verb, "publish") == 0) && (target[0] == '/'))
+  { // the payload is everything after the subtopic
+    step.action = ACTION_PUBLISH;
+    step.topic = target;
+    char *payload = save + strspn(save, " ");
+    size_t length = strlen(payload);
+    while ((length != 0) && (payload[length - 1] == ' '))
+    {
+      payload[--length] = '\0';
+    }
+    step.payload = payload;
+  }
+  else
+  {
+    return false;
+  }
+  _stepCount++;
+  return true;
+}
+
+int8_t Rules::_input(bool button, uint8_t page, uint8_t id, const char *sensor, const char *value)
+{ // find or add an input, -1 when the table is full
+  for (uint8_t i = 0; i < _inputCount; i++)
+  {
+    const RuleInput &input = _inputs[i];
+    if ((input.button == button) &&
+        (button ? ((input.page == page) && (input.id == id)) : ((strcmp(input.sensor, sensor) == 0) && (strcmp(input.value, value) == 0))))
+    {
+      return i;
+    }
+  }
+  if (_inputCount == RULE_INPUTS)
+  {
+    return -1;
+  }
+  RuleInput &input = _inputs[_inputCount];
+  input.button = button;
+  input.page = page;
+  input.id = id;
+  input.sensor = sensor;
+  input.value = value;
+  input.known = false;
+  input.latest = 0;
+  input.rules = 0;
+  return _inputCount++;
+}
+
+void Rules::_changed(uint8_t index, float value)
+{ // look at the rules on this input, and only if it has moved
+  RuleInput &input = _inputs[index];
+  if (input.known && (input.latest == value))
+  {
+    return;
+  }
+  const uint32_t start = micros();
+  input.known = true;
+  input.latest = value;
+  for (uint8_t r = 0; r < _count; r++)
+  {
+    if (!(input.rules & (1 << r)))
+    {
+      continue;
+    }
+    Rule &rule = _rules[r];
+    bool met = true;
+    for (uint8_t t = rule.firstTerm; met && (t < rule.firstTerm + rule.terms); t++)
+    {
+      met = _test(_terms[t]);
+    }
+    if (met && !rule.met)
+    {
+      _run(rule);
+    }
+    rule.met = met;
+  }
+  const uint32_t elapsed = micros() - start;
+  if (elapsed > _maxEvaluationUs)
+  {
+    _maxEvaluationUs = elapsed;
+  }
+}
+
+bool Rules::_test(const RuleTerm &term)
+{ // an input not seen yet is never true
+  const RuleInput &input = _inputs[term.input];
+  if (!input.known)
+  {
+    return false;
+  }
+  switch (term.op)
+  {
+  case RULE_LT:
+    return input.latest < term.operand;
+  case RULE_GT:
+    return input.latest > term.operand;
+  case RULE_LE:
+    return input.latest <= term.operand;
+  case RULE_GE:
+    return input.latest >= term.operand;
+  case RULE_EQ:
+    return input.latest == term.operand;
+  case RULE_NE:
+    return input.latest != term.operand;
+  }
+  return false;
+}
+
+void Rules::_run(Rule &rule)
+{ // GPIO straight away, publishing only if the broker is there
+  for (uint8_t s = rule.firstStep; s < rule.firstStep + rule.steps; s++)
+  {
+    const RuleStep &step = _steps[s];
+    switch (step.action)
+    {
+    case ACTION_GPIO_ON:
+      _levels |= (1ULL << step.pin);
+      digitalWrite(step.pin, HIGH);
+      break;
+    case ACTION_GPIO_OFF:
+      _levels &= ~(1ULL << step.pin);
+      digitalWrite(step.pin, LOW);
+      break;
+    case ACTION_GPIO_TOGGLE: // from what we last wrote, an output doesn't read back on every chip
+      _levels ^= (1ULL << step.pin);
+      digitalWrite(step.pin, (_levels & (1ULL << step.pin)) ? HIGH : LOW);
+      break;
+    case ACTION_PUBLISH:
+      if (mqtt.clientIsConnected())
+      {
+        mqtt.publishStateSubTopic(step.topic, step.payload);
+      }
+      break;
+    }
+  }
+  rule.fired++;
+  _fired++;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+#include "config.h"
+
+class SensorDriver;
+
+// Local automation, so a button can drive a relay with the broker down. The "rules" setting holds rules separated by ';':
+//
+//   rule   := term { '&' term } '->' action { ',' action }
+//   term   := 'button' <page>.<id> ('on' | 'off')
+//           | <sensor>.<value> ('<' | '>' | '<=' | '>=' | '=' | '!=') <number>
+//   action := 'gpio' <pin> ('on' | 'off' | 'toggle')
+//           | 'publish' <State subtopic> <payload without , or ;>
+//
+// e.g. "button 0.1 on -> gpio 5 toggle; fake1.temperature > 24 -> gpio 4 on, publish /alarm hot"
+// A rule fires when its terms go from not all true to all true, and is only looked at when one of its inputs changes.
+// <pin> has to be an output the chip has and not one of the flash pins, GPIO 6-11, or the rule is left out.
+
+// what a term compares
+enum ruleOp_t : uint8_t
+{
+    RULE_LT,
+    RULE_GT,
+    RULE_LE,
+    RULE_GE,
+    RULE_EQ,
+    RULE_NE
+};
+
+enum ruleAction_t : uint8_t
+{
+    ACTION_GPIO_ON,
+    ACTION_GPIO_OFF,
+    ACTION_GPIO_TOGGLE,
+    ACTION_PUBLISH
+};
+
+// Something rules watch: a button, or one value of a sensor
+struct RuleInput
+{
+    bool button;     // else a sensor
+    uint8_t page;    // button
+    uint8_t id;
+    const char *sensor; // driver name, into the compiled text
+    const char *value;  // value name
+    bool known;      // has been seen since the rules were compiled
+    float latest;    // 1 or 0 for a button
+    uint16_t rules;  // bit per rule that has a term on this input
+};
+
+struct RuleTerm
+{
+    uint8_t input; // into the inputs
+    ruleOp_t op;
+    float operand;
+};
+
+struct RuleStep
+{
+    ruleAction_t action;
+    uint8_t pin;         // gpio
+    const char *topic;   // publish, into the compiled text
+    const char *payload;
+};
+
+struct Rule
+{
+    uint8_t firstTerm;
+    uint8_t terms;
+    uint8_t firstStep;
+    uint8_t steps;
+    bool met;       // all terms true when last looked at
+    uint32_t fired; // times the actions have run
+};
+
+static_assert(RULE_SLOTS <= 16, "RuleInput.rules has a bit per rule");
+
+class Rules
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    Rules(void)
+    {
+        _alive = false;
+        _source[0] = '\0';
+        _inputCount = 0;
+        _termCount = 0;
+        _stepCount = 0;
+        _count = 0;
+        _levels = 0;
+    }
+
+    // destructor
+    ~Rules(void) { _alive = false; }
+
+    void begin();
+    void applyConfig();
+
+    // inputs, from where the change is first known
+    void buttonChanged(uint8_t page, uint8_t id, bool pressed);
+    void sensorRead(SensorDriver *driver, const float *values);
+
+    uint8_t getCount(void) { return _count; }
+    uint32_t getFired(void) { return _fired; }
+    uint32_t getMaxEvaluationUs(void) { return _maxEvaluationUs; }
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    bool _alive;
+    char _source[sizeof(((ConfigData *)nullptr)->rules)]; // the setting the tables were compiled from
+    char _text[sizeof(_source)];                           // a copy of it, tokenised in place and pointed into
+    RuleInput _inputs[RULE_INPUTS];
+    RuleTerm _terms[RULE_TERMS];
+    RuleStep _steps[RULE_STEPS];
+    Rule _rules[RULE_SLOTS];
+    uint8_t _inputCount;
+    uint8_t _termCount;
+    uint8_t _stepCount;
+    uint8_t _count;
+    uint32_t _fired;           // rule firings since boot
+    uint32_t _maxEvaluationUs; // slowest input change to actions done
+    uint64_t _levels;          // bit per GPIO, as actions last wrote it
+
+    void _compile(const char *text);
+    bool _compileRule(char *text);
+    bool _compileTerm(char *text, uint16_t ruleBit);
+    bool _compileStep(char *text);
+    int8_t _input(bool button, uint8_t page, uint8_t id, const char *sensor, const char *value);
+    void _changed(uint8_t index, float value);
+    bool _test(const RuleTerm &term);
+    void _run(Rule &rule);
+
+#pragma endregion Protected
+};
@@ -0,0 +1,226 @@
+// scratch.cpp : Per loop() scratch arena, and strings built in it
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "common.h"
+#include <stdarg.h>
+
+void Scratch::begin()
+{ // called in the main code setup, handles our initialisation
+  _top = 0;
+  _highWater = 0;
+  _overflows = 0;
+  _alive = true;
+}
+
+void Scratch::loop()
+{ // called at the end of the main code loop, when nothing can still be using the arena
+  _top = 0;
+}
+
+char *Scratch::allocate(size_t size)
+{ // size bytes, word aligned, or nullptr when the arena is full
+  const size_t start = (_top + 3) & ~(size_t)3;
+  if ((start + size) > SCRATCH_SIZE)
+  {
+    return nullptr;
+  }
+  _top = start + size;
+  if (_top > _highWater)
+  {
+    _highWater = _top;
+  }
+  return _buffer + start;
+}
+
+bool Scratch::extend(char *end, size_t size)
+{ // grow the allocation that ends at end by size bytes, only possible for the newest one
+  if ((end != (_buffer + _top)) || ((_top + size) > SCRATCH_SIZE))
+  {
+    return false;
+  }
+  _top += size;
+  if (_top > _highWater)
+  {
+    _highWater = _top;
+  }
+  return true;
+}
+
+size_t Scratch::available(char *end)
+{ // how far the allocation that ends at end could grow
+  return (end == (_buffer + _top)) ? (SCRATCH_SIZE - _top) : 0;
+}
+
+void Scratch::release(char *start, size_t size)
+{ // hand back the newest allocation early, anything else waits for loop()
+  if ((start + size) == (_buffer + _top))
+  {
+    _top = start - _buffer;
+  }
+}
+
+ScratchString::ScratchString(void)
+{
+  _length = 0;
+  _truncated = false;
+  _data = scratch.allocate(1);
+  if (_data != nullptr)
+  {
+    _data[0] = '\0';
+  }
+  else
+  {
+    scratch.overflowed();
+  }
+}
+
+ScratchString::~ScratchString(void)
+{
+  if (_data != nullptr)
+  {
+    scratch.release(_data, _length + 1);
+  }
+}
+
+char *ScratchString::_grow(size_t length)
+{ // room for length more characters in the arena, or nullptr once we are on the heap
+  if ((_data == nullptr) || (SCRATCH_TRUNCATE && _truncated))
+  { // once something has been cut off, nothing after it goes in either, or the text would have holes
+    return nullptr;
+  }
+  if (scratch.extend(_data + _length + 1, length))
+  {
+    char *at = _data + _length;
+    _length += length;
+    _data[_length] = '\0';
+    return at;
+  }
+#if SCRATCH_TRUNCATE
+  // out of room, or something else was allocated after us: stop here rather than touch the heap
+  if (!_truncated)
+  {
+    _truncated = true;
+    scratch.overflowed();
+  }
+  return nullptr;
+#endif
+  // out of room, or something else was allocated after us: move what we have to the heap
+  scratch.overflowed();
+  debug.printLn(String(F("SCRATCH: [WARNING] arena full at ")) + String(scratch.getUsed()) + String(F(" bytes, using the heap")));
+  _fallback.reserve(_length + length + 1);
+  _fallback = _data;
+  scratch.release(_data, _length + 1);
+  _data = nullptr;
+  return nullptr;
+}
+
+ScratchString &ScratchString::add(const char *text, size_t length)
+{
+  char *at = _grow(length);
+  if (at != nullptr)
+  {
+    memcpy(at, text, length);
+    return *this;
+  }
+  if (SCRATCH_TRUNCATE)
+  {
+    return *this;
+  }
+  _fallback.reserve(_length + length);
+  for (size_t i = 0; i < length; i++)
+  {
+    _fallback += text[i];
+  }
+  _length += length;
+  return *this;
+}
+
+ScratchString &ScratchString::add(const __FlashStringHelper *text)
+{
+  return _addP((PGM_P)text, strlen_P((PGM_P)text));
+}
+
+ScratchString &ScratchString::_addP(PGM_P text, size_t length)
+{ // add from flash
+  char *at = _grow(length);
+  if (at != nullptr)
+  {
+    memcpy_P(at, text, length);
+    return *this;
+  }
+  if (SCRATCH_TRUNCATE)
+  {
+    return *this;
+  }
+  _fallback.reserve(_length + length);
+  for (size_t i = 0; i < length; i++)
+  {
+    _fallback += (char)pgm_read_byte(text + i);
+  }
+  _length += length;
+  return *this;
+}
+
+ScratchString &ScratchString::addf(PGM_P format, ...)
+{ // printf straight into the arena, going through a temporary only when it doesn't fit
+  if (SCRATCH_TRUNCATE && _truncated)
+  { // it would be written past the end before _grow() refused it
+    return *this;
+  }
+  va_list args;
+  va_start(args, format);
+  va_list retry;
+  va_copy(retry, args);
+  const size_t room = (_data != nullptr) ? scratch.available(_data + _length + 1) : 0;
+  int length = (_data != nullptr) ? vsnprintf_P(_data + _length, room + 1, format, args) : vsnprintf_P(nullptr, 0, format, args);
+  va_end(args);
+  if (length > 0)
+  {
+    if ((_data != nullptr) && ((size_t)length <= room))
+    { // already written, just claim it
+      _grow(length);
+    }
+    else if (SCRATCH_TRUNCATE)
+    { // keep as much as fitted
+      if (_data != nullptr)
+      {
+        _grow(room);
+      }
+      if (!_truncated)
+      {
+        _truncated = true;
+        scratch.overflowed();
+      }
+    }
+    else
+    {
+      if (_data != nullptr)
+      {
+        _data[_length] = '\0'; // vsnprintf wrote a partial result over our terminator
+      }
+      std::unique_ptr<char[]> text(new char[length + 1]);
+      vsnprintf_P(text.get(), length + 1, format, retry);
+      add(text.get(), length);
+    }
+  }
+  va_end(retry);
+  return *this;
+}
+
+ScratchString &ScratchString::addTemplate(PGM_P text, const char *value)
+{ // add a WiFiManager page template from flash with its {v} placeholders filled in
+  const size_t length = strlen_P(text);
+  size_t start = 0;
+  for (size_t i = 0; (i + 2) < length; i++)
+  {
+    if ((pgm_read_byte(text + i) == '{') && (pgm_read_byte(text + i + 1) == 'v') && (pgm_read_byte(text + i + 2) == '}'))
+    {
+      _addP(text + start, i - start);
+      add(value);
+      start = i + 3;
+      i += 2;
+    }
+  }
+  return _addP(text + start, length - start);
+}
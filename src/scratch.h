@@ -0,0 +1,88 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+
+// Bump allocator for things that live for one request or one message, emptied at the end of every loop()
+class Scratch
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    Scratch(void) { _alive = false; }
+
+    // destructor
+    ~Scratch(void) { _alive = false; }
+
+    void begin();
+    void loop();
+
+    char *allocate(size_t size);
+    bool extend(char *end, size_t size);
+    size_t available(char *end);
+    void release(char *start, size_t size);
+    void overflowed(void) { _overflows++; }
+
+    size_t getUsed(void) { return _top; }
+    size_t getHighWater(void) { return _highWater; }
+    uint32_t getOverflows(void) { return _overflows; }
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    bool _alive;
+    char _buffer[SCRATCH_SIZE]; // the arena
+    size_t _top;                // bytes handed out since the last loop()
+    size_t _highWater;          // most bytes ever handed out in one loop()
+    uint32_t _overflows;        // strings that didn't fit and went to the heap
+
+#pragma endregion Protected
+};
+
+// A string built in the scratch arena, for pages and payloads that are sent and forgotten.
+// Appends grow it in place while it is the newest allocation; if it can't grow, it moves to the heap and carries on,
+// or in a SCRATCH_TRUNCATE build stops where it is.
+// It is a Print too, so print() and serializeJson() can write straight into it.
+class ScratchString : public Print
+{
+public:
+    ScratchString(void);
+    ~ScratchString(void);
+    ScratchString(const ScratchString &) = delete;
+    ScratchString &operator=(const ScratchString &) = delete;
+
+    ScratchString &add(const char *text) { return add(text, strlen(text)); }
+    ScratchString &add(const char *text, size_t length);
+    ScratchString &add(const __FlashStringHelper *text);
+    ScratchString &add(const String &text) { return add(text.c_str(), text.length()); }
+    ScratchString &add(char value) { return add(&value, 1); }
+    ScratchString &add(int value) { return addf(PSTR("%d"), value); }
+    ScratchString &add(unsigned int value) { return addf(PSTR("%u"), value); }
+    ScratchString &add(long value) { return addf(PSTR("%ld"), value); }
+    ScratchString &add(unsigned long value) { return addf(PSTR("%lu"), value); }
+    ScratchString &addf(PGM_P format, ...);
+    ScratchString &addTemplate(PGM_P text, const char *value);
+
+    size_t write(uint8_t value) override { add((char)value); return 1; }
+    size_t write(const uint8_t *buffer, size_t size) override { add((const char *)buffer, size); return size; }
+
+    const char *c_str(void) const { return (_data != nullptr) ? _data : _fallback.c_str(); }
+    size_t length(void) const { return _length; }
+
+protected:
+    char *_data;      // our characters in the arena, nullptr once we've moved to _fallback
+    size_t _length;   // not counting the terminator
+    String _fallback; // where we went when the arena was full
+    bool _truncated;  // SCRATCH_TRUNCATE: the arena was full and we stopped there
+
+    ScratchString &_addP(PGM_P text, size_t length);
+    char *_grow(size_t length);
+};
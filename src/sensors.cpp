@@ -0,0 +1,329 @@
+// sensors.cpp : Sensor driver registry, sampling each on its own period with reads that share a bus batched together
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "common.h"
+
+#if SENSOR_FAKE
+// two on one bus to show a shared conversion, one on its own
+static FakeSensor fakeWire1("fake1", BUS_ONEWIRE, 10 * ASECOND, 750);
+static FakeSensor fakeWire2("fake2", BUS_ONEWIRE, 10 * ASECOND, 750);
+static FakeSensor fakeAnalog("fake3", BUS_NONE, 15 * ASECOND, 0);
+#endif
+
+const char *FakeSensor::valueName(uint8_t index)
+{ // the same pair a common temperature and humidity part gives
+  return (index == 0) ? "temperature" : "humidity";
+}
+
+bool FakeSensor::start(bool shared)
+{ // nothing to talk to, just note when the conversion would be done
+  _startedAt = millis();
+  return true;
+}
+
+bool FakeSensor::read(float *values)
+{ // a slow sawtooth, so anything watching the topic can see samples arrive in order
+  if ((millis() - _startedAt) < _latency)
+  { // a real part would hand back a stale or half finished conversion here
+    return false;
+  }
+  values[0] = 20.0f + (float)(_samples % 20) * 0.25f;
+  values[1] = 50.0f - (float)(_samples % 10);
+  _samples++;
+  return true;
+}
+
+static void sensorSeries(ScratchString &payload, const SensorBatch &batch, uint8_t first, uint8_t count, int8_t value)
+{ // one value of count samples from first, or for -1 when each was read: a number for one sample, an array for more
+  char number[24];
+  if (count > 1)
+  {
+    payload.add('[');
+  }
+  for (uint8_t sample = first; sample < (first + count); sample++)
+  {
+    if (sample != first)
+    {
+      payload.add(',');
+    }
+    if (value < 0)
+    {
+      payload.add(timeSync.format(batch.at[sample], number, sizeof(number)));
+    }
+    else
+    {
+      payload.add(dtostrf(batch.samples[sample][value], 1, 2, number));
+    }
+  }
+  if (count > 1)
+  {
+    payload.add(']');
+  }
+}
+
+void Sensors::begin()
+{ // called in the main code setup, handles our initialisation
+  _readings = 0;
+  _errors = 0;
+  _batches = 0;
+  _messages = 0;
+  _dropped = 0;
+#if SENSOR_FAKE
+  add(&fakeWire1);
+  add(&fakeWire2);
+  add(&fakeAnalog);
+#endif
+  _alive = true;
+}
+
+void Sensors::loop()
+{ // called in the main code loop, handles our periodic code
+  if (!_alive || (_count == 0))
+  {
+    return;
+  }
+  const uint32_t now = millis();
+  _readReady(now); // first, so a bus finishing this time round is free for its next batch
+  _startDue(now);
+  _flushDue(now);
+}
+
+bool Sensors::add(SensorDriver *driver)
+{ // register a driver, its first sample is due straight away
+  if ((_count == SENSOR_SLOTS) || (driver->values() > SENSOR_VALUES))
+  {
+    debug.printLn(String(F("SENSOR: [ERROR] cannot add ")) + String(driver->name()));
+    return false;
+  }
+  SensorSlot &slot = _slots[_count++];
+  slot.driver = driver;
+  slot.state = SENSOR_IDLE;
+  slot.dueAt = millis();
+  slot.readyAt = 0;
+  slot.errors = 0;
+  slot.batch.count = 0;
+  debug.printLn(String(F("SENSOR: added ")) + String(driver->name()) + String(F(" every ")) + String(driver->period()) + String(F("ms")));
+  return true;
+}
+
+bool Sensors::isConverting(void)
+{ // a sample has been started and not yet read
+  for (uint8_t i = 0; i < _count; i++)
+  {
+    if (_slots[i].state == SENSOR_CONVERTING)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Sensors::_busBusy(sensorBus_t bus)
+{ // a conversion is in progress on the bus, its results are read before anything else starts on it
+  for (uint8_t i = 0; i < _count; i++)
+  {
+    if ((_slots[i].state == SENSOR_CONVERTING) && (_slots[i].driver->bus() == bus))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Sensors::_startDue(uint32_t now)
+{ // start every sensor that is due, bringing forward those on the same bus that will be due shortly
+  for (uint8_t i = 0; i < _count; i++)
+  {
+    if ((_slots[i].state != SENSOR_IDLE) || ((int32_t)(now - _slots[i].dueAt) < 0))
+    {
+      continue;
+    }
+    const sensorBus_t bus = _slots[i].driver->bus();
+    if ((bus != BUS_NONE) && _busBusy(bus))
+    { // wait for the batch in progress
+      continue;
+    }
+    _batches++;
+    bool shared = false;
+    for (uint8_t j = i; j < _count; j++)
+    {
+      SensorSlot &slot = _slots[j];
+      if ((slot.state != SENSOR_IDLE) || ((int32_t)(slot.dueAt - now) > (int32_t)SENSOR_BATCH_WINDOW))
+      {
+        continue;
+      }
+      if ((j != i) && ((bus == BUS_NONE) || (slot.driver->bus() != bus)))
+      { // only the bus is shared, nothing on its own
+        continue;
+      }
+      if (slot.driver->start(shared))
+      {
+        slot.state = SENSOR_CONVERTING;
+        slot.readyAt = now + slot.driver->latency();
+        shared = true;
+      }
+      else
+      {
+        slot.errors++;
+        _errors++;
+        debug.printLn(String(F("SENSOR: [WARNING] ")) + String(slot.driver->name()) + String(F(" did not start")));
+      }
+      // keep to the period rather than drift by however late we were, unless we are a whole period behind
+      slot.dueAt += slot.driver->period();
+      if ((int32_t)(now - slot.dueAt) >= 0)
+      {
+        slot.dueAt = now + slot.driver->period();
+      }
+    }
+  }
+}
+
+void Sensors::_readReady(uint32_t now)
+{ // read every conversion that has had its time
+  float values[SENSOR_VALUES];
+  for (uint8_t i = 0; i < _count; i++)
+  {
+    SensorSlot &slot = _slots[i];
+    if ((slot.state != SENSOR_CONVERTING) || ((int32_t)(now - slot.readyAt) < 0))
+    {
+      continue;
+    }
+    slot.state = SENSOR_IDLE;
+    if (slot.driver->read(values))
+    {
+      _readings++;
+      rules.sensorRead(slot.driver, values);
+      history.record(slot.driver, values);
+      _batch(slot, values, now);
+    }
+    else
+    {
+      slot.errors++;
+      _errors++;
+      debug.printLn(String(F("SENSOR: [WARNING] ")) + String(slot.driver->name()) + String(F(" read failed")));
+    }
+  }
+}
+
+void Sensors::_batch(SensorSlot &slot, const float *values, uint32_t now)
+{ // keep a sample for the slot's next message, less the values that go out with their window instead
+  uint8_t carried = 0;
+  for (uint8_t i = 0; i < slot.driver->values(); i++)
+  {
+    if (!aggregator.add(slot.driver, i, values[i]))
+    {
+      carried |= 1 << i;
+    }
+  }
+  if (carried == 0)
+  {
+    return;
+  }
+  SensorBatch &batch = slot.batch;
+  if ((batch.count != 0) && (batch.values != carried))
+  { // the sensor windows changed under the batch, every sample of a message has the same values
+    if (power.isDutyCycling() || mqtt.clientIsConnected())
+    {
+      _flush(slot);
+    }
+    else
+    {
+      _dropped += batch.count;
+      batch.count = 0;
+    }
+  }
+  if (batch.count == SENSOR_BATCH_SAMPLES)
+  { // the broker has been away a while, the newest samples are worth more; history keeps the rest on flash
+    memmove(&batch.at[0], &batch.at[1], sizeof(batch.at[0]) * (SENSOR_BATCH_SAMPLES - 1));
+    memmove(&batch.samples[0], &batch.samples[1], sizeof(batch.samples[0]) * (SENSOR_BATCH_SAMPLES - 1));
+    batch.count--;
+    _dropped++;
+  }
+  batch.values = carried;
+  batch.at[batch.count] = now;
+  memcpy(batch.samples[batch.count], values, sizeof(batch.samples[0]));
+  batch.count++;
+}
+
+void Sensors::flush(void)
+{ // publish every batch now, Power calls this for a duty cycling node once it has the broker and the time, or before it sleeps
+  for (uint8_t i = 0; i < _count; i++)
+  {
+    if (_slots[i].batch.count != 0)
+    {
+      _flush(_slots[i]);
+    }
+  }
+}
+
+void Sensors::_flushDue(uint32_t now)
+{ // publish the batches that are big enough or old enough, holding them while the broker is away or the time is a moment off
+  if (power.isDutyCycling() || !mqtt.clientIsConnected())
+  { // a duty cycling node is flushed by Power once it has the broker and the time, or before it sleeps
+    return;
+  }
+  const uint8_t size = max(config.getSensorBatch(), (uint8_t)1);
+  const uint32_t age = config.getSensorBatchAge() * ASECOND;
+  const bool syncing = timeSync.isSyncing();
+  for (uint8_t i = 0; i < _count; i++)
+  {
+    SensorBatch &batch = _slots[i].batch;
+    if (batch.count == 0)
+    {
+      continue;
+    }
+    if ((batch.count == SENSOR_BATCH_SAMPLES) || (!syncing && ((batch.count >= size) || ((now - batch.at[0]) >= age))))
+    {
+      _flush(_slots[i]);
+    }
+  }
+}
+
+void Sensors::_flush(SensorSlot &slot)
+{ // the whole batch in one message straight to MQTT, or while duty cycling a message a sample through the queue Power
+  // keeps across deep sleep, which only has room for one
+  SensorBatch &batch = slot.batch;
+  if (power.isDutyCycling())
+  {
+    for (uint8_t sample = 0; sample < batch.count; sample++)
+    {
+      _send(slot, sample, 1);
+    }
+  }
+  else
+  {
+    _send(slot, 0, batch.count);
+  }
+  batch.count = 0;
+}
+
+void Sensors::_send(SensorSlot &slot, uint8_t first, uint8_t count)
+{ // one JSON object on the driver's Sensor subtopic, with arrays in place of numbers when it carries more than one sample:
+  // {"time":1700000000.250,"temperature":20.25} or {"time":[1700000000.250,1700000010.250],"temperature":[20.25,20.50]}
+  SensorBatch &batch = slot.batch;
+  SensorDriver *driver = slot.driver;
+  ScratchString subtopic;
+  subtopic.add('/').add(driver->name());
+  ScratchString payload;
+  payload.add(F("{\"")).add(timeSync.key()).add(F("\":"));
+  sensorSeries(payload, batch, first, count, -1);
+  for (uint8_t i = 0; i < driver->values(); i++)
+  {
+    if (batch.values & (1 << i))
+    {
+      payload.add(F(",\"")).add(driver->valueName(i)).add(F("\":"));
+      sensorSeries(payload, batch, first, count, i);
+    }
+  }
+  payload.add('}');
+  _messages++;
+  if (power.isDutyCycling())
+  {
+    power.queue(subtopic.c_str(), payload.c_str());
+  }
+  else
+  {
+    mqtt.publishSensorSubTopic(subtopic.c_str(), payload.c_str());
+  }
+}
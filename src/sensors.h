@@ -0,0 +1,153 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+
+// What a sensor hangs off: sensors sharing a bus are started together, so one transaction serves them all
+enum sensorBus_t : uint8_t
+{
+    BUS_NONE,    // nothing shared, e.g. an analog pin
+    BUS_I2C,
+    BUS_ONEWIRE, // one "convert T" broadcast starts every device on the wire
+    BUS_COUNT
+};
+
+// A sensor driver. A sample is split into start() and read(), latency() apart, so nothing waits on the hardware.
+class SensorDriver
+{
+public:
+    virtual ~SensorDriver(void) {}
+
+    virtual const char *name(void) = 0;             // subtopic of the Sensor Topic, short enough to keep across deep sleep
+    virtual sensorBus_t bus(void) { return BUS_NONE; }
+    virtual uint32_t period(void) = 0;              // msec between samples
+    virtual uint32_t latency(void) { return 0; }    // msec from start() until read() has a result
+    virtual uint8_t values(void) = 0;               // how many values read() fills in, up to SENSOR_VALUES
+    virtual const char *valueName(uint8_t index) = 0;
+
+    // begin a conversion; shared is true when another driver has already started this batch on the bus
+    // (e.g. its OneWire broadcast covers us too). false if the hardware didn't answer.
+    virtual bool start(bool shared) = 0;
+    // fetch the result of the conversion started latency() ago, false if there isn't a good one
+    virtual bool read(float *values) = 0;
+};
+
+// Stands in for real hardware, so the scheduling and publishing can be run on any board
+class FakeSensor : public SensorDriver
+{
+public:
+    FakeSensor(const char *name, sensorBus_t bus, uint32_t period, uint32_t latency)
+    {
+        _name = name;
+        _bus = bus;
+        _period = period;
+        _latency = latency;
+        _samples = 0;
+        _startedAt = 0;
+    }
+
+    const char *name(void) override { return _name; }
+    sensorBus_t bus(void) override { return _bus; }
+    uint32_t period(void) override { return _period; }
+    uint32_t latency(void) override { return _latency; }
+    uint8_t values(void) override { return 2; }
+    const char *valueName(uint8_t index) override;
+    bool start(bool shared) override;
+    bool read(float *values) override;
+
+protected:
+    const char *_name;
+    sensorBus_t _bus;
+    uint32_t _period;
+    uint32_t _latency;
+    uint32_t _samples;   // conversions completed, drives the waveform
+    uint32_t _startedAt; // millis() of the conversion in progress, a read before latency() is over fails
+};
+
+// where a registered driver is in its cycle
+enum sensorState_t : uint8_t
+{
+    SENSOR_IDLE,      // waiting for its next sample to fall due
+    SENSOR_CONVERTING // started, result ready at readyAt
+};
+
+// Samples of one sensor waiting to go out in one message
+struct SensorBatch
+{
+    uint8_t count;
+    uint8_t values;                     // bit per driver value carried, the others go to the aggregator
+    uint32_t at[SENSOR_BATCH_SAMPLES];  // millis() each sample was read, stamped with the time when the batch goes
+    float samples[SENSOR_BATCH_SAMPLES][SENSOR_VALUES];
+};
+
+struct SensorSlot
+{
+    SensorDriver *driver;
+    sensorState_t state;
+    uint32_t dueAt;   // millis() the next sample should start
+    uint32_t readyAt; // millis() the conversion in progress can be read
+    uint32_t errors;  // failed starts and reads
+    SensorBatch batch;
+};
+
+class Sensors
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    Sensors(void)
+    {
+        _alive = false;
+        _count = 0;
+    }
+
+    // destructor
+    ~Sensors(void) { _alive = false; }
+
+    void begin();
+    void loop();
+
+    // register a driver, before or after begin(); it must outlive us
+    bool add(SensorDriver *driver);
+
+    // publish every batch now, for a duty cycling node once it has the broker and the time, or before it sleeps
+    void flush(void);
+
+    bool isConverting(void);
+    uint8_t getCount(void) { return _count; }
+    uint32_t getReadings(void) { return _readings; }
+    uint32_t getErrors(void) { return _errors; }
+    uint32_t getBatches(void) { return _batches; }
+    uint32_t getMessages(void) { return _messages; }
+    uint32_t getDropped(void) { return _dropped; }
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    bool _alive;
+    SensorSlot _slots[SENSOR_SLOTS];
+    uint8_t _count;
+    uint32_t _readings; // samples published since boot
+    uint32_t _errors;   // failed starts and reads since boot
+    uint32_t _batches;  // bus transactions started since boot, each covering one or more drivers
+    uint32_t _messages; // sample batches published since boot, each carrying one or more readings
+    uint32_t _dropped;  // samples pushed out of a full batch while the broker was away
+
+    bool _busBusy(sensorBus_t bus);
+    void _startDue(uint32_t now);
+    void _readReady(uint32_t now);
+    void _batch(SensorSlot &slot, const float *values, uint32_t now);
+    void _flushDue(uint32_t now);
+    void _flush(SensorSlot &slot);
+    void _send(SensorSlot &slot, uint8_t first, uint8_t count);
+
+#pragma endregion Protected
+};
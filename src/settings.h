@@ -31,8 +31,131 @@
 
 #define MQTT_MAX_PACKET_SIZE (4096)               // Size of buffer for incoming MQTT message
 #define MQTT_STATUS_UPDATE_INTERVAL (5 * AMINUTE) // Time in msec between publishing MQTT status updates (5 minutes)
+#define MQTT_RETRY_MIN (10 * ASECOND)             // Time between the first failed broker connection attempt and the next
+#define MQTT_RETRY_MAX (5 * AMINUTE)              // Longest time between attempts, the wait doubles after each failure
+#define MQTT_JSON_KEY_SIZE (20)                   // Bytes allowed for each setting's name in a config command, see MQTT_JSON_DOCUMENT_SIZE
 
 #define MDNS_ENABLED (true) // mDNS enabled
 
+#define WEB_SESSION_SLOTS (4)              // Number of browser login sessions held at once
+#define WEB_SESSION_TIMEOUT (30 * AMINUTE) // Idle time in msec before a login session expires
+#define WEB_SESSION_COOKIE ("ESPSESSION")  // Name of the HttpOnly cookie carrying the session token
+
+#define METRICS_CLIENT_SLOTS (8) // Number of remote addresses tracked for per-client HTTP request counts
+
+#define DEFAULT_HTTP_RATE_LIMIT (2)    // Requests per second each HTTP client may sustain, 0 disables rate limiting
+#define DEFAULT_HTTP_RATE_BURST (10)   // Requests each HTTP client may make back to back before being limited
+#define DEFAULT_HTTP_MAX_IN_FLIGHT (1) // HTTP requests allowed to be handled at once (handlers can re-enter web.loop)
+#define HTTP_RATE_CLIENT_SLOTS (8)     // Number of remote addresses holding a rate limit bucket
+
+#define OTA_PULL_CHUNK (1024)                 // Bytes of a pulled firmware image read per loop iteration
+#define OTA_PULL_TIMEOUT (2 * ASECOND)        // Timeout for connecting to the firmware server and reading its headers, loop() waits on it
+#define OTA_PULL_STALL_TIMEOUT (15 * ASECOND) // Time without data before a pulled download is treated as dropped
+#define OTA_PULL_RETRIES (5)                  // Resume attempts for a pulled download before giving up
+#define OTA_PULL_RETRY_DELAY (5 * ASECOND)    // Back-off between resume attempts, multiplied by the attempt number
+
+#define HEATSHRINK_MAX_WINDOW_BITS (11) // Largest compression window a packed OTA image may use, costs 2^bits bytes of RAM
+#define OTA_STAGE_SIZE (256)            // Bytes of rebuilt image gathered before hashing and writing them to flash
+
+#define DEFAULT_OTA_TRIAL_WINDOW (120)    // Seconds a new firmware must run with WiFi and MQTT up before it is marked good
+#define OTA_TRIAL_MAX_BOOTS (3)           // Boots a new firmware gets to become healthy before rolling back
+#define OTA_TRIAL_DEADLINE (10 * AMINUTE) // Time from boot a new firmware gets to become healthy before rolling back
+#define RTC_BLOCK_OTA (32)                // ESP8266 RTC user memory block for the trial state, the first 128 bytes belong to eboot
+
+#define CONFIG_WRITE_DELAY (5 * ASECOND)       // Quiet time after the last config change before it is written out
+#define CONFIG_JOURNAL_MAX (1024)              // Journal bytes kept before it is compacted into the config record
+#define CONFIG_JOURNAL_KEYS (16)               // and on ESP32, flushes journalled, each under an NVS key of its own
+#define CONFIG_APPLY_DELAY (ASECOND)           // Time after the last config change before it is applied, so the HTTP reply gets out first
+#define CONFIG_APPLY_ATTEMPTS (3)              // MQTT connection attempts with changed settings before going back to the old ones
+#define CONFIG_APPLY_RETRY_DELAY (2 * ASECOND) // Time between those attempts
+
+#define WIFI_FAST_CONNECT_TIMEOUT (5 * ASECOND)    // Time to join the cached access point and get a DHCP lease before falling back to a full scan
+#define WIFI_STORED_CONNECT_TIMEOUT (10 * ASECOND) // Time to join the network WiFiManager saved before opening its portal
+#define WIFI_PORTAL_JOIN_TIMEOUT (20 * ASECOND)    // Time the setup network spends joining the network it was given
+#define WIFI_PORTAL_RETRY_INTERVAL (60 * ASECOND)  // Time between tries at the last known network while the setup network is up
+#define RTC_BLOCK_WIFI (40)                        // ESP8266 RTC user memory block for the cached WiFi connection
+#define WIFI_CANDIDATES (3)                        // Networks we may join: the main one and the two "other networks" in config
+#define WIFI_ROAM_THRESHOLD (-75)                  // RSSI in dBm below which we look for a better access point
+#define WIFI_ROAM_HYSTERESIS (8)                   // dB an access point must beat the current one by before we move to it
+#define WIFI_ROAM_SCAN_INTERVAL (60 * ASECOND)     // Least time between roaming scans
+#define WIFI_LINK_SAMPLE_INTERVAL (30 * ASECOND)   // Time between link quality samples
+#define WIFI_LINK_HISTORY (10)                     // Link quality samples kept for telemetry
+
+#define DEFAULT_SLEEP_INTERVAL (0)       // Seconds of deep sleep between reports, 0 for a node that stays awake
+#ifdef ESP_8266
+#define POWER_SLEEP_MAX (3 * 3600)       // Longest sleep the config accepts, inside ESP.deepSleepMax() which is about 3.5h and drifts with temperature
+#else
+#define POWER_SLEEP_MAX (65535)          // Longest sleep the config accepts, all the field holds
+#endif
+#define POWER_QUEUE_SLOTS (3)            // Telemetry messages kept across deep sleep
+#define POWER_QUEUE_SUBTOPIC (16)        // Longest Sensor subtopic of a kept message, including the terminator
+#define POWER_QUEUE_PAYLOAD (64)         // Longest payload of a kept message, including the terminator, room for a timestamp and two values
+#define POWER_AWAKE_LIMIT (30 * ASECOND) // Time a duty cycling node stays up trying to reach the broker before sleeping anyway
+#define POWER_LISTEN_TIME (ASECOND)      // Time a duty cycling node waits for commands after publishing
+#define RTC_BLOCK_POWER (56)             // ESP8266 RTC user memory block for the duty cycle state, up to the end at 128
+
+#ifndef SCRATCH_TRUNCATE
+#define SCRATCH_TRUNCATE (0) // 1 for scratch strings to truncate rather than move to the heap; topics, log lines and the like still allocate, see HEAP_TRACE
+#endif
+#define SCRATCH_SIZE (6144)  // Bytes of scratch arena for pages and payloads built in one loop(), see scratchHighWater in the status
+
+#ifndef HEAP_TRACE
+#define HEAP_TRACE (0)                            // 1 to count heap allocations after setup() by call site, needs the link time wrapping in platformio.ini
+#endif
+#ifndef HEAP_TRACE_TRAP
+#define HEAP_TRACE_TRAP (0)                       // 1 to abort() on the first allocation after setup(), for its backtrace
+#endif
+#define HEAP_TRACE_SITES (24)                     // Call sites the heap trace keeps counts for
+#define HEAP_TRACE_DEPTH (4)                      // Return addresses that tell one call site from another, innermost first
+#define HEAP_TRACE_SCAN (64)                      // Stack words an ESP8266 looks through for them
+#define HEAP_TRACE_REPORT_INTERVAL (60 * ASECOND) // Time between heap trace reports, when there is something new to say
+
+#define HEAP_SAMPLE_INTERVAL (10 * ASECOND) // Time between heap samples
+#define HEAP_SAMPLE_HISTORY (36)            // Latest heap samples kept
+#define HEAP_TREND_INTERVAL (5 * AMINUTE)   // Time each point of the trend covers, the smallest largest block sampled in it
+#define HEAP_TREND_HISTORY (48)             // Trend points kept, the slope is taken across them once a quarter are filled
+#define HEAP_UPDATE_BLOCK (4096)            // Flash sector buffer Update allocates when a firmware update starts
+#define HEAP_LOW_PERCENT (200)              // Largest free block below this percentage of what we need raises a "low" alert
+#define HEAP_CRITICAL_PERCENT (125)         // and below this one, a "critical" alert and a planned reboot
+#define HEAP_ALERT_HORIZON (24)             // Hours ahead the largest free block trend is projected for a "trending" alert
+#define HEAP_GRACEFUL_REBOOT (true)         // Reboot at a quiet moment when the heap is critical, rather than wait to crash
+#define HEAP_QUIET_TIME (30 * ASECOND)      // Time without web requests or MQTT commands that counts as quiet
+
+#define SENSOR_SLOTS (8)              // Sensor drivers that can be registered
+#define SENSOR_VALUES (4)             // Most values one sensor sample can carry
+#define SENSOR_BATCH_WINDOW (ASECOND) // A sensor due this soon is brought forward to share a bus transaction that is starting now
+#define SENSOR_BATCH_SAMPLES (8)      // Most samples of one sensor carried in one MQTT message
+#define DEFAULT_SENSOR_BATCH (1)      // Samples of a sensor per MQTT message, 1 to publish each as it is read
+#define DEFAULT_SENSOR_BATCH_AGE (60) // Seconds the oldest sample of a batch may wait for the rest
+#ifndef SENSOR_FAKE
+#define SENSOR_FAKE (0)               // 1 to register stand in sensors that need no hardware
+#endif
+
+#define BUTTON_SLOTS (4)        // GPIO buttons and contacts that can be watched
+#define BUTTON_QUEUE_SIZE (32)  // Edges the interrupt can capture ahead of loop(), a power of two
+#define BUTTON_DEBOUNCE (20000) // Time in usec after an accepted edge during which further edges are contact bounce
+#define BUTTON_DEFAULT_PIN (-1) // GPIO of a button watched from boot as p[0].b[1], e.g. 0 for the flash button, -1 for none
+
+#define AGGREGATE_SPECS (8)    // Entries the sensorWindows setting can have
+#define AGGREGATE_METRICS (16) // Sensor values that can be aggregated at once
+
+#define HISTORY_METRICS (4)                   // Sensor values the flash history can keep
+#define HISTORY_BLOCK_SIZE (256)              // Bytes of each block of the history rings, written whole
+#define HISTORY_BLOCKS (32)                   // Blocks in each history ring, raw samples and each rollup have one
+#define HISTORY_ROLLUP_STEP (5 * 60)          // Seconds each entry of the first history rollup covers
+#define HISTORY_ROLLUP2_STEP (60 * 60)        // and of the second
+#define HISTORY_FLUSH_INTERVAL (10 * AMINUTE) // Time between writes of the history blocks still filling, what a restart can lose
+
+#define DEFAULT_NTP_SERVER ("pool.ntp.org") // SNTP server, e.g. the machine running tools/ntp_server.py when testing
+#define TIME_VALID (1577836800)             // Epoch seconds (2020) below which the system clock has not been set
+#define TIME_SYNC_WAIT (3 * ASECOND)        // Time a duty cycling node waits for its first sync after joining WiFi before publishing without it
+#define TIME_DRIFT_INTERVAL (10 * AMINUTE)  // Shortest time between syncs that clock drift is measured over, shorter ones are mostly network jitter
+#define TIME_DRIFT_LIMIT (500)              // ppm, a bigger correction is the server's time changing rather than our crystal
+
+#define RULE_SLOTS (16)  // Rules that can be loaded at once
+#define RULE_INPUTS (16) // Distinct buttons and sensor values those rules can watch
+#define RULE_TERMS (32)  // Terms across all rules
+#define RULE_STEPS (32)  // Actions across all rules
+
 #define DEBUG_MQTT_VERBOSE (true)    // set false to have fewer printf from MQTT
 #define DEBUG_TELNET_ENABLED (false) // Enable telnet debug output
\ No newline at end of file
@@ -0,0 +1,153 @@
+// timeSync.cpp : Epoch time from SNTP for telemetry timestamps, with the drift of our own clock between syncs tracked
+//
+// ----------------------------------------------------------------------------------------------------------------- //
+
+#include "common.h"
+#include <inttypes.h>
+#ifdef ESP_32
+#include <WiFi.h>
+#include <esp_sntp.h>
+#elif defined(ESP_8266)
+#include <ESP8266WiFi.h>
+#include <coredecls.h>
+#endif
+
+static volatile bool timeSyncNotified = false; // SNTP has set the system clock since loop() last looked
+
+#ifdef ESP_32
+static void timeSyncNotify(struct timeval *tv)
+#elif defined(ESP_8266)
+static void timeSyncNotify(void)
+#endif
+{ // called from the SNTP client, in the lwIP task on ESP32, so just note it for loop()
+  timeSyncNotified = true;
+}
+
+void TimeSync::begin()
+{ // called in the main code setup, handles our initialisation
+  _syncEpochMs = 0;
+  _syncMillis = 0;
+  _offsetMs = 0;
+  _driftPpm = 0;
+  _driftKnown = false;
+#ifdef ESP_32
+  sntp_set_time_sync_notification_cb(timeSyncNotify);
+#elif defined(ESP_8266)
+  settimeofday_cb(timeSyncNotify);
+#endif
+  _alive = true;
+  if (time(nullptr) >= TIME_VALID)
+  { // the ESP32 keeps its clock through deep sleep, so a duty cycling node can stamp its samples before WiFi is up
+    _synced();
+  }
+}
+
+void TimeSync::loop()
+{ // called in the main code loop, handles our periodic code
+  if (!_alive)
+  {
+    return;
+  }
+  if (timeSyncNotified)
+  {
+    timeSyncNotified = false;
+    _synced();
+  }
+  if (!_started && (WiFi.status() == WL_CONNECTED))
+  { // the SNTP client needs the network stack up before it can be started
+    _start();
+  }
+}
+
+void TimeSync::applyConfig()
+{ // point SNTP at a changed server, it syncs with it straight away
+  if (!_alive || !_started || (strcmp(_server, config.getNTPServer()) == 0))
+  {
+    return;
+  }
+  if (config.getNTPServer()[0] == '\0')
+  {
+    debug.printLn(F("TIME: NTP server cleared, SNTP stops at the next restart"));
+    return;
+  }
+  _start();
+}
+
+void TimeSync::_start(void)
+{ // hand SNTP its server; it asks in the background and we hear back through timeSyncNotify
+  strncpy(_server, config.getNTPServer(), sizeof(_server));
+  _server[sizeof(_server) - 1] = '\0';
+  _started = true;
+  _startedAt = millis();
+  if (_server[0] == '\0')
+  {
+    debug.printLn(F("TIME: no NTP server, telemetry carries uptime"));
+    return;
+  }
+  configTime(0, 0, _server);
+  debug.printLn(String(F("TIME: syncing with ")) + String(_server));
+}
+
+bool TimeSync::isSyncing(void)
+{ // worth waiting a moment for, rather than publish what we have without the time
+  return _started && !isSynced() && (_server[0] != '\0') && ((millis() - _startedAt) < TIME_SYNC_WAIT);
+}
+
+void TimeSync::_synced(void)
+{ // take the clock SNTP has just set, and see how far ours had wandered since the last time
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  const uint32_t at = millis();
+  if (now.tv_sec < TIME_VALID)
+  {
+    return;
+  }
+  const uint64_t actual = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+  if (isSynced())
+  {
+    const uint32_t elapsed = at - _syncMillis;
+    _offsetMs = (int32_t)((int64_t)actual - (int64_t)epochMs(at));
+    if (elapsed >= TIME_DRIFT_INTERVAL)
+    { // what real time did against millis() over the interval, in parts per million
+      const int32_t drift = (int32_t)(((int64_t)actual - (int64_t)_syncEpochMs - elapsed) * 1000000 / elapsed);
+      if (abs(drift) > TIME_DRIFT_LIMIT)
+      {
+        debug.printLn(String(F("TIME: [WARNING] clock stepped by ")) + String(_offsetMs) + String(F("ms, not counted as drift")));
+      }
+      else
+      { // a slow average, one sync's network delay shouldn't swing it
+        _driftPpm = _driftKnown ? (_driftPpm + (drift - _driftPpm) / 4) : drift;
+        _driftKnown = true;
+      }
+    }
+  }
+  _syncEpochMs = actual;
+  _syncMillis = at;
+  _syncs++;
+  debug.printLn(String(F("TIME: synced to ")) + String((uint32_t)(actual / 1000)) + String(F(", ")) + String(_offsetMs) +
+                String(F("ms out, drift ")) + String(_driftPpm) + String(F("ppm")));
+}
+
+uint64_t TimeSync::epochMs(uint32_t at)
+{ // carried on from the latest sync by millis(), corrected for the drift
+  if (!isSynced())
+  {
+    return 0;
+  }
+  const int32_t elapsed = (int32_t)(at - _syncMillis); // negative for a sample read before the sync
+  return (int64_t)_syncEpochMs + elapsed + ((int64_t)elapsed * _driftPpm) / 1000000;
+}
+
+char *TimeSync::format(uint32_t at, char *text, size_t size)
+{ // seconds with the msec after the point, the way most time series stores take them
+  if (isSynced())
+  {
+    const uint64_t ms = epochMs(at);
+    snprintf_P(text, size, PSTR("%" PRIu32 ".%03" PRIu32 ""), (uint32_t)(ms / 1000), (uint32_t)(ms % 1000));
+  }
+  else
+  {
+    snprintf_P(text, size, PSTR("%" PRIu32 ".%03" PRIu32 ""), at / 1000, at % 1000);
+  }
+  return text;
+}
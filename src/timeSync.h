@@ -0,0 +1,71 @@
+#pragma once
+
+#include "settings.h"
+#include <Arduino.h>
+#include "config.h"
+
+// Wall clock time for telemetry, from SNTP. The lwIP client does the asking in the background; we are told when it
+// has set the clock, and keep our own epoch from that sync and millis(), corrected for how fast our crystal runs.
+class TimeSync
+{
+#pragma region Private
+
+private:
+#pragma endregion Private
+
+#pragma region Public
+
+public:
+    // constructor
+    TimeSync(void)
+    {
+        _alive = false;
+        _started = false;
+        _startedAt = 0;
+        _syncs = 0;
+        _server[0] = '\0';
+    }
+
+    // destructor
+    ~TimeSync(void) { _alive = false; }
+
+    void begin();
+    void loop();
+    void applyConfig();
+
+    bool isSynced(void) { return _syncs != 0; }
+    // asked for a first sync less than TIME_SYNC_WAIT ago and not had it yet
+    bool isSyncing(void);
+    // msec since 1970 at millis() at, which can be before the sync; 0 until synced
+    uint64_t epochMs(uint32_t at);
+    uint32_t epoch(void) { return epochMs(millis()) / 1000; }
+    // at as "1700000000.250" seconds since 1970, or seconds since boot until synced
+    char *format(uint32_t at, char *text, size_t size);
+    // the JSON key format() goes with
+    const char *key(void) { return isSynced() ? "time" : "uptime"; }
+
+    uint32_t getSyncs(void) { return _syncs; }
+    int32_t getOffsetMs(void) { return _offsetMs; }
+    int32_t getDriftPpm(void) { return _driftPpm; }
+
+#pragma endregion Public
+
+#pragma region Protected
+
+protected:
+    bool _alive;
+    bool _started;         // SNTP has been given its server, done once we first have WiFi
+    char _server[sizeof(((ConfigData *)nullptr)->ntpServer)]; // the server it was given
+    uint32_t _startedAt;   // millis() it was
+    uint64_t _syncEpochMs; // epoch at the latest sync
+    uint32_t _syncMillis;  // and millis() then
+    uint32_t _syncs;       // clock sets since boot
+    int32_t _offsetMs;     // how far our clock was out at the latest sync, positive when it was behind
+    int32_t _driftPpm;     // how much faster than millis() real time runs, averaged over syncs
+    bool _driftKnown;      // _driftPpm has been measured at least once
+
+    void _start(void);
+    void _synced(void);
+
+#pragma endregion Protected
+};
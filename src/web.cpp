@@ -6,6 +6,7 @@
 #include <ESP8266WebServer.h>
 #include <ESP8266mDNS.h> // MDNSResponder
 #endif
+#include <ESP_WiFiManager.h> // page templates, and resetSettings() for a factory reset
 
 static const uint32_t telnetInputMax = 128; // Size of user input buffer for user telnet session
 
@@ -35,23 +36,53 @@ extern Web web;
 // and yes, we need a local copy of "self" to handle our callbacks.
 void callback_HandleNotFound()
 {
-  web._handleNotFound();
+  web._serve(ROUTE_NOTFOUND, &Web::_handleNotFound);
 }
 void callback_HandleRoot()
 {
-  web._handleRoot();
+  web._serve(ROUTE_ROOT, &Web::_handleRoot);
 }
 void callback_HandleSaveConfig()
 {
-  web._handleSaveConfig();
+  web._serve(ROUTE_SAVECONFIG, &Web::_handleSaveConfig);
 }
 void callback_HandleResetConfig()
 {
-  web._handleResetConfig();
+  web._serve(ROUTE_RESETCONFIG, &Web::_handleResetConfig);
 }
 void callback_HandleReboot()
 {
-  web._handleReboot();
+  web._serve(ROUTE_REBOOT, &Web::_handleReboot);
+}
+void callback_HandleLogin()
+{
+  web._serve(ROUTE_LOGIN, &Web::_handleLogin);
+}
+void callback_HandleLogout()
+{
+  web._serve(ROUTE_LOGOUT, &Web::_handleLogout);
+}
+void callback_HandleMetrics()
+{
+  web._serve(ROUTE_METRICS, &Web::_handleMetrics);
+}
+void callback_HandleUpdate()
+{
+  web._serve(ROUTE_UPDATE, &Web::_handleUpdate);
+}
+void callback_HandleHistory()
+{
+  web._serve(ROUTE_HISTORY, &Web::_handleHistory);
+}
+void callback_HandleUpdateUpload()
+{
+  web._handleUpdateUpload();
+}
+// Metrics::render() sink, streams each rendered line out as one chunk
+void callback_MetricsEmit(const char *text, size_t length)
+{
+  metrics.bytesSent(length);
+  webServer.sendContent_P(text, length);
 }
 
 #pragma endregion Callbacks
@@ -60,20 +91,43 @@ void Web::begin()
 { // called in the main code setup, handles our initialisation
   _alive = true;
 
-  setUser(DEFAULT_CONFIG_USER);
-  setPassword(DEFAULT_CONFIG_PASS);
-  _tftFileSize = 0;
+  _updateRefused = false;
+  _uploadAdmission = false;
+  memset(_sessions, 0, sizeof(_sessions));
+  memset(_buckets, 0, sizeof(_buckets));
+  _inFlight = 0;
+  metrics.begin();
 
   _setupHTTP();
 
-  if (config.getMDNSEnabled())
+  _mdnsStarted = false;
+  _telnetStarted = false;
+  applyConfig();
+}
+
+void Web::applyConfig()
+{ // start or stop mDNS and telnet to match the config, without a reboot
+  if (config.getMDNSEnabled() && !_mdnsStarted)
   { // Setup mDNS service discovery if enabled
     _setupMDNS();
+    _mdnsStarted = true;
+  }
+  else if (!config.getMDNSEnabled() && _mdnsStarted)
+  {
+    MDNS.end();
+    _mdnsStarted = false;
   }
 
-  if (debug.getTelnetEnabled())
+  if (debug.getTelnetEnabled() && !_telnetStarted)
   { // Setup telnet server for remote debug output
     _setupTelnet();
+    _telnetStarted = true;
+  }
+  else if (!debug.getTelnetEnabled() && _telnetStarted)
+  {
+    telnetClient.stop();
+    telnetServer.stop();
+    _telnetStarted = false;
   }
 }
 
@@ -114,7 +168,17 @@ void Web::_setupHTTP()
   webServer.on("/saveConfig", callback_HandleSaveConfig);
   webServer.on("/resetConfig", callback_HandleResetConfig);
   webServer.on("/reboot", callback_HandleReboot);
+  webServer.on("/login", callback_HandleLogin);
+  webServer.on("/logout", callback_HandleLogout);
+  webServer.on("/metrics", callback_HandleMetrics);
+  webServer.on("/update", HTTP_GET, callback_HandleUpdate);
+  webServer.on("/update", HTTP_POST, callback_HandleUpdate, callback_HandleUpdateUpload);
+  webServer.on("/api/history", callback_HandleHistory);
   webServer.onNotFound(callback_HandleNotFound);
+
+  // the session cookie is the only request header we need beyond Authorization, which is always collected
+  static const char *headerKeys[] = {"Cookie", "Accept"};
+  webServer.collectHeaders(headerKeys, 2);
   webServer.begin();
   debug.printLn(String(F("HTTP: Server started @ http://")) + WiFi.localIP().toString());
 }
@@ -218,36 +282,320 @@ void Web::telnetPrint(bool enabled, String message)
   }
 }
 
+static uint32_t hardwareRandom()
+{ // 32 bits from the on-chip RNG, good enough to seed session tokens
+#ifdef ESP_32
+  return esp_random();
+#elif defined(ESP_8266)
+  return RANDOM_REG32;
+#endif
+}
+
+static bool constantTimeEquals(const char *a, const char *b, size_t length)
+{ // compare two buffers without bailing out at the first mismatch, so timing does not leak the token
+  uint8_t difference = 0;
+  for (size_t i = 0; i < length; i++)
+  {
+    difference |= (uint8_t)a[i] ^ (uint8_t)b[i];
+  }
+  return difference == 0;
+}
+
+void Web::_fieldAttributes(ScratchString &html, const ConfigField &field)
+{ // html input attributes for a config field
+  if (field.flags & FIELD_REQUIRED)
+  {
+    html.add(F(" required"));
+  }
+  if (field.flags & FIELD_SECRET)
+  {
+    html.add(F(" type='password'"));
+  }
+  else if ((field.flags & FIELD_NUMERIC) || (field.type != FIELD_STRING))
+  {
+    html.add(F(" type='number'"));
+  }
+  if (field.type == FIELD_STRING)
+  {
+    html.add(F(" maxlength=")).add(field.size - 1);
+  }
+  else
+  {
+    html.add(F(" min=")).add(field.minimum).add(F(" max=")).add(field.maximum);
+  }
+  if (field.flags & FIELD_LOWERCASE)
+  {
+    html.add(F(" pattern='[a-z0-9_]*'"));
+  }
+}
+
+uint8_t Web::_formFlag(void)
+{ // the setup network shows the short form its fields are marked for, otherwise everything the form can change
+  return esp.isProvisioning() ? FIELD_PORTAL : FIELD_FORM;
+}
+
+void Web::_formField(ScratchString &html, const ConfigField &field)
+{ // one labelled input on the config page
+  html.add((pgm_read_byte(field.group) != '\0') ? F("<br/><br/><b>") : F("<br/><b>")).add(FPSTR(field.label)).add(F("</b>"));
+  char number[8] = {0};
+  const char *value = config.getFieldText(field, number, sizeof(number));
+  if (field.type == FIELD_BOOL)
+  {
+    html.add(F(" <input id='")).add(field.name).add(F("' name='")).add(field.name).add(F("' type='checkbox'"));
+    if (value[0] == '1')
+    {
+      html.add(F(" checked='checked'"));
+    }
+    html.add('>');
+    return;
+  }
+
+  html.add(F(" <i><small>(")).add(Config::getFieldHint(field)).add(F(")</small></i>"));
+  html.add(F("<input id='")).add(field.name).add(F("' name='")).add(field.name).add('\'');
+  _fieldAttributes(html, field);
+  html.add(F(" placeholder='")).add(FPSTR(field.label)).add(F("' value='"));
+  html.add(((field.flags & FIELD_SECRET) && (value[0] != '\0')) ? CONFIG_MASK : value).add('\'').add('>');
+}
+
+void Web::_serve(route_t route, void (Web::*handler)(void))
+{ // run a route handler with its request counted and timed, if admission control lets it through
+  const uint32_t clientIP = (uint32_t)webServer.client().remoteIP();
+  metrics.requestStart(route, clientIP);
+  heapMonitor.activity();
+  uint32_t retryAfter = 0;
+  uint16_t refusal;
+  if ((route == ROUTE_UPDATE) && _uploadAdmission)
+  { // decided before any of the image was written, and not charged twice
+    _uploadAdmission = false;
+    refusal = _uploadRefusal;
+    retryAfter = _uploadRetryAfter;
+  }
+  else
+  {
+    refusal = _admission(clientIP, retryAfter);
+  }
+  if (refusal == 0)
+  {
+    _inFlight++;
+    (this->*handler)();
+    _inFlight--;
+  }
+  else
+  {
+    webServer.sendHeader("Retry-After", String(retryAfter));
+    _send(refusal, "text/plain", "");
+  }
+  metrics.requestEnd();
+}
+
+uint16_t Web::_admission(uint32_t clientIP, uint32_t &retryAfter)
+{ // cheap checks made before authentication or rendering: 503 or 429 with how long to wait when over budget, else 0
+  if (_inFlight >= config.getHTTPMaxInFlight())
+  { // a handler further up the stack is still running (handlers can re-enter web.loop)
+    retryAfter = 1;
+    return 503;
+  }
+
+  const uint32_t rateLimit = config.getHTTPRateLimit();
+  if (rateLimit == 0)
+  {
+    return 0;
+  }
+  const uint32_t burst = config.getHTTPRateBurst() * 1000UL;
+  const uint32_t now = millis();
+
+  // find this client's bucket, or take over the one that has been idle longest
+  WebClientBucket *bucket = nullptr;
+  WebClientBucket *idlest = &_buckets[0];
+  for (uint8_t i = 0; i < HTTP_RATE_CLIENT_SLOTS; i++)
+  {
+    if (_buckets[i].ip == clientIP)
+    {
+      bucket = &_buckets[i];
+      break;
+    }
+    if ((_buckets[i].ip == 0) || ((idlest->ip != 0) && ((int32_t)(_buckets[i].lastRefill - idlest->lastRefill) < 0)))
+    {
+      idlest = &_buckets[i];
+    }
+  }
+  if (bucket == nullptr)
+  { // a new client starts with a full bucket, just as an evicted idle one would have by now
+    bucket = idlest;
+    bucket->ip = clientIP;
+    bucket->milliTokens = burst;
+    bucket->lastRefill = now;
+  }
+
+  // rate tokens per second is rate milliTokens per msec
+  const uint32_t elapsed = now - bucket->lastRefill;
+  bucket->lastRefill = now;
+  if (elapsed >= (burst / rateLimit))
+  {
+    bucket->milliTokens = burst;
+  }
+  else
+  {
+    bucket->milliTokens = min(burst, bucket->milliTokens + (elapsed * rateLimit));
+  }
+
+  if (bucket->milliTokens < 1000)
+  {
+    retryAfter = 1 + ((1000 - bucket->milliTokens) / rateLimit) / 1000;
+    return 429;
+  }
+  bucket->milliTokens -= 1000;
+  return 0;
+}
+
+void Web::_send(int code, const char *contentType, const String &content)
+{ // send a complete response, accounting for it in the route metrics
+  metrics.responseSent(code, content.length());
+  webServer.send(code, contentType, content);
+}
+
+void Web::_send(int code, const char *contentType, const ScratchString &content)
+{ // the same for a page built in the scratch arena, which the server copies out without making a String of it
+  metrics.responseSent(code, content.length());
+  webServer.send_P(code, contentType, content.c_str(), content.length());
+}
+
 bool Web::_authenticated(void)
 { // common code to verify our authentication on most handle callbacks
-  if (_configPassword[0] != '\0')
-  { //Request HTTP auth if configPassword is set
-    if (!webServer.authenticate(_configUser, _configPassword))
+  if (_checkAuth())
+  { // authentication passes or not required
+    return true;
+  }
+
+  if (webServer.hasHeader("Authorization") || (webServer.method() != HTTP_GET) || (webServer.header("Accept").indexOf("text/html") < 0))
+  { // scripts get a plain challenge back, they may only send Basic credentials once asked for them
+    metrics.responseSent(401, 0);
+    webServer.requestAuthentication();
+  }
+  else
+  { // browsers are sent to the login form
+    webServer.sendHeader("Location", "/login");
+    _send(302, "text/plain", "");
+  }
+  return false;
+}
+
+bool Web::_checkAuth(void)
+{ // true when this request may proceed: no password set, a live session cookie, or Basic auth as a fallback
+  if (config.getConfigPassword()[0] == '\0')
+  {
+    return true;
+  }
+  if (_findSession() != nullptr)
+  {
+    return true;
+  }
+  // only pay for the Base64 decode when the client actually sent credentials
+  return webServer.hasHeader("Authorization") && webServer.authenticate(config.getConfigUser(), config.getConfigPassword());
+}
+
+WebSession *Web::_findSession(void)
+{ // look up the session cookie on the current request, refreshing its expiry when found
+  const String cookie = webServer.header("Cookie");
+  const String cookieName = String(WEB_SESSION_COOKIE) + "=";
+  int tokenStart = cookie.indexOf(cookieName);
+  if (tokenStart < 0)
+  {
+    return nullptr;
+  }
+  tokenStart += cookieName.length();
+
+  char token[sizeof(_sessions[0].token)];
+  size_t tokenLength = 0;
+  while ((tokenLength < sizeof(token) - 1) && (tokenStart + tokenLength < cookie.length()) && isxdigit(cookie[tokenStart + tokenLength]))
+  {
+    token[tokenLength] = cookie[tokenStart + tokenLength];
+    tokenLength++;
+  }
+  if (tokenLength != sizeof(token) - 1)
+  {
+    return nullptr;
+  }
+  token[tokenLength] = '\0';
+
+  // walk every slot whatever happens, so the lookup takes the same time for a hit or a miss
+  const uint32_t now = millis();
+  WebSession *found = nullptr;
+  for (uint8_t i = 0; i < WEB_SESSION_SLOTS; i++)
+  {
+    WebSession *session = &_sessions[i];
+    if ((session->token[0] != '\0') && ((int32_t)(session->expires - now) <= 0))
+    { // lapsed, free the slot
+      memset(session, 0, sizeof(WebSession));
+    }
+    if ((session->token[0] != '\0') && constantTimeEquals(session->token, token, tokenLength))
     {
-      webServer.requestAuthentication();
-      return false;
+      found = session;
     }
   }
-  // authentication passes or not required
-  return true;
+  if (found != nullptr)
+  {
+    found->expires = now + WEB_SESSION_TIMEOUT;
+  }
+  return found;
+}
+
+WebSession *Web::_createSession(void)
+{ // issue a fresh token, reusing a free slot or evicting the session closest to expiry
+  const uint32_t now = millis();
+  WebSession *slot = &_sessions[0];
+  for (uint8_t i = 0; i < WEB_SESSION_SLOTS; i++)
+  {
+    if (_sessions[i].token[0] == '\0' || (int32_t)(_sessions[i].expires - now) <= 0)
+    {
+      slot = &_sessions[i];
+      break;
+    }
+    if ((int32_t)(_sessions[i].expires - slot->expires) < 0)
+    {
+      slot = &_sessions[i];
+    }
+  }
+
+  static const char hexDigits[] = "0123456789abcdef";
+  for (uint8_t i = 0; i < sizeof(slot->token) - 1; i += 8)
+  {
+    uint32_t bits = hardwareRandom();
+    for (uint8_t j = 0; j < 8; j++)
+    {
+      slot->token[i + j] = hexDigits[bits & 0x0F];
+      bits >>= 4;
+    }
+  }
+  slot->token[sizeof(slot->token) - 1] = '\0';
+  slot->expires = now + WEB_SESSION_TIMEOUT;
+  return slot;
 }
 
 void Web::_handleNotFound()
 { // webServer 404
+  if (esp.isProvisioning())
+  { // phones check for a captive portal with requests of their own, send them to the config page
+    webServer.sendHeader("Location", String(F("http://")) + WiFi.softAPIP().toString() + "/");
+    _send(302, "text/plain", "");
+    return;
+  }
   debug.printLn(String(F("HTTP: Sending 404 to client connected from: ")) + webServer.client().remoteIP().toString());
-  String httpMessage = "File Not Found\n\n";
-  httpMessage += "URI: ";
-  httpMessage += webServer.uri();
-  httpMessage += "\nMethod: ";
-  httpMessage += (webServer.method() == HTTP_GET) ? "GET" : "POST";
-  httpMessage += "\nArguments: ";
-  httpMessage += webServer.args();
-  httpMessage += "\n";
-  for (uint8_t i = 0; i < webServer.args(); i++)
+  ScratchString httpMessage;
+  httpMessage.add(F("File Not Found\n\n"));
+  httpMessage.add("URI: ");
+  httpMessage.add(webServer.uri());
+  httpMessage.add("\nMethod: ");
+  httpMessage.add((webServer.method() == HTTP_GET) ? "GET" : "POST");
+  httpMessage.add("\nArguments: ");
+  const int args = webServer.args();
+  httpMessage.add(args);
+  httpMessage.add("\n");
+  for (int i = 0; i < args; i++)
   {
-    httpMessage += " " + webServer.argName(i) + ": " + webServer.arg(i) + "\n";
+    httpMessage.add(" ").add(webServer.argName(i)).add(": ").add(webServer.arg(i)).add("\n");
   }
-  webServer.send(404, "text/plain", httpMessage);
+  _send(404, "text/plain", httpMessage);
 }
 
 void Web::_handleRoot()
@@ -258,87 +606,73 @@ void Web::_handleRoot()
   }
 
   debug.printLn(String(F("HTTP: Sending root page to client connected from: ")) + webServer.client().remoteIP().toString());
-  String httpMessage = FPSTR(WM_HTTP_HEAD_START);
-  httpMessage.replace("{v}", String(config.getNodeName()));
-  httpMessage += FPSTR(WM_HTTP_SCRIPT);
-  httpMessage += FPSTR(WM_HTTP_STYLE);
-  httpMessage += String(_style);
-  httpMessage += FPSTR(WM_HTTP_HEAD_END);
-  httpMessage += String(F("<h1>"));
-  httpMessage += String(config.getNodeName());
-  httpMessage += String(F("</h1>"));
-
-  httpMessage += String(F("<form method='POST' action='saveConfig'>"));
-  httpMessage += String(F("<b>WiFi SSID</b> <i><small>(required)</small></i><input id='wifiSSID' required name='wifiSSID' maxlength=32 placeholder='WiFi SSID' value='")) + String(WiFi.SSID()) + "'>";
-  httpMessage += String(F("<br/><b>WiFi Password</b> <i><small>(required)</small></i><input id='wifiPass' required name='wifiPass' type='password' maxlength=64 placeholder='WiFi Password' value='")) + String("********") + "'>";
-  httpMessage += String(F("<br/><br/><b>Node Name</b> <i><small>(required. lowercase letters, numbers, and _ only)</small></i><input id='nodeName' required name='nodeName' maxlength=15 placeholder='Node Name' pattern='[a-z0-9_]*' value='")) + String(config.getNodeName()) + "'>";
-  httpMessage += String(F("<br/><br/><b>Group Name</b> <i><small>(required)</small></i><input id='groupName' required name='groupName' maxlength=15 placeholder='Group Name' value='")) + String(config.getGroupName()) + "'>";
-  httpMessage += String(F("<br/><br/><b>MQTT Broker</b> <i><small>(required)</small></i><input id='mqttServer' required name='mqttServer' maxlength=63 placeholder='mqttServer' value='")) + String(config.getMQTTServer()) + "'>";
-  httpMessage += String(F("<br/><b>MQTT Port</b> <i><small>(required)</small></i><input id='mqttPort' required name='mqttPort' type='number' maxlength=5 placeholder='mqttPort' value='")) + String(config.getMQTTPort()) + "'>";
-  httpMessage += String(F("<br/><b>MQTT User</b> <i><small>(optional)</small></i><input id='mqttUser' name='mqttUser' maxlength=31 placeholder='mqttUser' value='")) + String(config.getMQTTUser()) + "'>";
-  httpMessage += String(F("<br/><b>MQTT Password</b> <i><small>(optional)</small></i><input id='mqttPassword' name='mqttPassword' type='password' maxlength=31 placeholder='mqttPassword' value='"));
-  if (strlen(config.getMQTTPassword()) != 0)
-  {
-    httpMessage += String("********");
-  }
-  httpMessage += String(F("'><br/><br/><b>Admin Username</b> <i><small>(optional)</small></i><input id='configUser' name='configUser' maxlength=31 placeholder='Admin User' value='")) + String(_configUser) + "'>";
-  httpMessage += String(F("<br/><b>Admin Password</b> <i><small>(optional)</small></i><input id='configPassword' name='configPassword' type='password' maxlength=31 placeholder='Admin User Password' value='"));
-  if (strlen(_configPassword) != 0)
-  {
-    httpMessage += String("********");
-  }
-
-  httpMessage += String(F("><br/><b>Telnet debug output enabled:</b><input id='debugTelnetEnabled' name='debugTelnetEnabled' type='checkbox'"));
-  if (debug.getTelnetEnabled())
-  {
-    httpMessage += String(F(" checked='checked'"));
-  }
-  httpMessage += String(F("><br/><b>mDNS enabled:</b><input id='mdnsEnabled' name='mdnsEnabled' type='checkbox'"));
-  if (config.getMDNSEnabled())
+  ScratchString httpMessage;
+  httpMessage.addTemplate(WM_HTTP_HEAD_START, config.getNodeName());
+  httpMessage.add(FPSTR(WM_HTTP_SCRIPT));
+  httpMessage.add(FPSTR(WM_HTTP_STYLE));
+  httpMessage.add(_style);
+  httpMessage.add(FPSTR(WM_HTTP_HEAD_END));
+  httpMessage.add(F("<h1>"));
+  httpMessage.add(config.getNodeName());
+  httpMessage.add(F("</h1>"));
+
+  httpMessage.add(F("<form method='POST' action='saveConfig'>"));
+  for (const ConfigField &field : configFields)
   {
-    httpMessage += String(F(" checked='checked'"));
+    if (field.flags & _formFlag())
+    {
+      _formField(httpMessage, field);
+    }
   }
+  httpMessage.add(F("<br/><hr><button type='submit'>save settings</button></form>"));
 
-  httpMessage += String(F("><br/><hr><button type='submit'>save settings</button></form>"));
+  httpMessage.add(F("<hr><form method='get' action='reboot'>"));
+  httpMessage.add(F("<button type='submit'>reboot device</button></form>"));
 
-  httpMessage += String(F("<hr><form method='get' action='reboot'>"));
-  httpMessage += String(F("<button type='submit'>reboot device</button></form>"));
+  httpMessage.add(F("<hr><form method='get' action='resetConfig'>"));
+  httpMessage.add(F("<button type='submit'>factory reset settings</button></form>"));
 
-  httpMessage += String(F("<hr><form method='get' action='resetConfig'>"));
-  httpMessage += String(F("<button type='submit'>factory reset settings</button></form>"));
+  httpMessage.add(F("<hr><form method='get' action='update'>"));
+  httpMessage.add(F("<button type='submit'>update firmware</button></form>"));
 
-  httpMessage += String(F("<hr><b>MQTT Status: </b>"));
+  if (config.getConfigPassword()[0] != '\0')
+  {
+    httpMessage.add(F("<hr><form method='get' action='logout'>"));
+    httpMessage.add(F("<button type='submit'>log out</button></form>"));
+  }
+
+  httpMessage.add(F("<hr><b>MQTT Status: </b>"));
   if (mqtt.clientIsConnected())
   { // Check MQTT connection
-    httpMessage += String(F("Connected"));
+    httpMessage.add(F("Connected"));
   }
   else
   {
-    httpMessage += String(F("<font color='red'><b>Disconnected</b></font>, return code: ")) + mqtt.clientReturnCode();
+    httpMessage.add(F("<font color='red'><b>Disconnected</b></font>, return code: ")).add(mqtt.clientReturnCode());
   }
-  httpMessage += String(F("<br/><b>MQTT ClientID: </b>")) + mqtt.getClientID();
-  httpMessage += String(F("<br/><b>Version: </b>")) + String(config.getVersion());
-  httpMessage += String(F("<br/><b>CPU Frequency: </b>")) + String(ESP.getCpuFreqMHz()) + String(F("MHz"));
-  httpMessage += String(F("<br/><b>Sketch Size: </b>")) + String(ESP.getSketchSize()) + String(F(" bytes"));
-  httpMessage += String(F("<br/><b>Free Sketch Space: </b>")) + String(ESP.getFreeSketchSpace()) + String(F(" bytes"));
-  httpMessage += String(F("<br/><b>Heap Free: </b>")) + String(ESP.getFreeHeap());
+  httpMessage.add(F("<br/><b>MQTT ClientID: </b>")).add(mqtt.getClientID());
+  httpMessage.add(F("<br/><b>Version: </b>")).add(String(config.getVersion()));
+  httpMessage.add(F("<br/><b>CPU Frequency: </b>")).add(ESP.getCpuFreqMHz()).add(F("MHz"));
+  httpMessage.add(F("<br/><b>Sketch Size: </b>")).add(ESP.getSketchSize()).add(F(" bytes"));
+  httpMessage.add(F("<br/><b>Free Sketch Space: </b>")).add(ESP.getFreeSketchSpace()).add(F(" bytes"));
+  httpMessage.add(F("<br/><b>Heap Free: </b>")).add(ESP.getFreeHeap());
 #ifdef ESP_32
-  httpMessage += String(F("<br/><b>ESP sdk version: </b>")) + String(ESP.getSdkVersion());
+  httpMessage.add(F("<br/><b>ESP sdk version: </b>")).add(ESP.getSdkVersion());
 #elif defined(ESP_8266)
-  httpMessage += String(F("<br/><b>Heap Fragmentation: </b>")) + String(ESP.getHeapFragmentation());
-  httpMessage += String(F("<br/><b>ESP core version: </b>")) + String(ESP.getCoreVersion());
+  httpMessage.add(F("<br/><b>Heap Fragmentation: </b>")).add(ESP.getHeapFragmentation());
+  httpMessage.add(F("<br/><b>ESP core version: </b>")).add(ESP.getCoreVersion());
 #endif
-  httpMessage += String(F("<br/><b>IP Address: </b>")) + String(WiFi.localIP().toString());
-  httpMessage += String(F("<br/><b>Signal Strength: </b>")) + String(WiFi.RSSI());
-  httpMessage += String(F("<br/><b>Uptime: </b>")) + String(int32_t(millis() / 1000));
+  httpMessage.add(F("<br/><b>IP Address: </b>")).add(WiFi.localIP().toString());
+  httpMessage.add(F("<br/><b>Signal Strength: </b>")).add(WiFi.RSSI());
+  httpMessage.add(F("<br/><b>Uptime: </b>")).add(int32_t(millis() / 1000));
 #ifdef ESP_32
-  httpMessage += String(F("<br/><b>Last reset: </b>")) + String((int)rtc_get_reset_reason(0));
+  httpMessage.add(F("<br/><b>Last reset: </b>")).add((int)rtc_get_reset_reason(0));
 #elif defined(ESP_8266)
-  httpMessage += String(F("<br/><b>Last reset: </b>")) + String(ESP.getResetInfo());
+  httpMessage.add(F("<br/><b>Last reset: </b>")).add(ESP.getResetInfo());
 #endif
 
-  httpMessage += FPSTR(WM_HTTP_END);
-  webServer.send(200, "text/html", httpMessage);
+  httpMessage.add(FPSTR(WM_HTTP_END));
+  _send(200, "text/html", httpMessage);
 }
 
 void Web::_handleSaveConfig()
@@ -349,114 +683,87 @@ void Web::_handleSaveConfig()
   }
 
   debug.printLn(String(F("HTTP: Sending /saveConfig page to client connected from: ")) + webServer.client().remoteIP().toString());
-  String httpMessage = "";
-  httpMessage = FPSTR(WM_HTTP_HEAD_START);
-  httpMessage.replace("{v}", String(config.getNodeName()));
-  httpMessage += FPSTR(WM_HTTP_SCRIPT);
-  httpMessage += FPSTR(WM_HTTP_STYLE);
-  httpMessage += String(_style);
+  ScratchString httpMessage;
+  httpMessage.addTemplate(WM_HTTP_HEAD_START, config.getNodeName());
+  httpMessage.add(FPSTR(WM_HTTP_SCRIPT));
+  httpMessage.add(FPSTR(WM_HTTP_STYLE));
+  httpMessage.add(_style);
 
   bool shouldSaveWifi = false;
-  // Check required values
-  if (webServer.arg("wifiSSID") != "" && webServer.arg("wifiSSID") != String(WiFi.SSID()))
-  { // Handle WiFi update
-    config.setSaveNeeded();
-    shouldSaveWifi = true;
-    webServer.arg("wifiSSID").toCharArray(config.getWIFISSID(), 32);
-    if (webServer.arg("wifiPass") != String("********"))
+  for (const ConfigField &field : configFields)
+  { // Handle everything on the form, a masked secret coming back means it wasn't touched
+    if (!(field.flags & _formFlag()))
     {
-      webServer.arg("wifiPass").toCharArray(config.getWIFIPass(), 64);
+      continue;
     }
+    const String &value = webServer.arg(field.name);
+    if ((field.flags & FIELD_SECRET) && (value == CONFIG_MASK))
+    {
+      continue;
+    }
+    if (config.changeField(field, value) &&
+        ((&field == &configFields[CONFIG_FIELD_wifiSSID]) || (&field == &configFields[CONFIG_FIELD_wifiPass])))
+    { // a new network, which means starting over
+      shouldSaveWifi = true;
+    }
+  }
+
+  if (shouldSaveWifi && esp.isProvisioning())
+  { // Nothing is running on the old settings yet, so join the new network without a restart
+    httpMessage.add(FPSTR(WM_HTTP_HEAD_END));
+    httpMessage.add(F("<h1>")).add(config.getNodeName()).add(F("</h1>"));
+    httpMessage.add(F("<br/>Joining ")).add(config.getWIFISSID()).add(F(". Once connected this setup network closes and the device carries on from there. "));
+    httpMessage.add(F("If it can't connect, the setup network stays up so the settings can be corrected"));
+    httpMessage.add(FPSTR(WM_HTTP_END));
+    _send(200, "text/html", httpMessage);
+
+    config.saveFile();
+    esp.joinNetwork();
   }
-  if (webServer.arg("mqttServer") != "" && webServer.arg("mqttServer") != String(config.getMQTTServer()))
-  { // Handle mqttServer
-    config.setSaveNeeded();
-    webServer.arg("mqttServer").toCharArray(config.getMQTTServer(), 64);
-  }
-  if (webServer.arg("mqttPort") != "" && webServer.arg("mqttPort") != String(config.getMQTTPort()))
-  { // Handle mqttPort
-    config.setSaveNeeded();
-    webServer.arg("mqttPort").toCharArray(config.getMQTTPort(), 6);
-  }
-  if (webServer.arg("nodeName") != "" && webServer.arg("nodeName") != String(config.getNodeName()))
-  { // Handle nodeName
-    config.setSaveNeeded();
-    String lowerNodeName = webServer.arg("nodeName");
-    lowerNodeName.toLowerCase();
-    lowerNodeName.toCharArray(config.getNodeName(), 16);
-  }
-  if (webServer.arg("groupName") != "" && webServer.arg("groupName") != String(config.getGroupName()))
-  { // Handle groupName
-    config.setSaveNeeded();
-    webServer.arg("groupName").toCharArray(config.getGroupName(), 16);
-  }
-  // Check optional values
-  if (webServer.arg("mqttUser") != String(config.getMQTTUser()))
-  { // Handle mqttUser
-    config.setSaveNeeded();
-    webServer.arg("mqttUser").toCharArray(config.getMQTTUser(), 32);
-  }
-  if (webServer.arg("mqttPassword") != String("********"))
-  { // Handle mqttPassword
-    config.setSaveNeeded();
-    webServer.arg("mqttPassword").toCharArray(config.getMQTTPassword(), 32);
-  }
-  if (webServer.arg("configUser") != String(_configUser))
-  { // Handle configUser
-    config.setSaveNeeded();
-    webServer.arg("configUser").toCharArray(_configUser, 32);
-  }
-  if (webServer.arg("configPassword") != String("********"))
-  { // Handle configPassword
-    config.setSaveNeeded();
-    webServer.arg("configPassword").toCharArray(_configPassword, 32);
-  }
-  if ((webServer.arg("debugTelnetEnabled") == String("on")) && !debug.getTelnetEnabled())
-  { // debugTelnetEnabled was disabled but should now be enabled
-    config.setSaveNeeded();
-    debug.enableTelnet(true);
-  }
-  else if ((webServer.arg("debugTelnetEnabled") == String("")) && debug.getTelnetEnabled())
-  { // debugTelnetEnabled was enabled but should now be disabled
-    config.setSaveNeeded();
-    debug.enableTelnet(false);
-  }
-  if ((webServer.arg("mdnsEnabled") == String("on")) && !config.getMDNSEnabled())
-  { // mdnsEnabled was disabled but should now be enabled
-    config.setSaveNeeded();
-    config.setMDSNEnabled(true);
-  }
-  else if ((webServer.arg("mdnsEnabled") == String("")) && config.getMDNSEnabled())
-  { // mdnsEnabled was enabled but should now be disabled
-    config.setSaveNeeded();
-    config.setMDSNEnabled(false);
-  }
-
-  if (config.getSaveNeeded())
-  { // Config updated, notify user and trigger write to SPIFFS
-    httpMessage += String(F("<meta http-equiv='refresh' content='15;url=/' />"));
-    httpMessage += FPSTR(WM_HTTP_HEAD_END);
-    httpMessage += String(F("<h1>")) + String(config.getNodeName()) + String(F("</h1>"));
-    httpMessage += String(F("<br/>Saving updated configuration values and restarting device"));
-    httpMessage += FPSTR(WM_HTTP_END);
-    webServer.send(200, "text/html", httpMessage);
+  else if (shouldSaveWifi)
+  { // Config updated, notify user and trigger write to storage
+    httpMessage.add(F("<meta http-equiv='refresh' content='15;url=/' />"));
+    httpMessage.add(FPSTR(WM_HTTP_HEAD_END));
+    httpMessage.add(F("<h1>")).add(config.getNodeName()).add(F("</h1>"));
+    httpMessage.add(F("<br/>Saving updated configuration values and restarting device"));
+    httpMessage.add(FPSTR(WM_HTTP_END));
+    _send(200, "text/html", httpMessage);
 
     config.saveFile();
-    if (shouldSaveWifi)
+    debug.printLn(String(F("CONFIG: Attempting connection to SSID: ")) + String(config.getWIFISSID()));
+    esp.wiFiSetup();
+    esp.reset();
+  }
+  else if (config.getPendingApply() != APPLY_NONE)
+  { // Config updated, config.loop() applies it once this reply is on its way
+    const configApply_t pending = config.getPendingApply();
+    httpMessage.add(F("<meta http-equiv='refresh' content='")).add(pending == APPLY_REBOOT ? 15 : (pending == APPLY_RECONNECT ? 10 : 3)).add(F(";url=/' />"));
+    httpMessage.add(FPSTR(WM_HTTP_HEAD_END));
+    httpMessage.add(F("<h1>")).add(config.getNodeName()).add(F("</h1>"));
+    if (pending == APPLY_REBOOT)
     {
-      debug.printLn(String(F("CONFIG: Attempting connection to SSID: ")) + webServer.arg("wifiSSID"));
-      esp.wiFiSetup();
+      httpMessage.add(F("<br/>Saving updated configuration values and restarting device"));
     }
-    esp.reset();
+    else if (pending == APPLY_RECONNECT)
+    {
+      httpMessage.add(F("<br/>Saving updated configuration values and reconnecting to the MQTT broker. "));
+      httpMessage.add(F("If the broker can't be reached with them, the previous MQTT settings are restored"));
+    }
+    else
+    {
+      httpMessage.add(F("<br/>Updated configuration values applied, returning to <a href='/'>home page</a>"));
+    }
+    httpMessage.add(FPSTR(WM_HTTP_END));
+    _send(200, "text/html", httpMessage);
   }
   else
   { // No change found, notify user and link back to config page
-    httpMessage += String(F("<meta http-equiv='refresh' content='3;url=/' />"));
-    httpMessage += FPSTR(WM_HTTP_HEAD_END);
-    httpMessage += String(F("<h1>")) + String(config.getNodeName()) + String(F("</h1>"));
-    httpMessage += String(F("<br/>No changes found, returning to <a href='/'>home page</a>"));
-    httpMessage += FPSTR(WM_HTTP_END);
-    webServer.send(200, "text/html", httpMessage);
+    httpMessage.add(F("<meta http-equiv='refresh' content='3;url=/' />"));
+    httpMessage.add(FPSTR(WM_HTTP_HEAD_END));
+    httpMessage.add(F("<h1>")).add(config.getNodeName()).add(F("</h1>"));
+    httpMessage.add(F("<br/>No changes found, returning to <a href='/'>home page</a>"));
+    httpMessage.add(FPSTR(WM_HTTP_END));
+    _send(200, "text/html", httpMessage);
   }
 }
 
@@ -468,33 +775,32 @@ void Web::_handleResetConfig()
   }
 
   debug.printLn(String(F("HTTP: Sending /resetConfig page to client connected from: ")) + webServer.client().remoteIP().toString());
-  String httpMessage = "";
-  httpMessage = FPSTR(WM_HTTP_HEAD_START);
-  httpMessage.replace("{v}", String(config.getNodeName()));
-  httpMessage += FPSTR(WM_HTTP_SCRIPT);
-  httpMessage += FPSTR(WM_HTTP_STYLE);
-  httpMessage += String(_style);
-  httpMessage += FPSTR(WM_HTTP_HEAD_END);
+  ScratchString httpMessage;
+  httpMessage.addTemplate(WM_HTTP_HEAD_START, config.getNodeName());
+  httpMessage.add(FPSTR(WM_HTTP_SCRIPT));
+  httpMessage.add(FPSTR(WM_HTTP_STYLE));
+  httpMessage.add(_style);
+  httpMessage.add(FPSTR(WM_HTTP_HEAD_END));
 
   if (webServer.arg("confirm") == "yes")
   { // User has confirmed, so reset everything
-    httpMessage += String(F("<h1>"));
-    httpMessage += String(config.getNodeName());
-    httpMessage += String(F("</h1><b>Resetting all saved settings and restarting device into WiFi AP mode</b>"));
-    httpMessage += FPSTR(WM_HTTP_END);
-    webServer.send(200, "text/html", httpMessage);
+    httpMessage.add(F("<h1>"));
+    httpMessage.add(config.getNodeName());
+    httpMessage.add(F("</h1><b>Resetting all saved settings and restarting device into WiFi AP mode</b>"));
+    httpMessage.add(FPSTR(WM_HTTP_END));
+    _send(200, "text/html", httpMessage);
     delay(1000);
     config.clearFileSystem();
   }
   else
   {
-    httpMessage += String(F("<h1>Warning</h1><b>This process will reset all settings to the default values and restart the device.  You may need to connect to the WiFi AP displayed on the panel to re-configure the device before accessing it again."));
-    httpMessage += String(F("<br/><hr><br/><form method='get' action='resetConfig'>"));
-    httpMessage += String(F("<br/><br/><button type='submit' name='confirm' value='yes'>reset all settings</button></form>"));
-    httpMessage += String(F("<br/><hr><br/><form method='get' action='/'>"));
-    httpMessage += String(F("<button type='submit'>return home</button></form>"));
-    httpMessage += FPSTR(WM_HTTP_END);
-    webServer.send(200, "text/html", httpMessage);
+    httpMessage.add(F("<h1>Warning</h1><b>This process will reset all settings to the default values and restart the device.  You may need to connect to the WiFi AP displayed on the panel to re-configure the device before accessing it again."));
+    httpMessage.add(F("<br/><hr><br/><form method='get' action='resetConfig'>"));
+    httpMessage.add(F("<br/><br/><button type='submit' name='confirm' value='yes'>reset all settings</button></form>"));
+    httpMessage.add(F("<br/><hr><br/><form method='get' action='/'>"));
+    httpMessage.add(F("<button type='submit'>return home</button></form>"));
+    httpMessage.add(FPSTR(WM_HTTP_END));
+    _send(200, "text/html", httpMessage);
   }
 }
 
@@ -506,18 +812,222 @@ void Web::_handleReboot()
   }
 
   debug.printLn(String(F("HTTP: Sending /reboot page to client connected from: ")) + webServer.client().remoteIP().toString());
-  String httpMessage = "";
-  httpMessage = FPSTR(WM_HTTP_HEAD_START);
-  httpMessage.replace("{v}", (String(config.getNodeName()) + " ESP reboot"));
-  httpMessage += FPSTR(WM_HTTP_SCRIPT);
-  httpMessage += FPSTR(WM_HTTP_STYLE);
-  httpMessage += String(_style);
-  httpMessage += String(F("<meta http-equiv='refresh' content='10;url=/' />"));
-  httpMessage += FPSTR(WM_HTTP_HEAD_END);
-  httpMessage += String(F("<h1>")) + String(config.getNodeName()) + String(F("</h1>"));
-  httpMessage += String(F("<br/>Rebooting device"));
-  httpMessage += FPSTR(WM_HTTP_END);
-  webServer.send(200, "text/html", httpMessage);
+  ScratchString httpMessage;
+  httpMessage.addTemplate(WM_HTTP_HEAD_START, (String(config.getNodeName()) + F(" ESP reboot")).c_str());
+  httpMessage.add(FPSTR(WM_HTTP_SCRIPT));
+  httpMessage.add(FPSTR(WM_HTTP_STYLE));
+  httpMessage.add(_style);
+  httpMessage.add(F("<meta http-equiv='refresh' content='10;url=/' />"));
+  httpMessage.add(FPSTR(WM_HTTP_HEAD_END));
+  httpMessage.add(F("<h1>")).add(config.getNodeName()).add(F("</h1>"));
+  httpMessage.add(F("<br/>Rebooting device"));
+  httpMessage.add(FPSTR(WM_HTTP_END));
+  _send(200, "text/html", httpMessage);
   debug.printLn(F("RESET: Rebooting device"));
   esp.reset();
 }
+
+void Web::_handleLogin()
+{ // http://ESP01/login
+  if (config.getConfigPassword()[0] == '\0')
+  { // nothing to log in to
+    webServer.sendHeader("Location", "/");
+    _send(302, "text/plain", "");
+    return;
+  }
+
+  bool loginFailed = false;
+  if (webServer.method() == HTTP_POST)
+  {
+    const String &user = webServer.arg("user");
+    const String &password = webServer.arg("password");
+    // pad both sides to the full buffer so the comparison time does not depend on the input
+    char userBuffer[32] = {0};
+    char passwordBuffer[32] = {0};
+    user.toCharArray(userBuffer, sizeof(userBuffer));
+    password.toCharArray(passwordBuffer, sizeof(passwordBuffer));
+    char configUserBuffer[32] = {0};
+    char configPasswordBuffer[32] = {0};
+    strncpy(configUserBuffer, config.getConfigUser(), sizeof(configUserBuffer) - 1);
+    strncpy(configPasswordBuffer, config.getConfigPassword(), sizeof(configPasswordBuffer) - 1);
+    const bool userMatches = constantTimeEquals(userBuffer, configUserBuffer, sizeof(userBuffer));
+    const bool passwordMatches = constantTimeEquals(passwordBuffer, configPasswordBuffer, sizeof(passwordBuffer));
+
+    if (userMatches && passwordMatches)
+    {
+      WebSession *session = _createSession();
+      debug.printLn(String(F("HTTP: Login session started for client connected from: ")) + webServer.client().remoteIP().toString());
+      webServer.sendHeader("Set-Cookie", String(WEB_SESSION_COOKIE) + "=" + session->token + String(F("; Path=/; HttpOnly; SameSite=Strict; Max-Age=")) + String(WEB_SESSION_TIMEOUT / ASECOND));
+      webServer.sendHeader("Location", "/");
+      _send(302, "text/plain", "");
+      return;
+    }
+    debug.printLn(String(F("HTTP: Failed login from client connected from: ")) + webServer.client().remoteIP().toString());
+    loginFailed = true;
+  }
+
+  ScratchString httpMessage;
+  httpMessage.addTemplate(WM_HTTP_HEAD_START, config.getNodeName());
+  httpMessage.add(FPSTR(WM_HTTP_SCRIPT));
+  httpMessage.add(FPSTR(WM_HTTP_STYLE));
+  httpMessage.add(_style);
+  httpMessage.add(FPSTR(WM_HTTP_HEAD_END));
+  httpMessage.add(F("<h1>")).add(config.getNodeName()).add(F("</h1>"));
+  if (loginFailed)
+  {
+    httpMessage.add(F("<font color='red'><b>Login failed</b></font><br/>"));
+  }
+  httpMessage.add(F("<form method='POST' action='login'>"));
+  httpMessage.add(F("<b>Admin Username</b><input id='user' name='user' maxlength=31 placeholder='Admin User'>"));
+  httpMessage.add(F("<br/><b>Admin Password</b><input id='password' name='password' type='password' maxlength=31 placeholder='Admin User Password' autofocus>"));
+  httpMessage.add(F("<br/><hr><button type='submit'>log in</button></form>"));
+  httpMessage.add(FPSTR(WM_HTTP_END));
+  _send(loginFailed ? 401 : 200, "text/html", httpMessage);
+}
+
+void Web::_handleLogout()
+{ // http://ESP01/logout
+  WebSession *session = _findSession();
+  if (session != nullptr)
+  {
+    memset(session, 0, sizeof(WebSession));
+  }
+  webServer.sendHeader("Set-Cookie", String(WEB_SESSION_COOKIE) + String(F("=; Path=/; HttpOnly; SameSite=Strict; Max-Age=0")));
+  webServer.sendHeader("Location", "/login");
+  _send(302, "text/plain", "");
+}
+
+void Web::_handleMetrics()
+{ // http://ESP01/metrics
+  if (!_authenticated())
+  {
+    return;
+  }
+
+  // stream the exposition out line by line in chunked encoding, so nothing is assembled on the heap
+  metrics.responseSent(200, 0);
+  webServer.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  webServer.send(200, "text/plain; version=0.0.4", "");
+  metrics.render(callback_MetricsEmit);
+  webServer.sendContent_P("", 0);
+}
+
+void Web::_handleHistory()
+{ // http://ESP01/api/history?metric=fake1.temperature&from=&to=&step=
+  if (!_authenticated())
+  {
+    return;
+  }
+  const int8_t metric = history.findMetric(webServer.arg("metric").c_str());
+  if (metric < 0)
+  {
+    _send(404, "text/plain", String(F("No history is kept for that metric")));
+    return;
+  }
+  const uint32_t from = strtoul(webServer.arg("from").c_str(), nullptr, 10);
+  const String toArg = webServer.arg("to"); // missing or blank is up to now
+  const uint32_t to = (toArg.length() != 0) ? strtoul(toArg.c_str(), nullptr, 10) : UINT32_MAX;
+  const uint32_t step = strtoul(webServer.arg("step").c_str(), nullptr, 10);
+
+  // points go out as each block is decoded, so neither the store nor the reply is ever held in RAM
+  metrics.responseSent(200, 0);
+  webServer.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  webServer.send(200, "application/json", "");
+  history.query(metric, from, to, step, callback_MetricsEmit);
+  webServer.sendContent_P("", 0);
+}
+
+void Web::_handleUpdateUpload()
+{ // called by the server for each chunk of a POST to /update, before _handleUpdate() runs
+  HTTPUpload &upload = webServer.upload();
+  if (upload.status == UPLOAD_FILE_ABORTED)
+  { // no handler follows an aborted upload, so nothing will answer with the admission decided for it
+    _uploadAdmission = false;
+  }
+  if (upload.status == UPLOAD_FILE_START)
+  { // expected hashes come in the query string, which the server has parsed before the body
+    // admission is settled here, before anything reaches flash; _serve() answers with it once the body is in
+    _uploadAdmission = true;
+    _uploadRefusal = _admission((uint32_t)webServer.client().remoteIP(), _uploadRetryAfter);
+    _updateRefused = (_uploadRefusal != 0) || !_checkAuth();
+    if (_updateRefused)
+    {
+      return;
+    }
+    debug.printLn(String(F("HTTP: Receiving firmware ")) + upload.filename + String(F(" from client connected from: ")) + webServer.client().remoteIP().toString());
+    _updateRefused = !ota.start("http", webServer.arg("size").toInt(), webServer.arg("md5").c_str(), webServer.arg("sha256").c_str());
+  }
+  else if (_updateRefused)
+  { // drain the rest of the upload without touching flash
+  }
+  else if (upload.status == UPLOAD_FILE_WRITE)
+  {
+    ota.write(upload.buf, upload.currentSize);
+  }
+  else if (upload.status == UPLOAD_FILE_END)
+  {
+    ota.finish();
+  }
+  else if (upload.status == UPLOAD_FILE_ABORTED)
+  {
+    ota.abort("upload aborted");
+  }
+}
+
+void Web::_handleUpdate()
+{ // http://ESP01/update
+  if (!_authenticated())
+  {
+    return;
+  }
+
+  ScratchString httpMessage;
+  httpMessage.addTemplate(WM_HTTP_HEAD_START, config.getNodeName());
+  httpMessage.add(FPSTR(WM_HTTP_SCRIPT));
+  httpMessage.add(FPSTR(WM_HTTP_STYLE));
+  httpMessage.add(_style);
+
+  if (webServer.method() == HTTP_GET)
+  { // the hashes are optional, the script moves them into the query string so they are known before the image arrives
+    debug.printLn(String(F("HTTP: Sending /update page to client connected from: ")) + webServer.client().remoteIP().toString());
+    httpMessage.add(FPSTR(WM_HTTP_HEAD_END));
+    httpMessage.add(F("<h1>")).add(config.getNodeName()).add(F("</h1>"));
+    httpMessage.add(F("<form method='POST' action='update' enctype='multipart/form-data' onsubmit=\"this.action='update?md5='+encodeURIComponent(md5.value)+'&sha256='+encodeURIComponent(sha256.value)\">"));
+    httpMessage.add(F("<b>Firmware image</b><input type='file' name='firmware' accept='.bin' required>"));
+    httpMessage.add(F("<br/><b>MD5</b> <i><small>(optional)</small></i><input id='md5' maxlength=32 placeholder='md5'>"));
+    httpMessage.add(F("<br/><b>SHA-256</b> <i><small>(optional)</small></i><input id='sha256' maxlength=64 placeholder='sha256'>"));
+    httpMessage.add(F("<br/><hr><button type='submit'>upload and update</button></form>"));
+    httpMessage.add(F("<hr><form method='get' action='/'><button type='submit'>return home</button></form>"));
+    httpMessage.add(FPSTR(WM_HTTP_END));
+    _send(200, "text/html", httpMessage);
+    return;
+  }
+
+  const bool updated = !_updateRefused && !ota.isRunning() && (ota.getError()[0] == '\0') && (ota.getWritten() != 0);
+  if (ota.isRunning())
+  { // the client went away before the end of the image
+    ota.abort("upload incomplete");
+  }
+  _updateRefused = false;
+
+  if (updated)
+  {
+    httpMessage.add(F("<meta http-equiv='refresh' content='15;url=/' />"));
+    httpMessage.add(FPSTR(WM_HTTP_HEAD_END));
+    httpMessage.add(F("<h1>")).add(config.getNodeName()).add(F("</h1>"));
+    httpMessage.add(F("<br/>Firmware verified and written, restarting device"));
+    httpMessage.add(FPSTR(WM_HTTP_END));
+    _send(200, "text/html", httpMessage);
+    debug.printLn(F("RESET: Rebooting device into new firmware"));
+    esp.reset();
+  }
+  else
+  {
+    httpMessage.add(FPSTR(WM_HTTP_HEAD_END));
+    httpMessage.add(F("<h1>")).add(config.getNodeName()).add(F("</h1>"));
+    httpMessage.add(F("<br/><font color='red'><b>Update failed: </b></font>")).add(ota.getError());
+    httpMessage.add(F("<br/>The running firmware has not been changed, return to <a href='/update'>update</a>"));
+    httpMessage.add(FPSTR(WM_HTTP_END));
+    _send(400, "text/html", httpMessage);
+  }
+}
@@ -1,11 +1,28 @@
 #pragma once
 
+#include "config.h"
+#include "metrics.h"
 #include "settings.h"
 #include <Arduino.h>
 
 // Additional CSS style
 static const char _style[] = "<style>button{background-color:#03A9F4;}body{width:60%;margin:auto;}input:invalid{border:1px solid red;}input[type=checkbox]{width:20px;}</style>";
 
+// A browser login, identified by the random token handed out in the session cookie
+struct WebSession
+{
+    char token[33];   // 32 hex characters, empty when the slot is free
+    uint32_t expires; // millis() at which the session lapses unless used again
+};
+
+// Token bucket limiting how fast one remote address may make requests
+struct WebClientBucket
+{
+    uint32_t ip;          // IPv4 address as stored by IPAddress, 0 when the slot is free
+    uint32_t milliTokens; // tokens available, in thousandths so refill needs no floating point
+    uint32_t lastRefill;  // millis() when the bucket was last topped up
+};
+
 class Web
 {
 #pragma region Private
@@ -24,23 +41,10 @@ public:
 
     void begin();
     void loop();
+    void applyConfig();
 
     const char *getStyle(void) { return _style; }
 
-    char *getUser(void) { return _configUser; }
-    void setUser(const char *value)
-    {
-        strncpy(_configUser, value, 32);
-        _configUser[31] = '\0';
-    }
-
-    char *getPassword(void) { return _configPassword; }
-    void setPassword(const char *value)
-    {
-        strncpy(_configPassword, value, 32);
-        _configPassword[31] = '\0';
-    }
-
     void resetWifiManager(void);
 
     void _handleNotFound();
@@ -48,6 +52,13 @@ public:
     void _handleSaveConfig();
     void _handleResetConfig();
     void _handleReboot();
+    void _handleLogin();
+    void _handleLogout();
+    void _handleMetrics();
+    void _handleUpdate();
+    void _handleHistory();
+    void _handleUpdateUpload();
+    void _serve(route_t route, void (Web::*handler)(void));
     void telnetPrintLn(bool enabled, String message);
     void telnetPrint(bool enabled, String message);
 
@@ -57,11 +68,27 @@ public:
 
 protected:
     bool _alive;
-    char _configUser[32];     // these two might belong in WebClass
-    char _configPassword[32]; // these two might belong in WebClass
-    uint32_t _tftFileSize;
-
+    bool _updateRefused;                     // the upload in progress is not being written, e.g. no authentication
+    bool _uploadAdmission;                   // admission for the POST to /update was decided when its upload began
+    uint16_t _uploadRefusal;                 // and its 429/503, 0 when it was let through
+    uint32_t _uploadRetryAfter;              // seconds to tell the client to wait
+    WebSession _sessions[WEB_SESSION_SLOTS]; // fixed table of logged in browsers
+    WebClientBucket _buckets[HTTP_RATE_CLIENT_SLOTS]; // per-client request rate limits
+    uint8_t _inFlight;                       // requests currently inside a handler
+    bool _mdnsStarted;                       // mDNS is advertising us
+    bool _telnetStarted;                     // the telnet debug server is listening
+
+    uint16_t _admission(uint32_t clientIP, uint32_t &retryAfter);
+    uint8_t _formFlag(void);
+    void _formField(ScratchString &html, const ConfigField &field);
+    void _fieldAttributes(ScratchString &html, const ConfigField &field);
+
+    void _send(int code, const char *contentType, const String &content);
+    void _send(int code, const char *contentType, const ScratchString &content);
     bool _authenticated(void);
+    bool _checkAuth(void);
+    WebSession *_findSession(void);
+    WebSession *_createSession(void);
     void _handleTelnetClient();
     void _setupHTTP();
     void _setupMDNS();
@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+"""Answer SNTP requests from this machine's clock, for testing a node's time sync.
+
+    sudo python3 tools/ntp_server.py [--offset 3600] [--drift 200]
+
+Set the node's NTP Server to this machine. --offset skews the time served, so a
+node's "time" can be told apart from the real thing, and --drift makes the served
+clock run fast (or slow, when negative) by that many parts per million, which a
+node reports back as timeDriftPpm after a couple of syncs at least ten minutes
+apart. NTP is on port 123, so this needs to run as root.
+"""
+
+import argparse
+import socket
+import struct
+import time
+
+NTP_EPOCH = 2208988800  # seconds from 1900, where NTP counts from, to 1970
+PACKET = struct.Struct("!BBbbII4sQQQQ")
+
+
+def to_ntp(seconds):
+    return int((seconds + NTP_EPOCH) * (1 << 32))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", type=int, default=123)
+    parser.add_argument("--offset", type=float, default=0, help="seconds added to the time served")
+    parser.add_argument("--drift", type=float, default=0, help="ppm the time served gains on the real time")
+    args = parser.parse_args()
+
+    started = time.time()
+
+    def now():
+        real = time.time()
+        return real + args.offset + (real - started) * args.drift / 1e6
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", args.port))
+    print("serving SNTP on port %d, offset %gs, drift %gppm" % (args.port, args.offset, args.drift))
+    while True:
+        request, client = sock.recvfrom(1024)
+        received = now()
+        if len(request) < PACKET.size:
+            continue
+        version = (request[0] >> 3) & 0x07
+        transmitted = PACKET.unpack_from(request)[10]
+        reply = PACKET.pack(
+            (version << 3) | 4,  # no leap warning, the client's version, server mode
+            1,  # stratum: a primary reference, as far as the node is concerned
+            request[2],  # its poll interval back
+            -20,  # precision, about a microsecond
+            0,  # root delay
+            0,  # root dispersion
+            b"LOCL",
+            to_ntp(received),  # reference time
+            transmitted,  # originate: the client's own transmit time, which it checks
+            to_ntp(received),
+            to_ntp(now()),
+        )
+        sock.sendto(reply, client)
+        print("%s: %s" % (client[0], time.strftime("%Y-%m-%d %H:%M:%S", time.gmtime(received))))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,276 @@
+#!/usr/bin/env python3
+"""Build compressed and delta OTA packages for the firmware's Ota class.
+
+    python3 tools/ota_pack.py compress new.bin -o new.pkg
+    python3 tools/ota_pack.py delta old.bin new.bin -o patch.pkg
+
+A package is a 28 byte header followed by the payload:
+
+    magic "ABPK" | version u8 | flags u8 | window bits u8 | lookahead bits u8
+    image size u32 LE | MD5 of the base image (16 bytes, zero unless a delta)
+
+flags bit 0: payload is heatshrink compressed (window/lookahead bits apply)
+flags bit 1: payload is a delta against the running image, whose MD5 must match
+
+A delta is a sequence of operations, lengths and offsets as LEB128 varints:
+
+    0x01 <length> <bytes>      add literal bytes
+    0x02 <offset> <length>     copy bytes from the running image
+
+The MD5 and SHA-256 printed (and put in the MQTT command) are of the rebuilt
+image, which is what the device verifies before activating it. The package is
+decoded again here before it is written, so a packing bug cannot reach a node.
+"""
+
+import argparse
+import hashlib
+import json
+import struct
+import sys
+
+MAGIC = b"ABPK"
+VERSION = 1
+FLAG_COMPRESSED = 0x01
+FLAG_DELTA = 0x02
+HEADER = struct.Struct("<4sBBBBI16s")
+
+OP_ADD = 0x01
+OP_COPY = 0x02
+MAX_COPY = 4096  # keeps the flash work behind any single operation bounded on the device
+MIN_COPY = 12
+KEY = 8
+
+
+def varint(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return bytes(out)
+
+
+def make_delta(old, new):
+    """Greedy delta: copy runs from the old image where they match, literals elsewhere."""
+    index = {}
+    for i in range(len(old) - KEY, -1, -1):
+        index[old[i:i + KEY]] = i  # keep the earliest offset for each key
+    ops = bytearray()
+    literal = bytearray()
+    expected = None  # where the previous copy left off, matches there are tried first
+
+    def flush_literal():
+        if literal:
+            ops.extend(bytes([OP_ADD]) + varint(len(literal)) + literal)
+            literal.clear()
+
+    j = 0
+    while j < len(new):
+        best_offset, best_length = None, 0
+        for candidate in (expected, index.get(new[j:j + KEY])):
+            if candidate is None or candidate >= len(old):
+                continue
+            length = 0
+            limit = min(len(old) - candidate, len(new) - j, MAX_COPY)
+            while length < limit and old[candidate + length] == new[j + length]:
+                length += 1
+            if length > best_length:
+                best_offset, best_length = candidate, length
+        if best_length >= MIN_COPY:
+            flush_literal()
+            ops.extend(bytes([OP_COPY]) + varint(best_offset) + varint(best_length))
+            j += best_length
+            expected = best_offset + best_length
+        else:
+            literal.append(new[j])
+            j += 1
+            if expected is not None:
+                expected += 1
+    flush_literal()
+    return bytes(ops)
+
+
+def apply_delta(old, ops):
+    out = bytearray()
+    pos = 0
+
+    def read_varint():
+        nonlocal pos
+        value, shift = 0, 0
+        while True:
+            byte = ops[pos]
+            pos += 1
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value
+
+    while pos < len(ops):
+        op = ops[pos]
+        pos += 1
+        if op == OP_ADD:
+            length = read_varint()
+            out.extend(ops[pos:pos + length])
+            pos += length
+        elif op == OP_COPY:
+            offset = read_varint()
+            length = read_varint()
+            out.extend(old[offset:offset + length])
+        else:
+            raise ValueError("bad delta op %d" % op)
+    return bytes(out)
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.count = 0
+
+    def write(self, value, bits):
+        self.acc = (self.acc << bits) | value
+        self.count += bits
+        while self.count >= 8:
+            self.count -= 8
+            self.out.append((self.acc >> self.count) & 0xFF)
+        self.acc &= (1 << self.count) - 1
+
+    def finish(self):
+        if self.count:
+            self.out.append((self.acc << (8 - self.count)) & 0xFF)
+        return bytes(self.out)
+
+
+def heatshrink_compress(data, window_bits, lookahead_bits, chain=64):
+    """LZSS in heatshrink's bit format: 1+literal, or 0+(offset-1)+(count-1)."""
+    window = 1 << window_bits
+    max_count = 1 << lookahead_bits
+    # a back-reference only pays when it is shorter than the literals it replaces
+    min_count = (1 + window_bits + lookahead_bits) // 9 + 1
+    heads = {}
+    writer = BitWriter()
+    i = 0
+    while i < len(data):
+        best_length, best_offset = 0, 0
+        key = data[i:i + 3]
+        if len(key) == 3:
+            for start in reversed(heads.get(key, ())[-chain:]):
+                offset = i - start
+                if offset > window:
+                    break
+                length = 0
+                limit = min(max_count, len(data) - i)
+                while length < limit and data[start + length] == data[i + length]:
+                    length += 1
+                if length > best_length:
+                    best_length, best_offset = length, offset
+                    if length == limit:
+                        break
+        step = best_length if best_length >= min_count else 1
+        if step > 1:
+            writer.write(0, 1)
+            writer.write(best_offset - 1, window_bits)
+            writer.write(best_length - 1, lookahead_bits)
+        else:
+            writer.write(1, 1)
+            writer.write(data[i], 8)
+        for k in range(i, i + step):
+            positions = heads.setdefault(data[k:k + 3], [])
+            positions.append(k)
+            if len(positions) > 4 * chain:
+                del positions[:-chain]
+        i += step
+    return writer.finish()
+
+
+def heatshrink_decompress(data, window_bits, lookahead_bits):
+    out = bytearray()
+    acc, count, pos = 0, 0, 0
+
+    def bits(n):
+        nonlocal acc, count, pos
+        while count < n:
+            if pos >= len(data):
+                return None
+            acc = (acc << 8) | data[pos]
+            pos += 1
+            count += 8
+        count -= n
+        value = (acc >> count) & ((1 << n) - 1)
+        acc &= (1 << count) - 1
+        return value
+
+    while True:
+        tag = bits(1)
+        if tag is None:
+            break
+        if tag:
+            value = bits(8)
+            if value is None:
+                break
+            out.append(value)
+        else:
+            offset = bits(window_bits)
+            length = bits(lookahead_bits)
+            if offset is None or length is None:
+                break
+            for _ in range(length + 1):
+                out.append(out[len(out) - offset - 1])
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="mode", required=True)
+    compress = sub.add_parser("compress", help="compress a full image")
+    compress.add_argument("new")
+    delta = sub.add_parser("delta", help="patch against the image the node is running")
+    delta.add_argument("old")
+    delta.add_argument("new")
+    for p in (compress, delta):
+        p.add_argument("-o", "--output", required=True)
+        p.add_argument("-w", "--window-bits", type=int, default=10, help="4..11, the device holds a 2^11 byte window at most")
+        p.add_argument("-l", "--lookahead-bits", type=int, default=5)
+        p.add_argument("--no-compress", action="store_true", help="delta only, payload left uncompressed")
+    args = parser.parse_args()
+
+    if not 4 <= args.window_bits <= 11 or not 3 <= args.lookahead_bits < args.window_bits:
+        parser.error("window bits must be 4..11 and lookahead bits 3..window bits - 1")
+
+    new = open(args.new, "rb").read()
+    flags = 0
+    base_md5 = bytes(16)
+    old = b""
+    payload = new
+    if args.mode == "delta":
+        old = open(args.old, "rb").read()
+        flags |= FLAG_DELTA
+        base_md5 = hashlib.md5(old).digest()
+        payload = make_delta(old, new)
+    if not args.no_compress:
+        flags |= FLAG_COMPRESSED
+        payload = heatshrink_compress(payload, args.window_bits, args.lookahead_bits)
+
+    # decode the way the device will before writing anything out
+    check = payload
+    if flags & FLAG_COMPRESSED:
+        check = heatshrink_decompress(check, args.window_bits, args.lookahead_bits)
+    if flags & FLAG_DELTA:
+        check = apply_delta(old, check)
+    if check != new:
+        sys.exit("internal error: package does not rebuild the image")
+
+    header = HEADER.pack(MAGIC, VERSION, flags, args.window_bits, args.lookahead_bits, len(new), base_md5)
+    with open(args.output, "wb") as f:
+        f.write(header + payload)
+
+    size = len(header) + len(payload)
+    print("%s: %d bytes, %.1f%% of the %d byte image" % (args.output, size, 100.0 * size / len(new), len(new)), file=sys.stderr)
+    print(json.dumps({"md5": hashlib.md5(new).hexdigest(), "sha256": hashlib.sha256(new).hexdigest()}))
+
+
+if __name__ == "__main__":
+    main()
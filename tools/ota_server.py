@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""Serve firmware images over HTTP with Range support, for testing pulled OTA updates.
+
+    python3 tools/ota_server.py .pio/build/esp32dev/firmware.bin [--port 8000]
+    python3 tools/ota_server.py patch.pkg --md5 <md5> --sha256 <sha256>
+
+Prints the MQTT command that points a node at the image. Python's built in
+http.server ignores Range headers, so it cannot exercise resumed downloads.
+A node checks the hashes against the image it ends up with, which for a
+package from ota_pack.py is the rebuilt image rather than the file served, so
+pass the hashes ota_pack.py printed for it.
+"""
+
+import argparse
+import hashlib
+import http.server
+import json
+import os
+import re
+import socket
+
+PACKAGE_MAGIC = b"ABPK"  # what ota_pack.py packages start with
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", help="firmware image to serve")
+    parser.add_argument("--port", type=int, default=8000)
+    parser.add_argument("--stagger", type=int, default=0, help="seconds to spread a group rollout over")
+    parser.add_argument("--md5", help="of the image the node ends up with, instead of the file's")
+    parser.add_argument("--sha256", help="likewise")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    name = os.path.basename(args.image)
+    if image[:4] == PACKAGE_MAGIC and not (args.md5 or args.sha256):
+        parser.error("%s is an ota_pack.py package, give the --md5 and --sha256 it printed for the rebuilt image" % name)
+
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def do_GET(self):
+            if self.path.lstrip("/") != name:
+                self.send_error(404)
+                return
+            first, last = 0, len(image) - 1
+            match = re.match(r"bytes=(\d+)-(\d*)$", self.headers.get("Range", ""))
+            if match:
+                first = int(match.group(1))
+                if match.group(2):
+                    last = min(int(match.group(2)), last)
+                if first > last:
+                    self.send_error(416)
+                    return
+                self.send_response(206)
+                self.send_header("Content-Range", "bytes %d-%d/%d" % (first, last, len(image)))
+            else:
+                self.send_response(200)
+            self.send_header("Content-Type", "application/octet-stream")
+            self.send_header("Content-Length", str(last - first + 1))
+            self.end_headers()
+            self.wfile.write(image[first:last + 1])
+
+    host = socket.gethostbyname(socket.gethostname())
+    command = {
+        "url": "http://%s:%d/%s" % (host, args.port, name),
+    }
+    if args.md5 or args.sha256:
+        command.update({key: value for key, value in (("md5", args.md5), ("sha256", args.sha256)) if value})
+    else:
+        command["md5"] = hashlib.md5(image).hexdigest()
+        command["sha256"] = hashlib.sha256(image).hexdigest()
+    if args.stagger:
+        command["stagger"] = args.stagger
+    print("publish to esp/<node or group>/command/ota:")
+    print(json.dumps(command))
+    http.server.ThreadingHTTPServer(("", args.port), Handler).serve_forever()
+
+
+if __name__ == "__main__":
+    main()